@@ -0,0 +1,247 @@
+/*
+ * Module microbenchmark.
+ *
+ * Generates a synthetic filesystem tree (-g <dir>) and drives the acquisition
+ * of every loaded module against it (-R <dir>), reporting the time and the
+ * number of allocations per cycle and the peak resident set size.
+ */
+
+#include <errno.h>
+#include <libre/scheduler.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "accounting.h"
+#include "modules.h"
+
+#define BENCH_PIDS 10000
+#define BENCH_SOCKETS 100000
+#define BENCH_LEASES 100000
+#define BENCH_CPUS 256
+#define BENCH_DISKS 64
+#define BENCH_CYCLES 20
+
+static const char *bench_meminfo[] = {
+  "MemTotal", "MemFree", "MemAvailable", "Buffers", "Cached", "SwapCached", "Active", "Inactive",
+  "Active(anon)", "Inactive(anon)", "Active(file)", "Inactive(file)", "Unevictable", "Mlocked",
+  "SwapTotal", "SwapFree", "Dirty", "Writeback", "AnonPages", "Mapped", "Shmem", "KReclaimable",
+  "Slab", "SReclaimable", "SUnreclaim", "KernelStack", "PageTables", "NFS_Unstable", "Bounce",
+  "WritebackTmp", "CommitLimit", "Committed_AS", "VmallocTotal", "VmallocUsed", "VmallocChunk",
+  "Percpu", "HardwareCorrupted", "AnonHugePages", "ShmemHugePages", "ShmemPmdMapped",
+  "FileHugePages", "FilePmdMapped", "HugePages_Total", "HugePages_Free", "HugePages_Rsvd",
+  "HugePages_Surp", "Hugepagesize", "Hugetlb", "DirectMap4k", "DirectMap2M", "DirectMap1G",
+  NULL
+};
+
+static FILE *bench_create(const char *root, const char *path) {
+
+  char buffer[PATH_MAX];
+  char *slash;
+
+  snprintf(buffer, sizeof(buffer), "%s/%s", root, path);
+
+  /* Create parent directories. */
+  for (slash = strchr(buffer + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    if (mkdir(buffer, 0755) < 0 && errno != EEXIST) {
+      fprintf(stderr, "ERROR: Unable to create '%s': %m\n", buffer);
+      return NULL;
+    }
+    *slash = '/';
+  }
+
+  FILE *file = fopen(buffer, "w");
+  if (!file)
+    fprintf(stderr, "ERROR: Unable to create '%s': %m\n", buffer);
+
+  return file;
+}
+
+static int bench_write(const char *root, const char *path, const char *content) {
+
+  FILE *file = bench_create(root, path);
+
+  if (!file)
+    return -1;
+
+  fputs(content, file);
+  fclose(file);
+  return 0;
+}
+
+static int bench_generate_sockets(const char *root, const char *path, int count) {
+
+  int i;
+  FILE *file = bench_create(root, path);
+
+  if (!file)
+    return -1;
+
+  fprintf(file, "  sl  local_address rem_address   st tx_queue rx_queue tr tm->when retrnsmt   uid  timeout inode\n");
+  for (i = 0; i < count; i++) {
+    fprintf(file, "%4d: 0100007F:%04X 0100007F:%04X 01 00000000:00000000 00:00000000 00000000     0        0 %d 1 0000000000000000 20 4 30 10 -1\n",
+      i, 1024 + i % 60000, 80, 100000 + i);
+  }
+
+  fclose(file);
+  return 0;
+}
+
+static int bench_generate(const char *root) {
+
+  char path[PATH_MAX];
+  FILE *file;
+  int i;
+
+  printf("Generating fixture in '%s'.\n", root);
+
+  bench_write(root, "etc/uuid", "c2b4b1c6-4f7e-4c0e-9a53-1a7b6f1f0c11\n");
+  bench_write(root, "proc/loadavg", "0.42 0.36 0.30 2/10000 12345\n");
+  bench_write(root, "proc/uptime", "123456.78 98765.43\n");
+  bench_write(root, "proc/sys/net/netfilter/nf_conntrack_count", "1234\n");
+  bench_write(root, "proc/sys/net/netfilter/nf_conntrack_max", "65536\n");
+
+  if (!(file = bench_create(root, "proc/meminfo")))
+    return -1;
+  for (i = 0; bench_meminfo[i]; i++)
+    fprintf(file, "%-16s%10d kB\n", bench_meminfo[i], 1000000 + i * 1024);
+  fclose(file);
+
+  if (!(file = bench_create(root, "proc/cpuinfo")))
+    return -1;
+  for (i = 0; i < BENCH_CPUS; i++) {
+    fprintf(file, "processor\t: %d\nvendor_id\t: GenuineIntel\ncpu family\t: 6\nmodel\t\t: 85\n", i);
+    fprintf(file, "model name\t: Intel(R) Xeon(R) Gold 6130 CPU @ 2.10GHz\nstepping\t: 4\n");
+    fprintf(file, "cpu MHz\t\t: 2100.000\ncache size\t: 22528 KB\nphysical id\t: %d\n", i / 32);
+    fprintf(file, "flags\t\t: fpu vme de pse tsc msr pae mce cx8 apic sep mtrr pge mca cmov pat pse36\n\n");
+  }
+  fclose(file);
+
+  if (!(file = bench_create(root, "proc/diskstats")))
+    return -1;
+  for (i = 0; i < BENCH_DISKS; i++) {
+    fprintf(file, "   8 %7d sd%c%c %d 10 %d 300 %d 20 %d 600 0 900 1200 0 0 0 0\n", i * 16,
+      'a' + i / 26, 'a' + i % 26, 1000 + i, 80000 + i, 2000 + i, 160000 + i);
+    fprintf(file, "   8 %7d sd%c%c1 %d 10 %d 300 %d 20 %d 600 0 900 1200 0 0 0 0\n", i * 16 + 1,
+      'a' + i / 26, 'a' + i % 26, 1000 + i, 80000 + i, 2000 + i, 160000 + i);
+    snprintf(path, sizeof(path), "sys/block/sd%c%c/stat", 'a' + i / 26, 'a' + i % 26);
+    bench_write(root, path, "");
+  }
+  fclose(file);
+
+  bench_generate_sockets(root, "proc/net/tcp", BENCH_SOCKETS);
+  bench_generate_sockets(root, "proc/net/tcp6", BENCH_SOCKETS);
+  bench_generate_sockets(root, "proc/net/udp", BENCH_SOCKETS / 10);
+  bench_generate_sockets(root, "proc/net/udp6", BENCH_SOCKETS / 10);
+
+  for (i = 1; i <= BENCH_PIDS; i++) {
+    snprintf(path, sizeof(path), "proc/%d/stat", i);
+    if (!(file = bench_create(root, path)))
+      return -1;
+    fprintf(file, "%d (worker-%d) %c 1 %d %d 0 -1 4194560 100 0 0 0 10 5 0 0 20 0 1 0 100 1000000 200\n",
+      i, i, "RSSSSSSDZTW"[i % 11], i, i);
+    fclose(file);
+  }
+
+  if (!(file = bench_create(root, "dhcp.leases")))
+    return -1;
+  for (i = 0; i < BENCH_LEASES; i++) {
+    fprintf(file, "%d 02:00:%02x:%02x:%02x:%02x 10.%d.%d.%d host-%d 01:02:00:%02x:%02x:%02x:%02x\n",
+      1700000000 + i, (i >> 24) & 0xff, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff,
+      (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff, i,
+      (i >> 24) & 0xff, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+  }
+  fclose(file);
+
+  return 0;
+}
+
+static uint64_t bench_clock_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_cycle(nodewatcher_module_t *module) {
+
+  nw_module_start_acquire_data(module);
+
+  /* Only the synchronous part of asynchronous modules is measured. */
+  if (module->sched_status == NW_MODULE_PENDING_DATA && module->hooks.cancel_acquire_data)
+    module->hooks.cancel_acquire_data(module);
+
+  /* Drop the timers the core has armed so they do not fire. */
+  nw_timer_disarm(&module->timer);
+  nw_timer_disarm(&module->supervisor.timer);
+  module->sched_status = NW_MODULE_NONE;
+}
+
+static void bench_warmup(nodewatcher_module_t *module, void *arg) {
+
+  UNUSED(arg);
+
+  /* Fill caches and module data, so output modules serialize a complete snapshot. */
+  bench_cycle(module);
+}
+
+static void bench_module(nodewatcher_module_t *module, void *arg) {
+
+  int cycles = *(int *)arg;
+  uint64_t start, elapsed = 0;
+  uint64_t before, after, bytes, allocs = 0;
+  struct rusage usage;
+  int i;
+
+  for (i = 0; i < cycles; i++) {
+    nw_accounting_counters(&before, &bytes);
+    start = bench_clock_ns();
+    bench_cycle(module);
+    elapsed += bench_clock_ns() - start;
+    nw_accounting_counters(&after, &bytes);
+    allocs += after - before;
+  }
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%-24s %14llu %14lu %14ld\n", module->name, (unsigned long long)(elapsed / cycles),
+    (unsigned long)(allocs / cycles), usage.ru_maxrss);
+}
+
+int main(int argc, char **argv) {
+
+  char c;
+  lu_args args;
+  int cycles = BENCH_CYCLES;
+
+  args.argc = argc;
+  args.argv = argv;
+
+  openlog("node-agent-bench", LOG_PID, LOG_DAEMON);
+
+  while ((c = lu_getopt(&args, "g:N:")) != EOF) {
+    switch (c) {
+      case 'g': return bench_generate(lu_getarg()) ? 1 : 0;
+      case 'N': cycles = atoi(lu_getarg()); break;
+    }
+  }
+
+  if (cycles < 1)
+    cycles = 1;
+
+  lu_init();
+
+  if (nw_module_init(&args) < 0)
+    fprintf(stderr, "WARNING: Some modules failed to initialize.\n");
+
+  nw_module_foreach(bench_warmup, NULL);
+
+  printf("%-24s %14s %14s %14s\n", "module", "ns/cycle", "allocs/cycle", "peak_rss_kb");
+  nw_module_foreach(bench_module, &cycles);
+
+  return 0;
+}
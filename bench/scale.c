@@ -0,0 +1,144 @@
+/*
+ * Core scaling benchmark.
+ *
+ * Loads 10, 100 and 1000 instances of the synthetic dummy module through
+ * nw_module_init (each count in a fresh process) and measures the cost of an
+ * acquisition cycle including core bookkeeping and rescheduling, of
+ * nw_module_get_output, of serializing the result and the resident memory.
+ */
+
+#include <libre/scheduler.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "modules.h"
+
+#define BENCH_CYCLES 20
+
+static const int bench_instances[] = { 10, 100, 1000 };
+
+static uint64_t bench_clock_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_acquire(nodewatcher_module_t *module, void *arg) {
+
+  UNUSED(arg);
+
+  /* Same as the module timer firing: it is disarmed, runs and is armed again. */
+  nw_timer_disarm(&module->timer);
+  module->sched_status = NW_MODULE_SCHEDULED;
+  nw_module_start_acquire_data(module);
+}
+
+static void bench_count(nodewatcher_module_t *module, void *arg) {
+
+  UNUSED(module);
+  (*(int *)arg)++;
+}
+
+static int bench_run(const char *moddir, int instances, const char *load, int cycles) {
+
+  char option[256];
+  char *argv[] = { "bench-scale", "-m", (char *)moddir, "-L", option, NULL };
+  lu_args args;
+  uint64_t start, init, acquire = 0, output = 0, serialize = 0;
+  size_t bytes = 0;
+  struct rusage usage;
+  int modules = 0, i;
+
+  snprintf(option, sizeof(option), "n=%d%s%s", instances, *load ? "," : "", load);
+  args.argc = 5;
+  args.argv = argv;
+
+  lu_init();
+
+  start = bench_clock_ns();
+  if (nw_module_init(&args) < 0) {
+    fprintf(stderr, "ERROR: Failed to initialize modules from '%s'!\n", moddir);
+    return -1;
+  }
+  init = bench_clock_ns() - start;
+  nw_module_foreach(bench_count, &modules);
+
+  for (i = 0; i < cycles; i++) {
+    start = bench_clock_ns();
+    nw_module_foreach(bench_acquire, NULL);
+    acquire += bench_clock_ns() - start;
+
+    start = bench_clock_ns();
+    json_object *data = nw_module_get_output();
+    output += bench_clock_ns() - start;
+
+    start = bench_clock_ns();
+    bytes = strlen(json_object_to_json_string_ext(data, JSON_C_TO_STRING_PLAIN));
+    serialize += bench_clock_ns() - start;
+
+    json_object_put(data);
+  }
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%10d %14llu %14llu %14llu %14llu %12.1f %12ld\n", modules,
+    (unsigned long long)init,
+    (unsigned long long)(acquire / cycles / modules),
+    (unsigned long long)(output / cycles),
+    (unsigned long long)(serialize / cycles),
+    serialize ? (double)bytes * cycles * 1000 / serialize : 0.0,
+    usage.ru_maxrss);
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  char c;
+  lu_args args;
+  const char *moddir = "bench/scale";
+  const char *load = "keys=16,depth=2,strlen=32";
+  int cycles = BENCH_CYCLES;
+  unsigned int i;
+  int status;
+
+  args.argc = argc;
+  args.argv = argv;
+
+  openlog("node-agent-bench", LOG_PID, LOG_DAEMON);
+
+  while ((c = lu_getopt(&args, "m:L:N:")) != EOF) {
+    switch (c) {
+      case 'm': moddir = lu_getarg(); break;
+      case 'L': load = lu_getarg(); break;
+      case 'N': cycles = atoi(lu_getarg()); break;
+    }
+  }
+
+  if (cycles < 1)
+    cycles = 1;
+
+  printf("%10s %14s %14s %14s %14s %12s %12s\n", "modules", "init_ns", "acquire_ns", "output_ns",
+    "serialize_ns", "MB/s", "peak_rss_kb");
+  fflush(stdout);
+
+  /* The module list can not be torn down, so every count runs in its own process. */
+  for (i = 0; i < sizeof(bench_instances) / sizeof(bench_instances[0]); i++) {
+    pid_t pid = fork();
+
+    if (pid < 0)
+      return 1;
+    if (pid == 0)
+      return bench_run(moddir, bench_instances[i], load, cycles) ? 1 : 0;
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+      return 1;
+  }
+
+  return 0;
+}
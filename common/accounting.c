@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "accounting.h"
+#include "modules.h"
+
+/*
+ * Memory accounting of modules.
+ *
+ * Allocations of the whole process are counted by interposing the allocator,
+ * which also covers json-c and libc, and attributed to a module by taking the
+ * difference over its acquisition. The size of module data is estimated by
+ * walking it. With -M <module>=<bytes>[:<count>] data over the given size has
+ * its lists of records cut to their first entries, halving the count until the
+ * data fits, and the number of dropped entries is reported by path.
+ */
+
+static nodewatcher_accounting_budget_t *nw_accounting_budgets = NULL;
+
+static uint64_t nw_accounting_allocs = 0;
+static uint64_t nw_accounting_bytes = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *malloc(size_t size) {
+
+  void *ptr = __libc_malloc(size);
+
+  nw_accounting_allocs++;
+  nw_accounting_bytes += malloc_usable_size(ptr);
+  return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+
+  void *ptr = __libc_calloc(nmemb, size);
+
+  nw_accounting_allocs++;
+  nw_accounting_bytes += malloc_usable_size(ptr);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+
+  ptr = __libc_realloc(ptr, size);
+
+  nw_accounting_allocs++;
+  nw_accounting_bytes += malloc_usable_size(ptr);
+  return ptr;
+}
+#endif
+
+void nw_accounting_counters(uint64_t *allocs, uint64_t *bytes) {
+
+  *allocs = nw_accounting_allocs;
+  *bytes = nw_accounting_bytes;
+}
+
+static int nw_accounting_parse(const char *arg) {
+
+  nodewatcher_accounting_budget_t *budget;
+  char *name, *limit;
+
+  name = strdup(arg);
+  limit = strchr(name, '=');
+  if (!limit) {
+    syslog(LOG_WARNING, "Invalid memory budget '%s', expected name=bytes[:count].", arg);
+    free(name);
+    return -1;
+  }
+  *limit++ = 0;
+
+  budget = malloc(sizeof(nodewatcher_accounting_budget_t));
+  budget->name = name;
+  budget->limit = strtoul(limit, &limit, 10);
+  budget->topn = *limit == ':' ? strtoul(limit + 1, NULL, 10) : NW_ACCOUNTING_DEFAULT_TOPN;
+  budget->next = nw_accounting_budgets;
+  nw_accounting_budgets = budget;
+
+  return 0;
+}
+
+int nw_accounting_init(const lu_args *args) {
+
+  char c;
+
+  while ((c = lu_getopt(args, "M:")) != EOF) {
+    switch (c) {
+      case 'M': nw_accounting_parse(lu_getarg()); break;
+    }
+  }
+
+  return 0;
+}
+
+size_t nw_accounting_json_size(json_object *object) {
+
+  size_t size = NW_ACCOUNTING_JSON_VALUE;
+  size_t i, length;
+
+  switch (json_object_get_type(object)) {
+    case json_type_null: return 0;
+    case json_type_string: return size + strlen(json_object_get_string(object)) + 1;
+    case json_type_array: {
+      length = json_object_array_length(object);
+      size += length * NW_ACCOUNTING_JSON_SLOT;
+      for (i = 0; i < length; i++)
+        size += nw_accounting_json_size(json_object_array_get_idx(object, i));
+      return size;
+    }
+    case json_type_object: {
+      size += json_object_get_object(object)->size * NW_ACCOUNTING_JSON_ENTRY;
+      json_object_object_foreach(object, key, value) {
+        size += strlen(key) + 1 + nw_accounting_json_size(value);
+      }
+      return size;
+    }
+    default: return size;
+  }
+}
+
+static void nw_accounting_omit(json_object *omitted, const char *path, size_t count) {
+
+  json_object *previous;
+
+  if (json_object_object_get_ex(omitted, path, &previous))
+    count += json_object_get_int64(previous);
+  json_object_object_add(omitted, path, json_object_new_int64(count));
+}
+
+/* Only lists of records are cut: arrays and maps (objects) whose entries are all objects. */
+static int nw_accounting_is_list(json_object *object) {
+
+  size_t i, length;
+
+  if (json_object_is_type(object, json_type_array)) {
+    length = json_object_array_length(object);
+    for (i = 0; i < length; i++) {
+      if (!json_object_is_type(json_object_array_get_idx(object, i), json_type_object))
+        return 0;
+    }
+    return length > 0;
+  }
+
+  json_object_object_foreach(object, key, value) {
+    UNUSED(key);
+    if (!json_object_is_type(value, json_type_object))
+      return 0;
+  }
+
+  return json_object_object_length(object) > 0;
+}
+
+static void nw_accounting_truncate(json_object *object, size_t topn, char *path, size_t length,
+                                   json_object *omitted) {
+
+  size_t i, count;
+  int child;
+
+  if (json_object_is_type(object, json_type_array)) {
+    count = json_object_array_length(object);
+    if (count > topn && nw_accounting_is_list(object)) {
+      json_object_array_del_idx(object, topn, count - topn);
+      nw_accounting_omit(omitted, path, count - topn);
+      count = topn;
+    }
+
+    for (i = 0; i < count; i++) {
+      child = snprintf(path + length, NW_ACCOUNTING_PATH_LENGTH - length, ".%zu", i);
+      if (child < 0 || length + child >= NW_ACCOUNTING_PATH_LENGTH)
+        break;
+      nw_accounting_truncate(json_object_array_get_idx(object, i), topn, path, length + child, omitted);
+    }
+  } else if (json_object_is_type(object, json_type_object)) {
+    /* The top level of module data is never cut, only what is below it. */
+    count = 0;
+    if (length && nw_accounting_is_list(object)) {
+      json_object_object_foreach(object, key, value) {
+        UNUSED(value);
+        if (count++ >= topn)
+          json_object_object_del(object, key);
+      }
+      if (count > topn)
+        nw_accounting_omit(omitted, path, count - topn);
+    }
+
+    json_object_object_foreach(object, key, value) {
+      child = snprintf(path + length, NW_ACCOUNTING_PATH_LENGTH - length, "%s%s", length ? "." : "", key);
+      if (child < 0 || length + child >= NW_ACCOUNTING_PATH_LENGTH)
+        continue;
+      nw_accounting_truncate(value, topn, path, length + child, omitted);
+    }
+  }
+
+  path[length] = 0;
+}
+
+json_object *nw_accounting_enforce(const char *name, json_object *object) {
+
+  nodewatcher_accounting_budget_t *budget;
+  json_object *memory = json_object_new_object();
+  json_object *omitted;
+  char path[NW_ACCOUNTING_PATH_LENGTH] = "";
+  size_t size = nw_accounting_json_size(object);
+  size_t topn;
+
+  for (budget = nw_accounting_budgets; budget; budget = budget->next) {
+    if (!strcmp(budget->name, name))
+      break;
+  }
+
+  if (budget && size > budget->limit) {
+    omitted = json_object_new_object();
+    for (topn = budget->topn;; topn /= 2) {
+      nw_accounting_truncate(object, topn, path, 0, omitted);
+      size = nw_accounting_json_size(object);
+      if (size <= budget->limit || !topn)
+        break;
+    }
+    json_object_object_add(memory, "omitted", omitted);
+  }
+
+  json_object_object_add(memory, "retained", json_object_new_int64(size));
+  if (budget)
+    json_object_object_add(memory, "limit", json_object_new_int64(budget->limit));
+
+  return memory;
+}
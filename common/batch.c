@@ -0,0 +1,375 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "batch.h"
+
+/*
+ * Batched file reader. With io_uring the opens of a batch are submitted in
+ * one system call and the reads (each hard-linked to the close of the file)
+ * in another, instead of three system calls per file. Without it, or when the
+ * kernel refuses to set up a ring or lacks these operations, files are read
+ * one by one.
+ */
+
+/*
+ * OPENAT, READ and CLOSE operations appeared together with this feature flag,
+ * the running kernel is checked for them when setting up the ring.
+ */
+#if defined(IORING_FEAT_CUR_PERSONALITY) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+  defined(__NR_io_uring_register)
+#define NW_BATCH_URING
+#endif
+
+/* Mark completions of open and close operations, other completions are reads. */
+#define NW_BATCH_OPEN (1ULL << 62)
+#define NW_BATCH_CLOSE (1ULL << 63)
+
+static void nw_batch_read_one(nodewatcher_batch_read_t *entry, int fd, int owned) {
+
+  ssize_t length;
+
+  do {
+    length = pread(fd, entry->buffer, entry->size - 1, 0);
+  } while (length < 0 && errno == EINTR);
+
+  entry->length = length < 0 ? -errno : length;
+  if (length >= 0)
+    entry->buffer[length] = 0;
+
+  if (owned)
+    close(fd);
+}
+
+static void nw_batch_read_fallback(nodewatcher_batch_read_t *reads, size_t count) {
+
+  size_t i;
+  int fd;
+
+  for (i = 0; i < count; i++) {
+    if (reads[i].fd >= 0) {
+      nw_batch_read_one(&reads[i], reads[i].fd, 0);
+      continue;
+    }
+
+    fd = open(reads[i].path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      reads[i].length = -errno;
+      continue;
+    }
+    nw_batch_read_one(&reads[i], fd, 1);
+  }
+}
+
+#ifdef NW_BATCH_URING
+typedef struct {
+  int fd;
+  void *sq;
+  size_t sq_size;
+  void *cq;
+  size_t cq_size;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+} nw_batch_ring_t;
+
+static nw_batch_ring_t nw_batch_ring = { .fd = -1 };
+/* Set once setting up a ring has failed, so it is not retried every cycle. */
+static int nw_batch_unavailable = 0;
+
+static void nw_batch_teardown(void) {
+
+  if (nw_batch_ring.sqes)
+    munmap(nw_batch_ring.sqes, nw_batch_ring.sqes_size);
+  if (nw_batch_ring.cq && nw_batch_ring.cq != nw_batch_ring.sq)
+    munmap(nw_batch_ring.cq, nw_batch_ring.cq_size);
+  if (nw_batch_ring.sq)
+    munmap(nw_batch_ring.sq, nw_batch_ring.sq_size);
+  if (nw_batch_ring.fd >= 0)
+    close(nw_batch_ring.fd);
+
+  memset(&nw_batch_ring, 0, sizeof(nw_batch_ring));
+  nw_batch_ring.fd = -1;
+}
+
+/* Checks that the kernel implements every operation a batch uses. */
+static int nw_batch_probe(int fd) {
+
+  static const unsigned char opcodes[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+  struct io_uring_probe *probe;
+  size_t i;
+  int ret;
+
+  probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+  if (!probe)
+    return -1;
+
+  ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256);
+  for (i = 0; ret >= 0 && i < sizeof(opcodes); i++) {
+    if (opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED))
+      ret = -1;
+  }
+
+  free(probe);
+  return ret < 0 ? -1 : 0;
+}
+
+static int nw_batch_setup(void) {
+
+  struct io_uring_params params;
+  size_t sq_size, cq_size;
+  void *map;
+  int fd;
+
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, 2 * NW_BATCH_SIZE, &params);
+  if (fd < 0)
+    return -1;
+  nw_batch_ring.fd = fd;
+
+  /* Kernels before 5.6 set up rings but fail OPENAT, READ and CLOSE with -EINVAL. */
+  if (!(params.features & IORING_FEAT_CUR_PERSONALITY) || nw_batch_probe(fd) < 0) {
+    nw_batch_teardown();
+    return -1;
+  }
+
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+  map = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (map == MAP_FAILED) {
+    nw_batch_teardown();
+    return -1;
+  }
+  nw_batch_ring.sq = map;
+  nw_batch_ring.sq_size = sq_size;
+
+  nw_batch_ring.cq = map;
+  nw_batch_ring.cq_size = cq_size;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    map = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (map == MAP_FAILED) {
+      nw_batch_ring.cq = NULL;
+      nw_batch_teardown();
+      return -1;
+    }
+    nw_batch_ring.cq = map;
+  }
+
+  map = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (map == MAP_FAILED) {
+    nw_batch_teardown();
+    return -1;
+  }
+  nw_batch_ring.sqes = map;
+  nw_batch_ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  nw_batch_ring.sq_tail = (unsigned *)((char *)nw_batch_ring.sq + params.sq_off.tail);
+  nw_batch_ring.sq_mask = (unsigned *)((char *)nw_batch_ring.sq + params.sq_off.ring_mask);
+  nw_batch_ring.sq_array = (unsigned *)((char *)nw_batch_ring.sq + params.sq_off.array);
+  nw_batch_ring.cq_head = (unsigned *)((char *)nw_batch_ring.cq + params.cq_off.head);
+  nw_batch_ring.cq_tail = (unsigned *)((char *)nw_batch_ring.cq + params.cq_off.tail);
+  nw_batch_ring.cq_mask = (unsigned *)((char *)nw_batch_ring.cq + params.cq_off.ring_mask);
+  nw_batch_ring.cqes = (struct io_uring_cqe *)((char *)nw_batch_ring.cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+static struct io_uring_sqe *nw_batch_sqe(unsigned *tail) {
+
+  unsigned index = *tail & *nw_batch_ring.sq_mask;
+  struct io_uring_sqe *sqe = &nw_batch_ring.sqes[index];
+
+  nw_batch_ring.sq_array[index] = index;
+  memset(sqe, 0, sizeof(*sqe));
+  (*tail)++;
+
+  return sqe;
+}
+
+/* Submits the queued operations, storing opened and closed files in fds and read lengths in reads. */
+static int nw_batch_submit(unsigned tail, unsigned submitted, nodewatcher_batch_read_t *reads, int *fds) {
+
+  unsigned head, pending = submitted, completed = 0;
+  struct io_uring_cqe *cqe;
+  size_t i;
+  int ret;
+
+  __atomic_store_n(nw_batch_ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+  while (completed < submitted) {
+    ret = syscall(__NR_io_uring_enter, nw_batch_ring.fd, pending, submitted - completed, IORING_ENTER_GETEVENTS,
+      NULL, 0);
+    if (ret < 0 && errno != EINTR)
+      return -1;
+    if (ret > 0)
+      pending -= (unsigned)ret < pending ? (unsigned)ret : pending;
+
+    head = *nw_batch_ring.cq_head;
+    while (head != __atomic_load_n(nw_batch_ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &nw_batch_ring.cqes[head & *nw_batch_ring.cq_mask];
+      i = cqe->user_data & ~(NW_BATCH_OPEN | NW_BATCH_CLOSE);
+
+      if (cqe->user_data & NW_BATCH_OPEN)
+        fds[i] = cqe->res;
+      else if (cqe->user_data & NW_BATCH_CLOSE)
+        fds[i] = -1;
+      else
+        reads[i].length = cqe->res;
+      head++;
+      completed++;
+    }
+    __atomic_store_n(nw_batch_ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+/* Closes the files of a chunk given up on, which the fallback opens again. */
+static void nw_batch_abandon(nodewatcher_batch_read_t *reads, int *fds, size_t count) {
+
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (reads[i].fd < 0 && fds[i] >= 0)
+      close(fds[i]);
+  }
+}
+
+static int nw_batch_read_chunk(nodewatcher_batch_read_t *reads, size_t count) {
+
+  int fds[NW_BATCH_SIZE];
+  unsigned tail, submitted = 0;
+  struct io_uring_sqe *sqe;
+  size_t i;
+
+  /* Open all files at once. */
+  tail = *nw_batch_ring.sq_tail;
+  for (i = 0; i < count; i++) {
+    fds[i] = reads[i].fd;
+    if (reads[i].fd >= 0)
+      continue;
+
+    sqe = nw_batch_sqe(&tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)reads[i].path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = NW_BATCH_OPEN | i;
+    submitted++;
+  }
+
+  if (submitted && nw_batch_submit(tail, submitted, reads, fds) < 0) {
+    nw_batch_abandon(reads, fds, count);
+    return -1;
+  }
+
+  /* Opens never fail with -EINVAL on a kernel implementing them, leave such kernels to the fallback. */
+  for (i = 0; i < count; i++) {
+    if (fds[i] == -EINVAL) {
+      nw_batch_abandon(reads, fds, count);
+      return -1;
+    }
+  }
+
+  /* Read them all at once, closing the files we opened right after reading. */
+  tail = *nw_batch_ring.sq_tail;
+  submitted = 0;
+  for (i = 0; i < count; i++) {
+    if (fds[i] < 0) {
+      reads[i].length = fds[i];
+      continue;
+    }
+
+    sqe = nw_batch_sqe(&tail);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fds[i];
+    sqe->addr = (uintptr_t)reads[i].buffer;
+    sqe->len = reads[i].size - 1;
+    sqe->off = 0;
+    sqe->user_data = i;
+    submitted++;
+
+    if (reads[i].fd < 0) {
+      /* Hard links keep the close even when the read fails. */
+      sqe->flags = IOSQE_IO_HARDLINK;
+      sqe = nw_batch_sqe(&tail);
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = fds[i];
+      sqe->user_data = NW_BATCH_CLOSE | i;
+      submitted++;
+    }
+  }
+
+  if (submitted && nw_batch_submit(tail, submitted, reads, fds) < 0) {
+    nw_batch_abandon(reads, fds, count);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (reads[i].length == -EINVAL)
+      return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (reads[i].length >= 0)
+      reads[i].buffer[reads[i].length] = 0;
+  }
+
+  return 0;
+}
+#endif
+
+int nw_batch_read(nodewatcher_batch_read_t *reads, size_t count) {
+
+#ifdef NW_BATCH_URING
+  size_t offset, chunk;
+
+  if (nw_batch_ring.fd < 0 && !nw_batch_unavailable && nw_batch_setup() < 0) {
+    syslog(LOG_INFO, "io_uring is not available, reading files one by one.");
+    nw_batch_unavailable = 1;
+  }
+
+  if (nw_batch_ring.fd >= 0) {
+    for (offset = 0; offset < count; offset += chunk) {
+      chunk = count - offset < NW_BATCH_SIZE ? count - offset : NW_BATCH_SIZE;
+      if (nw_batch_read_chunk(reads + offset, chunk) < 0) {
+        /* The ring is in an unknown state or the kernel lacks an operation, do not use it again. */
+        syslog(LOG_WARNING, "io_uring batch failed, reading files one by one.");
+        nw_batch_teardown();
+        nw_batch_unavailable = 1;
+        break;
+      }
+    }
+
+    if (offset >= count)
+      return 0;
+    reads += offset;
+    count -= offset;
+  }
+#endif
+
+  nw_batch_read_fallback(reads, count);
+  return 0;
+}
@@ -0,0 +1,389 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libre/scheduler.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "history.h"
+#include "modules.h"
+
+/*
+ * Control socket. Clients send one request per line and get one JSON line back:
+ *
+ *   get [<module>]      current data of a module or of all modules
+ *   refresh [<module>]  acquire data now and reply once the acquisition is done
+ *   reload              rescan the module directory
+ *   history [<module>]  recorded history of a module or of all modules
+ *
+ * Refresh requests for a module that is already acquiring data wait for that
+ * acquisition, and data younger than the freshness window (-W) is used as is.
+ */
+
+typedef struct {
+  char *name;
+  /* Set while the acquisition the client waits for is in flight. */
+  nodewatcher_module_t *module;
+} nodewatcher_control_wait_t;
+
+typedef struct nodewatcher_control_client {
+  lu_fdn_t *fdn;
+  char buffer[NW_CONTROL_LINE_LENGTH];
+  size_t length;
+  /* Modules of the refresh request in progress. */
+  nodewatcher_control_wait_t *waits;
+  size_t count;
+  size_t pending;
+  int all;
+  struct nodewatcher_control_client *next;
+} nodewatcher_control_client_t;
+
+static char *nw_control_path = NULL;
+static time_t nw_control_window = NW_CONTROL_DEFAULT_WINDOW;
+static int nw_control_fd = -1;
+static nodewatcher_control_client_t *nw_control_clients = NULL;
+
+static void nw_control_process(nodewatcher_control_client_t *client);
+
+static void nw_control_clear(nodewatcher_control_client_t *client) {
+
+  size_t i;
+
+  for (i = 0; i < client->count; i++)
+    free(client->waits[i].name);
+
+  free(client->waits);
+  client->waits = NULL;
+  client->count = 0;
+  client->pending = 0;
+  client->all = 0;
+}
+
+static void nw_control_close(nodewatcher_control_client_t *client) {
+
+  nodewatcher_control_client_t **node;
+  int fd = client->fdn->fd;
+
+  for (node = &nw_control_clients; *node; node = &(*node)->next) {
+    if (*node == client) {
+      *node = client->next;
+      break;
+    }
+  }
+
+  lu_fd_del(client->fdn);
+  lu_task_remove((void *)client);
+  close(fd);
+
+  nw_control_clear(client);
+  free(client);
+}
+
+static int nw_control_send(nodewatcher_control_client_t *client, json_object *object) {
+
+  const char *reply = json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN);
+  size_t length = strlen(reply), offset = 0;
+  ssize_t written;
+
+  while (offset < length) {
+    written = write(client->fdn->fd, reply + offset, length - offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      break;
+    offset += written;
+  }
+
+  json_object_put(object);
+
+  if (offset < length || write(client->fdn->fd, "\n", 1) != 1) {
+    nw_control_close(client);
+    return -1;
+  }
+
+  return 0;
+}
+
+static json_object *nw_control_error(const char *message) {
+
+  json_object *object = json_object_new_object();
+
+  json_object_object_add(object, "error", json_object_new_string(message));
+  return object;
+}
+
+static json_object *nw_control_data(const char *name) {
+
+  nodewatcher_module_t *module;
+  json_object *object;
+
+  if (!name)
+    return nw_module_get_output();
+
+  module = nw_module_find(name);
+  if (!module)
+    return nw_control_error("unknown module");
+
+  object = json_object_new_object();
+  json_object_object_add(object, module->name, json_object_get(module->data));
+  return object;
+}
+
+static void nw_control_reply(void *arg) {
+
+  nodewatcher_control_client_t *client = (nodewatcher_control_client_t *)arg;
+  json_object *object;
+  size_t i;
+
+  if (client->all) {
+    object = nw_module_get_output();
+  } else {
+    /* Modules may have been unloaded meanwhile, so they are looked up again. */
+    object = json_object_new_object();
+    for (i = 0; i < client->count; i++) {
+      nodewatcher_module_t *module = nw_module_find(client->waits[i].name);
+      json_object_object_add(object, client->waits[i].name, module ? json_object_get(module->data) : NULL);
+    }
+  }
+
+  nw_control_clear(client);
+  if (nw_control_send(client, object) < 0)
+    return;
+
+  /* Serve requests that arrived while waiting. */
+  nw_control_process(client);
+}
+
+static void nw_control_wait(nodewatcher_module_t *module, void *arg) {
+
+  nodewatcher_control_client_t *client = (nodewatcher_control_client_t *)arg;
+
+  if (nw_module_refresh(module, nw_control_window) <= 0)
+    return;
+
+  client->waits[client->count].name = strdup(module->name);
+  client->waits[client->count].module = module;
+  client->count++;
+  client->pending++;
+}
+
+static void nw_control_count(nodewatcher_module_t *module, void *arg) {
+
+  UNUSED(module);
+  (*(size_t *)arg)++;
+}
+
+static void nw_control_refresh(nodewatcher_control_client_t *client, const char *name) {
+
+  nodewatcher_module_t *module;
+  size_t modules = 0;
+
+  if (name) {
+    module = nw_module_find(name);
+    if (!module) {
+      nw_control_send(client, nw_control_error("unknown module"));
+      return;
+    }
+
+    client->waits = calloc(1, sizeof(nodewatcher_control_wait_t));
+    client->waits[0].name = strdup(module->name);
+    client->count = 1;
+
+    if (nw_module_refresh(module, nw_control_window) > 0) {
+      client->waits[0].module = module;
+      client->pending = 1;
+    }
+  } else {
+    nw_module_foreach(nw_control_count, &modules);
+    client->waits = calloc(modules, sizeof(nodewatcher_control_wait_t));
+    client->all = 1;
+    nw_module_foreach(nw_control_wait, client);
+  }
+
+  if (!client->pending)
+    nw_control_reply(client);
+}
+
+static void nw_control_finished(nodewatcher_module_t *module, void *arg) {
+
+  nodewatcher_control_client_t *client;
+  size_t i;
+
+  UNUSED(arg);
+
+  for (client = nw_control_clients; client; client = client->next) {
+    for (i = 0; i < client->count; i++) {
+      if (client->waits[i].module != module)
+        continue;
+
+      client->waits[i].module = NULL;
+      client->pending--;
+
+      /* Reply from the event loop, not from within the module. */
+      if (!client->pending)
+        lu_task_insert(0, nw_control_reply, (void *)client);
+    }
+  }
+}
+
+static void nw_control_process(nodewatcher_control_client_t *client) {
+
+  char *newline, *command, *name, *saveptr;
+  char line[NW_CONTROL_LINE_LENGTH];
+  size_t length;
+
+  while (!client->count && (newline = memchr(client->buffer, '\n', client->length))) {
+    length = newline - client->buffer;
+    memcpy(line, client->buffer, length);
+    line[length] = 0;
+    client->length -= length + 1;
+    memmove(client->buffer, newline + 1, client->length);
+
+    command = strtok_r(line, " \t\r", &saveptr);
+    if (!command)
+      continue;
+    name = strtok_r(NULL, " \t\r", &saveptr);
+    if (name && !strcmp(name, "all"))
+      name = NULL;
+
+    if (!strcmp(command, "get")) {
+      if (nw_control_send(client, nw_control_data(name)) < 0)
+        return;
+    } else if (!strcmp(command, "refresh")) {
+      nw_control_refresh(client, name);
+      /* The client may have been closed while replying. */
+      return;
+    } else if (!strcmp(command, "history")) {
+      if (nw_control_send(client, nw_history_query(name)) < 0)
+        return;
+    } else if (!strcmp(command, "reload")) {
+      json_object *object = json_object_new_object();
+
+      json_object_object_add(object, "status", json_object_new_string(nw_module_reload() ? "partial" : "ok"));
+      if (nw_control_send(client, object) < 0)
+        return;
+    } else {
+      if (nw_control_send(client, nw_control_error("unknown command")) < 0)
+        return;
+    }
+  }
+}
+
+static void nw_control_recv(void *arg) {
+
+  nodewatcher_control_client_t *client = (nodewatcher_control_client_t *)arg;
+  ssize_t length;
+
+  if (client->length == sizeof(client->buffer)) {
+    syslog(LOG_WARNING, "Control request too long, dropping client.");
+    nw_control_close(client);
+    return;
+  }
+
+  length = read(client->fdn->fd, client->buffer + client->length, sizeof(client->buffer) - client->length);
+  if (length <= 0) {
+    if (length < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    nw_control_close(client);
+    return;
+  }
+
+  client->length += length;
+  nw_control_process(client);
+}
+
+static void nw_control_accept(void *arg) {
+
+  nodewatcher_control_client_t *client;
+  struct timeval timeout = { NW_CONTROL_SEND_TIMEOUT, 0 };
+  lu_fdn_t fdn;
+
+  UNUSED(arg);
+
+  fdn.fd = accept(nw_control_fd, NULL, NULL);
+  if (fdn.fd < 0)
+    return;
+
+  client = calloc(1, sizeof(nodewatcher_control_client_t));
+  if (!client) {
+    close(fdn.fd);
+    return;
+  }
+
+  /* Replies are written in one go, but a stuck client must not stall the loop for long. */
+  setsockopt(fdn.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  fcntl(fdn.fd, F_SETFD, FD_CLOEXEC);
+
+  fdn.recv = nw_control_recv;
+  fdn.options = LS_READ;
+  fdn.data = client;
+
+  client->fdn = lu_fd_add(&fdn);
+  client->next = nw_control_clients;
+  nw_control_clients = client;
+}
+
+int nw_control_init(const lu_args *args) {
+
+  char c;
+  struct sockaddr_un address;
+  lu_fdn_t fdn;
+  mode_t pmask;
+
+  while ((c = lu_getopt(args, "C:W:")) != EOF) {
+    switch (c) {
+      case 'C':
+        if (nw_control_path)
+          free(nw_control_path);
+        nw_control_path = strdup(lu_getarg());
+        break;
+      case 'W': nw_control_window = atoi(lu_getarg()); break;
+    }
+  }
+
+  if (!nw_control_path)
+    return 0;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(nw_control_path) >= sizeof(address.sun_path)) {
+    syslog(LOG_WARNING, "Control socket path '%s' is too long!", nw_control_path);
+    return -1;
+  }
+  strcpy(address.sun_path, nw_control_path);
+
+  nw_control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (nw_control_fd < 0) {
+    syslog(LOG_WARNING, "Could not create control socket.");
+    return -1;
+  }
+
+  /* Only the owner may talk to the agent. */
+  unlink(nw_control_path);
+  pmask = umask(0077);
+  if (bind(nw_control_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(nw_control_fd, 8) < 0) {
+    umask(pmask);
+    syslog(LOG_WARNING, "Could not listen on control socket '%s': %m", nw_control_path);
+    close(nw_control_fd);
+    nw_control_fd = -1;
+    return -1;
+  }
+  umask(pmask);
+
+  fdn.fd = nw_control_fd;
+  fdn.recv = nw_control_accept;
+  fdn.options = LS_READ;
+  fdn.data = NULL;
+  lu_fd_add(&fdn);
+
+  nw_module_add_listener(nw_control_finished, NULL);
+
+  syslog(LOG_INFO, "Listening for control requests on '%s'.", nw_control_path);
+
+  return 0;
+}
@@ -0,0 +1,568 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libre/scheduler.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "exporter.h"
+#include "modules.h"
+
+/*
+ * Prometheus text exposition of module data over HTTP (-X [address:]port).
+ * Numeric and boolean leaves become gauges named after their path, prefixed
+ * with the module name without "core.". Objects whose members are all
+ * objects are maps, and so are arrays of objects: their entries add a label
+ * named after the singular of the key, holding the map key or, for arrays,
+ * labels from the string members of each element. Neighbours of
+ * core.routing.babel become
+ * routing_babel_neighbour_rxcost{address="...",interface="..."}.
+ *
+ * Modules are rendered when they finish an acquisition and the text is kept
+ * until the next one, so scrapes only concatenate cached text.
+ */
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} nw_exporter_buffer_t;
+
+typedef struct {
+  char *name;
+  nodewatcher_module_t *module;
+  unsigned int runs;
+  nw_exporter_buffer_t text;
+} nw_exporter_entry_t;
+
+typedef struct {
+  char *family;
+  /* Shared by all samples of the same map entry or array element. */
+  const char *labels;
+  json_object *value;
+  size_t order;
+} nw_exporter_sample_t;
+
+typedef struct {
+  nw_exporter_sample_t *samples;
+  size_t count;
+  size_t capacity;
+  /* Label sets rendered for this module. */
+  char **labels;
+  size_t label_count;
+  size_t label_capacity;
+} nw_exporter_render_t;
+
+/* A scrape in progress, with its own copy of the reply. */
+typedef struct {
+  int fd;
+  lu_fdn_t *fdn;
+  nw_exporter_buffer_t reply;
+  size_t offset;
+} nw_exporter_client_t;
+
+static nw_exporter_entry_t *nw_exporter_entries = NULL;
+static size_t nw_exporter_count = 0;
+static int nw_exporter_fd = -1;
+static size_t nw_exporter_clients = 0;
+
+static void nw_exporter_walk(nw_exporter_render_t *render, json_object *object, const char *name, const char *labels);
+
+static int nw_exporter_reserve(nw_exporter_buffer_t *buffer, size_t length) {
+
+  char *data;
+  size_t capacity;
+
+  if (buffer->length + length < buffer->capacity)
+    return 0;
+
+  capacity = buffer->capacity ? buffer->capacity : 1024;
+  while (capacity <= buffer->length + length)
+    capacity *= 2;
+
+  data = realloc(buffer->data, capacity);
+  if (!data)
+    return -1;
+  buffer->data = data;
+  buffer->capacity = capacity;
+
+  return 0;
+}
+
+static void nw_exporter_append(nw_exporter_buffer_t *buffer, const char *string, size_t length) {
+
+  if (nw_exporter_reserve(buffer, length) < 0)
+    return;
+
+  memcpy(buffer->data + buffer->length, string, length);
+  buffer->length += length;
+  buffer->data[buffer->length] = 0;
+}
+
+static void nw_exporter_append_string(nw_exporter_buffer_t *buffer, const char *string) {
+
+  nw_exporter_append(buffer, string, strlen(string));
+}
+
+/* Appends a name component, replacing characters that are not allowed in metric and label names. */
+static void nw_exporter_append_name(nw_exporter_buffer_t *buffer, const char *name, size_t length) {
+
+  size_t i;
+  char c;
+
+  for (i = 0; i < length; i++) {
+    c = name[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+      c = '_';
+    nw_exporter_append(buffer, &c, 1);
+  }
+}
+
+/* Length of the singular of a key, "neighbours" gives "neighbour". */
+static size_t nw_exporter_singular(const char *key) {
+
+  size_t length = strlen(key);
+
+  if (length > 1 && key[length - 1] == 's')
+    length--;
+
+  return length;
+}
+
+static void nw_exporter_append_label(nw_exporter_buffer_t *buffer, const char *name, size_t length, const char *value) {
+
+  if (buffer->length)
+    nw_exporter_append(buffer, ",", 1);
+  nw_exporter_append_name(buffer, name, length);
+  nw_exporter_append(buffer, "=\"", 2);
+
+  for (; *value; value++) {
+    switch (*value) {
+      case '\\': nw_exporter_append(buffer, "\\\\", 2); break;
+      case '"': nw_exporter_append(buffer, "\\\"", 2); break;
+      case '\n': nw_exporter_append(buffer, "\\n", 2); break;
+      default: nw_exporter_append(buffer, value, 1); break;
+    }
+  }
+  nw_exporter_append(buffer, "\"", 1);
+}
+
+static const char *nw_exporter_keep_labels(nw_exporter_render_t *render, nw_exporter_buffer_t *buffer) {
+
+  char **labels;
+
+  if (render->label_count == render->label_capacity) {
+    labels = realloc(render->labels, (render->label_capacity ? render->label_capacity * 2 : 16) * sizeof(char *));
+    if (!labels) {
+      free(buffer->data);
+      return NULL;
+    }
+    render->labels = labels;
+    render->label_capacity = render->label_capacity ? render->label_capacity * 2 : 16;
+  }
+
+  render->labels[render->label_count++] = buffer->data;
+  return buffer->data;
+}
+
+static void nw_exporter_add_sample(nw_exporter_render_t *render, const char *name, const char *labels,
+  json_object *value) {
+
+  nw_exporter_sample_t *samples;
+
+  if (render->count == render->capacity) {
+    samples = realloc(render->samples, (render->capacity ? render->capacity * 2 : 64) * sizeof(nw_exporter_sample_t));
+    if (!samples)
+      return;
+    render->samples = samples;
+    render->capacity = render->capacity ? render->capacity * 2 : 64;
+  }
+
+  render->samples[render->count].family = strdup(name);
+  render->samples[render->count].labels = labels;
+  render->samples[render->count].value = value;
+  render->samples[render->count].order = render->count;
+  render->count++;
+}
+
+static int nw_exporter_is_map(json_object *object) {
+
+  int members = 0;
+
+  json_object_object_foreach(object, key, value) {
+    UNUSED(key);
+    if (!json_object_is_type(value, json_type_object))
+      return 0;
+    members++;
+  }
+
+  return members > 0;
+}
+
+static void nw_exporter_walk_entry(nw_exporter_render_t *render, json_object *object, const char *name,
+  const char *labels, const char *key, const char *entry) {
+
+  nw_exporter_buffer_t child;
+  nw_exporter_buffer_t set;
+
+  memset(&child, 0, sizeof(child));
+  nw_exporter_append_string(&child, name);
+  nw_exporter_append(&child, "_", 1);
+  nw_exporter_append_name(&child, key, nw_exporter_singular(key));
+
+  memset(&set, 0, sizeof(set));
+  if (labels)
+    nw_exporter_append_string(&set, labels);
+
+  if (entry) {
+    /* Map entries are labelled by their key. */
+    nw_exporter_append_label(&set, key, nw_exporter_singular(key), entry);
+  } else {
+    /* Array elements are labelled by their string members. */
+    json_object_object_foreach(object, member, value) {
+      if (json_object_is_type(value, json_type_string))
+        nw_exporter_append_label(&set, member, strlen(member), json_object_get_string(value));
+    }
+  }
+
+  if (child.data && child.length < NW_EXPORTER_NAME_LENGTH)
+    nw_exporter_walk(render, object, child.data, set.data ? nw_exporter_keep_labels(render, &set) : labels);
+  else
+    free(set.data);
+  free(child.data);
+}
+
+static void nw_exporter_walk(nw_exporter_render_t *render, json_object *object, const char *name, const char *labels) {
+
+  nw_exporter_buffer_t child;
+  size_t i;
+
+  switch (json_object_get_type(object)) {
+    case json_type_boolean:
+    case json_type_int:
+    case json_type_double: nw_exporter_add_sample(render, name, labels, object); return;
+    case json_type_object: break;
+    default: return;
+  }
+
+  json_object_object_foreach(object, key, value) {
+    if (json_object_is_type(value, json_type_array)) {
+      for (i = 0; i < json_object_array_length(value); i++) {
+        json_object *element = json_object_array_get_idx(value, i);
+        if (json_object_is_type(element, json_type_object))
+          nw_exporter_walk_entry(render, element, name, labels, key, NULL);
+      }
+    } else if (json_object_is_type(value, json_type_object) && *key != '_' && nw_exporter_is_map(value)) {
+      json_object_object_foreach(value, entry, member)
+        nw_exporter_walk_entry(render, member, name, labels, key, entry);
+    } else {
+      memset(&child, 0, sizeof(child));
+      nw_exporter_append_string(&child, name);
+      nw_exporter_append(&child, "_", 1);
+      /* Keys such as _meta would give a double underscore. */
+      nw_exporter_append_name(&child, key + (*key == '_'), strlen(key + (*key == '_')));
+      if (child.data && child.length < NW_EXPORTER_NAME_LENGTH)
+        nw_exporter_walk(render, value, child.data, labels);
+      free(child.data);
+    }
+  }
+}
+
+static int nw_exporter_sample_cmp(const void *a, const void *b) {
+
+  const nw_exporter_sample_t *x = (const nw_exporter_sample_t *)a;
+  const nw_exporter_sample_t *y = (const nw_exporter_sample_t *)b;
+  int cmp = strcmp(x->family, y->family);
+
+  /* Keep the order of the data within a family. */
+  if (!cmp)
+    return (x->order > y->order) - (x->order < y->order);
+  return cmp;
+}
+
+static void nw_exporter_render(nw_exporter_entry_t *entry) {
+
+  nw_exporter_render_t render;
+  nw_exporter_buffer_t prefix;
+  const char *name = entry->module->name;
+  char value[32];
+  size_t i;
+
+  memset(&render, 0, sizeof(render));
+  memset(&prefix, 0, sizeof(prefix));
+  if (!strncmp(name, "core.", 5))
+    name += 5;
+  nw_exporter_append_name(&prefix, name, strlen(name));
+  if (!prefix.data)
+    return;
+
+  nw_exporter_walk(&render, entry->module->data, prefix.data, NULL);
+  free(prefix.data);
+
+  /* Samples of a family must be listed together. */
+  qsort(render.samples, render.count, sizeof(nw_exporter_sample_t), nw_exporter_sample_cmp);
+
+  entry->text.length = 0;
+  for (i = 0; i < render.count; i++) {
+    nw_exporter_sample_t *sample = &render.samples[i];
+
+    if (!i || strcmp(sample->family, render.samples[i - 1].family)) {
+      nw_exporter_append_string(&entry->text, "# TYPE ");
+      nw_exporter_append_string(&entry->text, sample->family);
+      nw_exporter_append_string(&entry->text, " gauge\n");
+    }
+
+    nw_exporter_append_string(&entry->text, sample->family);
+    if (sample->labels) {
+      nw_exporter_append(&entry->text, "{", 1);
+      nw_exporter_append_string(&entry->text, sample->labels);
+      nw_exporter_append(&entry->text, "}", 1);
+    }
+
+    if (json_object_is_type(sample->value, json_type_double))
+      snprintf(value, sizeof(value), " %.15g\n", json_object_get_double(sample->value));
+    else
+      snprintf(value, sizeof(value), " %lld\n", (long long)json_object_get_int64(sample->value));
+    nw_exporter_append_string(&entry->text, value);
+  }
+
+  for (i = 0; i < render.count; i++)
+    free(render.samples[i].family);
+  for (i = 0; i < render.label_count; i++)
+    free(render.labels[i]);
+  free(render.samples);
+  free(render.labels);
+}
+
+static nw_exporter_entry_t *nw_exporter_entry(nodewatcher_module_t *module) {
+
+  nw_exporter_entry_t *entries;
+  size_t i;
+
+  for (i = 0; i < nw_exporter_count; i++) {
+    if (!strcmp(nw_exporter_entries[i].name, module->name))
+      return &nw_exporter_entries[i];
+  }
+
+  entries = realloc(nw_exporter_entries, (nw_exporter_count + 1) * sizeof(nw_exporter_entry_t));
+  if (!entries)
+    return NULL;
+  nw_exporter_entries = entries;
+
+  memset(&entries[nw_exporter_count], 0, sizeof(nw_exporter_entry_t));
+  entries[nw_exporter_count].name = strdup(module->name);
+  return &entries[nw_exporter_count++];
+}
+
+static void nw_exporter_finished(nodewatcher_module_t *module, void *arg) {
+
+  nw_exporter_entry_t *entry;
+
+  UNUSED(arg);
+
+  /* Failed or cancelled acquisitions leave the data as it was. */
+  entry = nw_exporter_entry(module);
+  if (!entry || (entry->module == module && entry->runs == module->stats.runs) || !module->data)
+    return;
+
+  entry->module = module;
+  entry->runs = module->stats.runs;
+  nw_exporter_render(entry);
+}
+
+static void nw_exporter_close(nw_exporter_client_t *client) {
+
+  if (client->fdn)
+    lu_fd_del(client->fdn);
+  lu_task_remove((void *)client);
+  close(client->fd);
+
+  free(client->reply.data);
+  free(client);
+  nw_exporter_clients--;
+}
+
+static void nw_exporter_expire(void *arg) {
+
+  nw_exporter_close((nw_exporter_client_t *)arg);
+}
+
+/* Sends as much of the reply as the socket takes, the rest when it is writable again. */
+static void nw_exporter_send(void *arg) {
+
+  nw_exporter_client_t *client = (nw_exporter_client_t *)arg;
+  ssize_t written;
+
+  written = write(client->fd, client->reply.data + client->offset, client->reply.length - client->offset);
+  if (written < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (written > 0)
+    client->offset += written;
+  if (written <= 0 || client->offset == client->reply.length)
+    nw_exporter_close(client);
+}
+
+static int nw_exporter_visible(nw_exporter_entry_t *entry) {
+
+  /* Skip modules that have been unloaded. */
+  return entry->text.length && nw_module_find(entry->name) == entry->module;
+}
+
+static void nw_exporter_respond(void *arg) {
+
+  static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+  nw_exporter_client_t *client = (nw_exporter_client_t *)arg;
+  size_t i, length = sizeof(header) - 1;
+  char request[1024];
+  lu_fdn_t fdn;
+
+  /* Any request gets the metrics, the method and path do not matter. */
+  if (read(client->fd, request, sizeof(request)) < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  lu_fd_del(client->fdn);
+  client->fdn = NULL;
+
+  /* Modules may finish while the reply is sent, it is copied as it is now. */
+  for (i = 0; i < nw_exporter_count; i++) {
+    if (nw_exporter_visible(&nw_exporter_entries[i]))
+      length += nw_exporter_entries[i].text.length;
+  }
+  if (nw_exporter_reserve(&client->reply, length) < 0) {
+    nw_exporter_close(client);
+    return;
+  }
+
+  nw_exporter_append(&client->reply, header, sizeof(header) - 1);
+  for (i = 0; i < nw_exporter_count; i++) {
+    if (nw_exporter_visible(&nw_exporter_entries[i]))
+      nw_exporter_append(&client->reply, nw_exporter_entries[i].text.data, nw_exporter_entries[i].text.length);
+  }
+
+  fdn.fd = client->fd;
+  fdn.recv = nw_exporter_send;
+  fdn.options = LS_WRITE;
+  fdn.data = client;
+  client->fdn = lu_fd_add(&fdn);
+  if (!client->fdn)
+    nw_exporter_close(client);
+}
+
+static void nw_exporter_accept(void *arg) {
+
+  nw_exporter_client_t *client;
+  lu_fdn_t fdn;
+
+  UNUSED(arg);
+
+  fdn.fd = accept(nw_exporter_fd, NULL, NULL);
+  if (fdn.fd < 0)
+    return;
+  fcntl(fdn.fd, F_SETFL, fcntl(fdn.fd, F_GETFL, 0) | O_NONBLOCK);
+  fcntl(fdn.fd, F_SETFD, FD_CLOEXEC);
+
+  if (nw_exporter_clients >= NW_EXPORTER_MAX_CLIENTS || !(client = calloc(1, sizeof(nw_exporter_client_t)))) {
+    close(fdn.fd);
+    return;
+  }
+
+  client->fd = fdn.fd;
+  fdn.recv = nw_exporter_respond;
+  fdn.options = LS_READ;
+  fdn.data = client;
+  client->fdn = lu_fd_add(&fdn);
+  if (!client->fdn) {
+    close(fdn.fd);
+    free(client);
+    return;
+  }
+  nw_exporter_clients++;
+
+  /* The socket never blocks the loop, a scraper that stalls is dropped after a while. */
+  lu_task_insert(NW_EXPORTER_TIMEOUT, nw_exporter_expire, (void *)client);
+}
+
+int nw_exporter_init(const lu_args *args) {
+
+  struct addrinfo hints, *result;
+  char *listen_address = NULL, *host, *port;
+  int enable = 1, ret;
+  size_t length;
+  lu_fdn_t fdn;
+  char c;
+
+  while ((c = lu_getopt(args, "X:")) != EOF) {
+    switch (c) {
+      case 'X':
+        if (listen_address)
+          free(listen_address);
+        listen_address = strdup(lu_getarg());
+        break;
+    }
+  }
+
+  if (!listen_address)
+    return 0;
+
+  /* The port follows the last colon, IPv6 addresses are given in brackets. */
+  host = listen_address;
+  port = strrchr(listen_address, ':');
+  if (port) {
+    *port++ = 0;
+  } else {
+    port = listen_address;
+    host = "";
+  }
+
+  length = strlen(host);
+  if (length > 1 && host[0] == '[' && host[length - 1] == ']') {
+    host[length - 1] = 0;
+    host++;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  ret = getaddrinfo(*host ? host : NULL, port, &hints, &result);
+  if (ret) {
+    syslog(LOG_WARNING, "Could not resolve metrics address '%s': %s", host, gai_strerror(ret));
+    free(listen_address);
+    return -1;
+  }
+
+  nw_exporter_fd = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, 0);
+  if (nw_exporter_fd >= 0)
+    setsockopt(nw_exporter_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if (nw_exporter_fd < 0 || bind(nw_exporter_fd, result->ai_addr, result->ai_addrlen) < 0 ||
+      listen(nw_exporter_fd, 8) < 0) {
+    syslog(LOG_WARNING, "Could not listen for metrics requests: %m");
+    if (nw_exporter_fd >= 0)
+      close(nw_exporter_fd);
+    nw_exporter_fd = -1;
+    freeaddrinfo(result);
+    free(listen_address);
+    return -1;
+  }
+  freeaddrinfo(result);
+
+  fdn.fd = nw_exporter_fd;
+  fdn.recv = nw_exporter_accept;
+  fdn.options = LS_READ;
+  fdn.data = NULL;
+  lu_fd_add(&fdn);
+
+  nw_module_add_listener(nw_exporter_finished, NULL);
+  nw_module_foreach(nw_exporter_finished, NULL);
+
+  syslog(LOG_INFO, "Serving metrics on port %s.", port);
+  free(listen_address);
+
+  return 0;
+}
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "history.h"
+#include "modules.h"
+
+/*
+ * History of selected numeric fields, kept in a fixed amount of memory (-Y)
+ * so data survives uplink outages. Fields are given as <module>:<path>
+ * (-H, comma separated), where path walks the module data by object keys
+ * and array indices separated by dots. Every series keeps raw samples and
+ * 5 minute and 1 hour averages in rings of blocks, compressed as in Gorilla:
+ * timestamps as delta-of-deltas and values XORed with the previous one. When
+ * a ring is full the oldest block is overwritten, so coarser tiers reach
+ * further back in time.
+ */
+
+static nodewatcher_history_series_t *nw_history_series = NULL;
+static size_t nw_history_count = 0;
+static size_t nw_history_budget = NW_HISTORY_DEFAULT_BUDGET;
+
+static void nw_history_write(nodewatcher_history_block_t *block, uint64_t value, int count) {
+
+  while (count-- > 0) {
+    if ((value >> count) & 1)
+      block->data[block->bits >> 3] |= 0x80 >> (block->bits & 7);
+    block->bits++;
+  }
+}
+
+static uint64_t nw_history_read(const nodewatcher_history_block_t *block, size_t *position, int count) {
+
+  uint64_t value = 0;
+
+  while (count-- > 0) {
+    value = (value << 1) | ((block->data[*position >> 3] >> (7 - (*position & 7))) & 1);
+    (*position)++;
+  }
+
+  return value;
+}
+
+static void nw_history_start_block(nodewatcher_history_tier_t *tier, int64_t time, uint64_t value) {
+
+  nodewatcher_history_block_t *block;
+
+  if (tier->used) {
+    tier->head = (tier->head + 1) % tier->capacity;
+    if (tier->used < tier->capacity)
+      tier->used++;
+  } else {
+    tier->used = 1;
+  }
+
+  block = &tier->blocks[tier->head];
+  memset(block, 0, sizeof(nodewatcher_history_block_t));
+  block->time = time;
+  block->value = value;
+  block->count = 1;
+
+  tier->time = time;
+  tier->delta = 0;
+  tier->value = value;
+  tier->leading = -1;
+  tier->trailing = 0;
+}
+
+static void nw_history_append(nodewatcher_history_tier_t *tier, int64_t time, double number) {
+
+  nodewatcher_history_block_t *block = &tier->blocks[tier->head];
+  int64_t delta, dod;
+  uint64_t value, x;
+  int leading, trailing;
+
+  memcpy(&value, &number, sizeof(value));
+
+  delta = time - tier->time;
+  dod = delta - tier->delta;
+
+  /* Start over when the block might not fit the worst case of 113 bits, or time jumped too far. */
+  if (!tier->used || block->count == UINT16_MAX || block->bits + 113 > NW_HISTORY_BLOCK_SIZE * 8 ||
+      dod < INT32_MIN || dod > INT32_MAX) {
+    nw_history_start_block(tier, time, value);
+    return;
+  }
+
+  if (dod == 0) {
+    nw_history_write(block, 0, 1);
+  } else if (dod >= -63 && dod <= 64) {
+    nw_history_write(block, 2, 2);
+    nw_history_write(block, dod + 63, 7);
+  } else if (dod >= -255 && dod <= 256) {
+    nw_history_write(block, 6, 3);
+    nw_history_write(block, dod + 255, 9);
+  } else if (dod >= -2047 && dod <= 2048) {
+    nw_history_write(block, 14, 4);
+    nw_history_write(block, dod + 2047, 12);
+  } else {
+    nw_history_write(block, 15, 4);
+    nw_history_write(block, (uint32_t)dod, 32);
+  }
+
+  x = value ^ tier->value;
+  if (!x) {
+    nw_history_write(block, 0, 1);
+  } else {
+    leading = __builtin_clzll(x);
+    trailing = __builtin_ctzll(x);
+    if (leading > 31)
+      leading = 31;
+
+    if (tier->leading >= 0 && leading >= tier->leading && trailing >= tier->trailing) {
+      /* Meaningful bits fit into the previous window. */
+      nw_history_write(block, 2, 2);
+      nw_history_write(block, x >> tier->trailing, 64 - tier->leading - tier->trailing);
+    } else {
+      nw_history_write(block, 3, 2);
+      nw_history_write(block, leading, 5);
+      nw_history_write(block, 64 - leading - trailing - 1, 6);
+      nw_history_write(block, x >> trailing, 64 - leading - trailing);
+      tier->leading = leading;
+      tier->trailing = trailing;
+    }
+  }
+
+  tier->time = time;
+  tier->delta = delta;
+  tier->value = value;
+  block->count++;
+}
+
+static json_object *nw_history_decode(const nodewatcher_history_tier_t *tier) {
+
+  json_object *samples = json_object_new_array();
+  const nodewatcher_history_block_t *block;
+  int64_t time, delta, dod;
+  uint64_t value, x;
+  int leading, trailing, length;
+  size_t i, position;
+  unsigned int j;
+
+  for (i = 0; i < tier->used; i++) {
+    block = &tier->blocks[(tier->head + tier->capacity - tier->used + 1 + i) % tier->capacity];
+    time = block->time;
+    value = block->value;
+    delta = 0;
+    leading = trailing = 0;
+    position = 0;
+
+    for (j = 0; j < block->count; j++) {
+      if (j) {
+        if (!nw_history_read(block, &position, 1))
+          dod = 0;
+        else if (!nw_history_read(block, &position, 1))
+          dod = (int64_t)nw_history_read(block, &position, 7) - 63;
+        else if (!nw_history_read(block, &position, 1))
+          dod = (int64_t)nw_history_read(block, &position, 9) - 255;
+        else if (!nw_history_read(block, &position, 1))
+          dod = (int64_t)nw_history_read(block, &position, 12) - 2047;
+        else
+          dod = (int32_t)(uint32_t)nw_history_read(block, &position, 32);
+        delta += dod;
+        time += delta;
+
+        if (nw_history_read(block, &position, 1)) {
+          if (nw_history_read(block, &position, 1)) {
+            leading = nw_history_read(block, &position, 5);
+            length = nw_history_read(block, &position, 6) + 1;
+            trailing = 64 - leading - length;
+          }
+          x = nw_history_read(block, &position, 64 - leading - trailing) << trailing;
+          value ^= x;
+        }
+      }
+
+      double number;
+      memcpy(&number, &value, sizeof(number));
+
+      json_object *sample = json_object_new_array();
+      json_object_array_add(sample, json_object_new_int64(time));
+      json_object_array_add(sample, json_object_new_double(number));
+      json_object_array_add(samples, sample);
+    }
+  }
+
+  return samples;
+}
+
+static void nw_history_add(nodewatcher_history_series_t *series, int64_t time, double number) {
+
+  nodewatcher_history_tier_t *tier;
+  int64_t bucket;
+  size_t i;
+
+  nw_history_append(&series->tiers[0], time, number);
+
+  for (i = 1; i < NW_HISTORY_TIERS; i++) {
+    tier = &series->tiers[i];
+    bucket = time - time % tier->resolution;
+
+    /* A sample of a new bucket closes the previous one. */
+    if (tier->samples && bucket != tier->bucket) {
+      nw_history_append(tier, tier->bucket, tier->sum / tier->samples);
+      tier->samples = 0;
+      tier->sum = 0;
+    }
+
+    tier->bucket = bucket;
+    tier->sum += number;
+    tier->samples++;
+  }
+}
+
+static int nw_history_lookup(json_object *object, const char *path, double *number) {
+
+  char buffer[256], *key, *end, *saveptr;
+  long index;
+
+  snprintf(buffer, sizeof(buffer), "%s", path);
+  for (key = strtok_r(buffer, ".", &saveptr); key && object; key = strtok_r(NULL, ".", &saveptr)) {
+    if (json_object_is_type(object, json_type_array)) {
+      index = strtol(key, &end, 10);
+      object = *end || index < 0 ? NULL : json_object_array_get_idx(object, index);
+    } else if (!json_object_object_get_ex(object, key, &object)) {
+      object = NULL;
+    }
+  }
+
+  if (!object || !(json_object_is_type(object, json_type_int) || json_object_is_type(object, json_type_double)))
+    return -1;
+
+  *number = json_object_get_double(object);
+  return 0;
+}
+
+static void nw_history_record(nodewatcher_module_t *module, void *arg) {
+
+  nodewatcher_history_series_t *series;
+  double number;
+  size_t i;
+
+  UNUSED(arg);
+
+  for (i = 0; i < nw_history_count; i++) {
+    series = &nw_history_series[i];
+    if (strcmp(series->module, module->name))
+      continue;
+
+    /* Only completed acquisitions bring new data. */
+    if (series->runs == module->stats.runs)
+      continue;
+    series->runs = module->stats.runs;
+
+    if (nw_history_lookup(module->data, series->path, &number) < 0)
+      continue;
+    nw_history_add(series, module->supervisor.last_success, number);
+  }
+}
+
+json_object *nw_history_query(const char *module) {
+
+  static const char *names[NW_HISTORY_TIERS] = NW_HISTORY_TIER_NAMES;
+  json_object *object = json_object_new_object();
+  char name[512];
+  size_t i, j;
+
+  for (i = 0; i < nw_history_count; i++) {
+    nodewatcher_history_series_t *series = &nw_history_series[i];
+
+    if (module && strcmp(series->module, module))
+      continue;
+
+    json_object *tiers = json_object_new_object();
+    for (j = 0; j < NW_HISTORY_TIERS; j++)
+      json_object_object_add(tiers, names[j], nw_history_decode(&series->tiers[j]));
+
+    snprintf(name, sizeof(name), "%s:%s", series->module, series->path);
+    json_object_object_add(object, name, tiers);
+  }
+
+  return object;
+}
+
+static int nw_history_parse(const char *arg) {
+
+  nodewatcher_history_series_t *series;
+  char *specs, *spec, *path, *saveptr;
+
+  specs = strdup(arg);
+  for (spec = strtok_r(specs, ",", &saveptr); spec; spec = strtok_r(NULL, ",", &saveptr)) {
+    path = strchr(spec, ':');
+    if (!path || !path[1]) {
+      syslog(LOG_WARNING, "Invalid history series '%s', expected module:path.", spec);
+      continue;
+    }
+    *path++ = 0;
+
+    series = realloc(nw_history_series, (nw_history_count + 1) * sizeof(nodewatcher_history_series_t));
+    if (!series)
+      break;
+    nw_history_series = series;
+
+    series = &nw_history_series[nw_history_count++];
+    memset(series, 0, sizeof(nodewatcher_history_series_t));
+    series->module = strdup(spec);
+    series->path = strdup(path);
+  }
+  free(specs);
+
+  return 0;
+}
+
+int nw_history_init(const lu_args *args) {
+
+  static const time_t resolutions[NW_HISTORY_TIERS] = NW_HISTORY_RESOLUTIONS;
+  /* Raw samples get half of the memory of a series, the averages a quarter each. */
+  static const size_t shares[NW_HISTORY_TIERS] = { 2, 1, 1 };
+  size_t i, j, blocks;
+  char c;
+
+  while ((c = lu_getopt(args, "H:Y:")) != EOF) {
+    switch (c) {
+      case 'H': nw_history_parse(lu_getarg()); break;
+      case 'Y': nw_history_budget = strtoul(lu_getarg(), NULL, 10); break;
+    }
+  }
+
+  if (!nw_history_count)
+    return 0;
+
+  for (i = 0; i < nw_history_count; i++) {
+    for (j = 0; j < NW_HISTORY_TIERS; j++) {
+      nodewatcher_history_tier_t *tier = &nw_history_series[i].tiers[j];
+
+      /* Every ring needs a block to fill and one to keep. */
+      blocks = nw_history_budget / nw_history_count * shares[j] / 4 / sizeof(nodewatcher_history_block_t);
+      tier->capacity = blocks < 2 ? 2 : blocks;
+      tier->resolution = resolutions[j];
+      tier->blocks = calloc(tier->capacity, sizeof(nodewatcher_history_block_t));
+      if (!tier->blocks) {
+        syslog(LOG_ERR, "Unable to allocate history of '%s'.", nw_history_series[i].path);
+        return -1;
+      }
+    }
+  }
+
+  nw_module_add_listener(nw_history_record, NULL);
+  syslog(LOG_INFO, "Keeping history of %zu series in %zu bytes.", nw_history_count, nw_history_budget);
+
+  return 0;
+}
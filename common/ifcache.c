@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <libre/scheduler.h>
+#include <linux/if_addr.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "ifcache.h"
+
+/*
+ * Interface and address cache. The first user dumps the kernel's link and
+ * address tables once, after which the cache follows link and address
+ * notifications from the event loop. Every change bumps the generation, so
+ * users can keep derived data until it changes.
+ */
+
+/* Links sorted by index. */
+static nodewatcher_ifcache_link_t *nw_ifcache_links = NULL;
+static size_t nw_ifcache_link_count = 0;
+static size_t nw_ifcache_link_capacity = 0;
+
+static nodewatcher_ifcache_addr_t *nw_ifcache_addrs = NULL;
+static size_t nw_ifcache_addr_count = 0;
+static size_t nw_ifcache_addr_capacity = 0;
+
+static int nw_ifcache_fd = -1;
+static uint32_t nw_ifcache_seq = 0;
+static uint64_t nw_ifcache_gen = 0;
+
+static int nw_ifcache_grow(void **items, size_t *capacity, size_t count, size_t size) {
+
+  void *resized;
+
+  if (count < *capacity)
+    return 0;
+
+  resized = realloc(*items, (*capacity ? *capacity * 2 : 16) * size);
+  if (!resized)
+    return -1;
+
+  *items = resized;
+  *capacity = *capacity ? *capacity * 2 : 16;
+  return 0;
+}
+
+/* Returns the index of the link or, if missing, where it would be inserted. */
+static size_t nw_ifcache_link_search(int index, int *found) {
+
+  size_t low = 0, high = nw_ifcache_link_count, middle;
+
+  *found = 0;
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (nw_ifcache_links[middle].index == index) {
+      *found = 1;
+      return middle;
+    }
+    if (nw_ifcache_links[middle].index < index)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+static void nw_ifcache_remove_addrs(int index) {
+
+  size_t i = 0;
+
+  while (i < nw_ifcache_addr_count) {
+    if (nw_ifcache_addrs[i].index == index)
+      nw_ifcache_addrs[i] = nw_ifcache_addrs[--nw_ifcache_addr_count];
+    else
+      i++;
+  }
+}
+
+static void nw_ifcache_parse_link(struct nlmsghdr *nlh) {
+
+  struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+  struct rtattr *rta;
+  nodewatcher_ifcache_link_t link, *entry;
+  int length = IFLA_PAYLOAD(nlh);
+  size_t position;
+  int found;
+
+  position = nw_ifcache_link_search(ifi->ifi_index, &found);
+
+  if (nlh->nlmsg_type == RTM_DELLINK) {
+    if (!found)
+      return;
+    nw_ifcache_remove_addrs(ifi->ifi_index);
+    memmove(&nw_ifcache_links[position], &nw_ifcache_links[position + 1],
+      (nw_ifcache_link_count - position - 1) * sizeof(nodewatcher_ifcache_link_t));
+    nw_ifcache_link_count--;
+    nw_ifcache_gen++;
+    return;
+  }
+
+  memset(&link, 0, sizeof(link));
+  link.index = ifi->ifi_index;
+  link.flags = ifi->ifi_flags;
+
+  for (rta = IFLA_RTA(ifi); RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+    switch (rta->rta_type) {
+      case IFLA_IFNAME: strncpy(link.name, RTA_DATA(rta), sizeof(link.name) - 1); break;
+      case IFLA_MTU: link.mtu = *(uint32_t *)RTA_DATA(rta); break;
+      case IFLA_OPERSTATE: link.operstate = *(uint8_t *)RTA_DATA(rta); break;
+      case IFLA_ADDRESS: {
+        if (RTA_PAYLOAD(rta) > sizeof(link.address))
+          break;
+        link.address_length = RTA_PAYLOAD(rta);
+        memcpy(link.address, RTA_DATA(rta), link.address_length);
+        break;
+      }
+    }
+  }
+
+  if (found) {
+    entry = &nw_ifcache_links[position];
+    if (!memcmp(entry, &link, sizeof(link)))
+      return;
+  } else {
+    if (nw_ifcache_grow((void **)&nw_ifcache_links, &nw_ifcache_link_capacity, nw_ifcache_link_count,
+        sizeof(nodewatcher_ifcache_link_t)))
+      return;
+    entry = &nw_ifcache_links[position];
+    memmove(entry + 1, entry, (nw_ifcache_link_count - position) * sizeof(nodewatcher_ifcache_link_t));
+    nw_ifcache_link_count++;
+  }
+
+  *entry = link;
+  nw_ifcache_gen++;
+}
+
+static void nw_ifcache_parse_addr(struct nlmsghdr *nlh) {
+
+  struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+  struct rtattr *rta;
+  nodewatcher_ifcache_addr_t addr;
+  int length = IFA_PAYLOAD(nlh);
+  int has_address = 0, has_local = 0;
+  size_t i, size;
+
+  if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+    return;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.index = ifa->ifa_index;
+  addr.family = ifa->ifa_family;
+  addr.prefix_length = ifa->ifa_prefixlen;
+  addr.scope = ifa->ifa_scope;
+  size = ifa->ifa_family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+  /* On point-to-point links IFA_ADDRESS is the peer, IFA_LOCAL is ours. */
+  for (rta = IFA_RTA(ifa); RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+    if (RTA_PAYLOAD(rta) < size)
+      continue;
+    if (rta->rta_type == IFA_LOCAL) {
+      memcpy(&addr.address, RTA_DATA(rta), size);
+      has_local = 1;
+    } else if (rta->rta_type == IFA_ADDRESS && !has_local) {
+      memcpy(&addr.address, RTA_DATA(rta), size);
+      has_address = 1;
+    }
+  }
+
+  if (!has_address && !has_local)
+    return;
+
+  for (i = 0; i < nw_ifcache_addr_count; i++) {
+    if (!memcmp(&nw_ifcache_addrs[i], &addr, sizeof(addr)))
+      break;
+  }
+
+  if (nlh->nlmsg_type == RTM_DELADDR) {
+    if (i == nw_ifcache_addr_count)
+      return;
+    nw_ifcache_addrs[i] = nw_ifcache_addrs[--nw_ifcache_addr_count];
+  } else {
+    if (i < nw_ifcache_addr_count)
+      return;
+    if (nw_ifcache_grow((void **)&nw_ifcache_addrs, &nw_ifcache_addr_capacity, nw_ifcache_addr_count,
+        sizeof(nodewatcher_ifcache_addr_t)))
+      return;
+    nw_ifcache_addrs[nw_ifcache_addr_count++] = addr;
+  }
+
+  nw_ifcache_gen++;
+}
+
+/* Applies all messages in the buffer, returns 1 once the dump with the given sequence number is done. */
+static int nw_ifcache_parse(char *buffer, ssize_t length, uint32_t seq) {
+
+  struct nlmsghdr *nlh;
+
+  for (nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, length); nlh = NLMSG_NEXT(nlh, length)) {
+    switch (nlh->nlmsg_type) {
+      case NLMSG_DONE:
+      case NLMSG_ERROR:
+        if (seq && nlh->nlmsg_seq == seq)
+          return 1;
+        break;
+      case RTM_NEWLINK:
+      case RTM_DELLINK: nw_ifcache_parse_link(nlh); break;
+      case RTM_NEWADDR:
+      case RTM_DELADDR: nw_ifcache_parse_addr(nlh); break;
+    }
+  }
+
+  return 0;
+}
+
+static int nw_ifcache_dump(int type) {
+
+  struct {
+    struct nlmsghdr nlh;
+    struct rtgenmsg g;
+  } request;
+  struct sockaddr_nl address;
+  char buffer[NW_IFCACHE_BUFFER_SIZE];
+  ssize_t length;
+
+  memset(&request, 0, sizeof(request));
+  request.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+  request.nlh.nlmsg_type = type;
+  request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.nlh.nlmsg_seq = ++nw_ifcache_seq;
+  request.g.rtgen_family = AF_UNSPEC;
+
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+
+  if (sendto(nw_ifcache_fd, &request, request.nlh.nlmsg_len, 0, (struct sockaddr *)&address, sizeof(address)) < 0)
+    return -1;
+
+  /* Notifications arriving meanwhile are applied as well. */
+  do {
+    length = recv(nw_ifcache_fd, buffer, sizeof(buffer), 0);
+    if (length < 0)
+      return -1;
+  } while (!nw_ifcache_parse(buffer, length, nw_ifcache_seq));
+
+  return 0;
+}
+
+static int nw_ifcache_sync(void) {
+
+  nw_ifcache_link_count = 0;
+  nw_ifcache_addr_count = 0;
+  nw_ifcache_gen++;
+
+  if (nw_ifcache_dump(RTM_GETLINK) < 0 || nw_ifcache_dump(RTM_GETADDR) < 0) {
+    syslog(LOG_WARNING, "Failed to dump network interfaces.");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void nw_ifcache_recv(void *arg) {
+
+  char buffer[NW_IFCACHE_BUFFER_SIZE];
+  ssize_t length;
+
+  for (;;) {
+    length = recv(*(int *)arg, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (length < 0) {
+      /* Notifications were lost, start over from a fresh dump. */
+      if (errno == ENOBUFS)
+        nw_ifcache_sync();
+      return;
+    }
+    nw_ifcache_parse(buffer, length, 0);
+  }
+}
+
+int nw_ifcache_init(void) {
+
+  struct sockaddr_nl address;
+  struct timeval timeout = { 1, 0 };
+  lu_fdn_t fdn;
+
+  if (nw_ifcache_fd >= 0)
+    return 0;
+
+  nw_ifcache_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (nw_ifcache_fd < 0) {
+    syslog(LOG_WARNING, "Could not create netlink socket for the interface cache.");
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+  address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+  if (bind(nw_ifcache_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    syslog(LOG_WARNING, "Could not subscribe to interface changes: %m");
+    close(nw_ifcache_fd);
+    nw_ifcache_fd = -1;
+    return -1;
+  }
+
+  /* Dumps are read synchronously, the kernel answers right away. */
+  setsockopt(nw_ifcache_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  nw_ifcache_sync();
+
+  fdn.fd = nw_ifcache_fd;
+  fdn.recv = nw_ifcache_recv;
+  fdn.options = LS_READ;
+  fdn.data = &nw_ifcache_fd;
+  lu_fd_add(&fdn);
+
+  return 0;
+}
+
+uint64_t nw_ifcache_generation(void) {
+
+  return nw_ifcache_gen;
+}
+
+const nodewatcher_ifcache_link_t *nw_ifcache_link(int index) {
+
+  size_t position;
+  int found;
+
+  position = nw_ifcache_link_search(index, &found);
+
+  return found ? &nw_ifcache_links[position] : NULL;
+}
+
+void nw_ifcache_foreach_link(void (*callback)(const nodewatcher_ifcache_link_t *, void *), void *arg) {
+
+  size_t i;
+
+  for (i = 0; i < nw_ifcache_link_count; i++)
+    callback(&nw_ifcache_links[i], arg);
+}
+
+void nw_ifcache_foreach_addr(void (*callback)(const nodewatcher_ifcache_addr_t *, void *), void *arg) {
+
+  size_t i;
+
+  for (i = 0; i < nw_ifcache_addr_count; i++)
+    callback(&nw_ifcache_addrs[i], arg);
+}
@@ -18,41 +18,444 @@
  */
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <libre/scheduler.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "node-agent.h"
+#include "accounting.h"
 #include "modules.h"
+#include "rules.h"
+#include "state.h"
+#include "trace.h"
+#include "utils.h"
+
+typedef struct nodewatcher_module_interval {
+  char *name;
+  /* Refresh interval in milliseconds, maximum interval in seconds. */
+  time_t min;
+  time_t max;
+  /* Module whose changes restore the base interval, NULL to keep the module's own. */
+  char *related;
+  struct nodewatcher_module_interval *next;
+} nodewatcher_module_interval_t;
+
+/* Modules sorted by name. */
+static nodewatcher_module_entry_t *module_table = NULL;
+static size_t module_count = 0;
+static size_t module_capacity = 0;
+
+/* Library being loaded, modules registered meanwhile belong to it. */
+static void *module_loading_handle = NULL;
+
+static nodewatcher_module_interval_t *interval_list = NULL;
+static int adaptive_mode = 0;
+
+/* CPU budget of the agent in percent of one core, zero disables throttling. */
+static double throttle_budget = 0;
+static unsigned int throttle_level = 0;
+static struct {
+  uint64_t time;
+  uint64_t cpu;
+  /* Agent CPU usage over the last period, in percent of one core. */
+  double usage;
+  int overloaded;
+} throttle_sample;
+
+/* Callbacks invoked whenever an acquisition ends. */
+static struct {
+  void (*callback)(nodewatcher_module_t *, void *);
+  void *arg;
+} module_listeners[NW_MODULE_MAX_LISTENERS];
+static size_t module_listener_count = 0;
+
+static int nw_module_schedule(nodewatcher_module_t *module);
+
+static void nw_module_notify(nodewatcher_module_t *module) {
+
+  size_t i;
+
+  for (i = 0; i < module_listener_count; i++)
+    module_listeners[i].callback(module, module_listeners[i].arg);
+}
+
+/* Returns the index of the named module or, if missing, where it would be inserted. */
+static size_t nw_module_table_search(const char *name, int *found) {
+
+  size_t low = 0, high = module_count, middle;
+  int cmp;
+
+  *found = 0;
+  while (low < high) {
+    middle = (low + high) / 2;
+    cmp = strcmp(module_table[middle].module->name, name);
+    if (!cmp) {
+      *found = 1;
+      return middle;
+    }
+    if (cmp < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
 
-static nodewatcher_module_node_t *module_list = NULL;
+static nodewatcher_module_entry_t *nw_module_table_insert(nodewatcher_module_t *module) {
+
+  nodewatcher_module_entry_t *table;
+  size_t index;
+  int found;
+
+  index = nw_module_table_search(module->name, &found);
+  if (found) {
+    syslog(LOG_WARNING, "Module '%s' is already loaded!", module->name);
+    return NULL;
+  }
+
+  if (module_count == module_capacity) {
+    table = realloc(module_table, (module_capacity ? module_capacity * 2 : 16) * sizeof(nodewatcher_module_entry_t));
+    if (!table)
+      return NULL;
+    module_table = table;
+    module_capacity = module_capacity ? module_capacity * 2 : 16;
+  }
+
+  memmove(&module_table[index + 1], &module_table[index], (module_count - index) * sizeof(nodewatcher_module_entry_t));
+  module_count++;
+
+  memset(&module_table[index], 0, sizeof(nodewatcher_module_entry_t));
+  module_table[index].module = module;
+  module_table[index].handle = module_loading_handle;
+
+  return &module_table[index];
+}
 
 static void nw_module_run_module(void *arg) {
 
   nodewatcher_module_t *module = (nodewatcher_module_t *)arg;
+  uint64_t now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  uint64_t span = nw_trace_begin();
+
+  /* Track how late the event loop dispatched the task. */
+  nw_stats_loop_lag(now > module->stats.due ? now - module->stats.due : 0);
+
   nw_module_start_acquire_data(module);
+  nw_trace_end(module->name, "task", span);
+}
+
+/* Factor by which the interval of a module is currently stretched. */
+static time_t nw_module_throttle_factor(nodewatcher_module_t *module) {
+
+  if (!throttle_level || (module->flags & (NW_MODULE_OUTPUT | NW_MODULE_ESSENTIAL)) || !module->stats.runs)
+    return 1;
+
+  /* Only stretch modules that cost something. */
+  if (module->stats.total_cpu / module->stats.runs < NW_MODULE_THROTTLE_CHEAP_US)
+    return 1;
+
+  return (time_t)1 << throttle_level;
+}
+
+static void nw_module_update_meta(nodewatcher_module_t *module) {
+
+  json_object *meta;
+
+  if (!json_object_object_get_ex(module->data, "_meta", &meta))
+    return;
+
+  json_object_object_add(meta, "acquisition", nw_stats_to_json(&module->stats));
+  /* Sub-second intervals are reported as fractions of a second. */
+  if (module->adaptive.interval % 1000)
+    json_object_object_add(meta, "interval", json_object_new_double(module->adaptive.interval / 1000.0));
+  else
+    json_object_object_add(meta, "interval", json_object_new_int64(module->adaptive.interval / 1000));
+
+  if (throttle_level) {
+    json_object *throttle = json_object_new_object();
+    json_object_object_add(throttle, "level", json_object_new_int(throttle_level));
+    json_object_object_add(throttle, "factor", json_object_new_int64(nw_module_throttle_factor(module)));
+    json_object_object_add(meta, "throttle", throttle);
+  } else {
+    json_object_object_del(meta, "throttle");
+  }
+}
+
+/* Ends a pending acquisition as timed out, the data of the previous one stays. */
+static void nw_module_expire(nodewatcher_module_t *module) {
+
+  nw_timer_disarm(&module->supervisor.timer);
+  module->stats.timeouts++;
+  nw_module_update_meta(module);
+
+  /* Any late result is dropped by nw_module_finish_acquire_data. */
+  module->sched_status = NW_MODULE_NONE;
+  nw_module_schedule(module);
+  nw_module_notify(module);
+}
+
+static void nw_module_deadline(void *arg) {
+
+  nodewatcher_module_t *module = ((nodewatcher_module_supervisor_t *)arg)->module;
+
+  if (module->sched_status != NW_MODULE_PENDING_DATA)
+    return;
+
+  syslog(LOG_WARNING, "Module '%s' did not finish acquiring data in time, cancelling.", module->name);
+
+  if (module->hooks.cancel_acquire_data)
+    module->hooks.cancel_acquire_data(module);
+
+  nw_module_expire(module);
 }
 
 static int nw_module_schedule(nodewatcher_module_t *module) {
 
-  time_t timeout;
+  uint64_t now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  uint64_t interval, due;
 
   if (module->sched_status == NW_MODULE_PENDING_DATA || module->sched_status == NW_MODULE_SCHEDULED)
     return -1;
 
-  /* If the module has just been initialized, we schedule it for immediate execution. */
-  timeout = module->sched_status == NW_MODULE_INIT ? 0 : module->schedule.refresh_interval;
+  if (module->sched_status == NW_MODULE_INIT) {
+    /* If the module has just been initialized, we schedule it for immediate execution. */
+    due = now;
+  } else {
+    /*
+     * Runs are due at whole intervals from the previous due time, so the time
+     * taken by acquisitions does not add up. Runs missed while an acquisition
+     * took longer than the interval are skipped rather than run back to back.
+     */
+    interval = module->adaptive.interval * nw_module_throttle_factor(module) * 1000ULL;
+    due = module->stats.due + interval;
+    if (due <= now)
+      due += ((now - due) / interval + 1) * interval;
+  }
 
   /* Schedule the module. */
-  lu_task_insert(timeout, nw_module_run_module, (void *)module);
+  nw_timer_arm(&module->timer, due, nw_module_run_module, (void *)module);
+  module->stats.due = due;
   module->sched_status = NW_MODULE_SCHEDULED;
 
   return 0;
 }
 
-static int nw_module_add(nodewatcher_module_node_t **node, nodewatcher_module_t *module) {
+static uint32_t nw_module_hash(const char *str) {
+
+  /* FNV-1a. */
+  uint32_t hash = 2166136261u;
+
+  while (*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/* Brings a backed-off or throttled run forward if it is due later than the current interval allows. */
+static void nw_module_bring_forward(nodewatcher_module_t *module, uint64_t now) {
+
+  if (module->sched_status == NW_MODULE_SCHEDULED &&
+      module->stats.due > now + module->adaptive.interval * nw_module_throttle_factor(module) * 1000ULL) {
+    nw_timer_disarm(&module->timer);
+    module->sched_status = NW_MODULE_NONE;
+    /* Count the next interval from now. */
+    module->stats.due = now;
+    nw_module_schedule(module);
+  }
+}
+
+/* Base refresh interval of a module, in milliseconds. */
+static time_t nw_module_base_interval(nodewatcher_module_t *module) {
+
+  if (module->schedule.refresh_interval_ms)
+    return module->schedule.refresh_interval_ms;
+
+  return module->schedule.refresh_interval * 1000;
+}
+
+static void nw_module_reset_interval(nodewatcher_module_t *module) {
+
+  uint64_t now = nw_stats_clock_us(CLOCK_MONOTONIC);
+
+  module->adaptive.unchanged = 0;
+  if (module->adaptive.interval == nw_module_base_interval(module))
+    return;
+
+  module->adaptive.interval = nw_module_base_interval(module);
+  nw_module_update_meta(module);
+  nw_module_bring_forward(module, now);
+}
+
+static void nw_module_adapt_interval(nodewatcher_module_t *module, json_object *object) {
+
+  size_t i;
+  uint32_t hash;
+
+  if (!adaptive_mode)
+    return;
+
+  hash = nw_module_hash(json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN));
+  if (hash == module->adaptive.hash) {
+    /* Output is stable, back off exponentially up to the configured maximum. */
+    if (++module->adaptive.unchanged < NW_MODULE_ADAPTIVE_CYCLES ||
+        module->schedule.max_interval * 1000 <= module->adaptive.interval)
+      return;
+
+    module->adaptive.unchanged = 0;
+    module->adaptive.interval *= 2;
+    if (module->adaptive.interval > module->schedule.max_interval * 1000)
+      module->adaptive.interval = module->schedule.max_interval * 1000;
+    return;
+  }
+
+  module->adaptive.hash = hash;
+  nw_module_reset_interval(module);
+
+  /* Wake up modules which follow this one. */
+  for (i = 0; i < module_count; i++) {
+    nodewatcher_module_t *follower = module_table[i].module;
+
+    if (follower->schedule.related && !strcmp(follower->schedule.related, module->name))
+      nw_module_reset_interval(follower);
+  }
+}
+
+static void nw_module_apply_interval(nodewatcher_module_t *module) {
+
+  nodewatcher_module_interval_t *interval;
+
+  for (interval = interval_list; interval; interval = interval->next) {
+    if (strcmp(interval->name, module->name))
+      continue;
+
+    if (interval->min) {
+      module->schedule.refresh_interval = interval->min / 1000;
+      module->schedule.refresh_interval_ms = interval->min;
+    }
+    if (interval->max)
+      module->schedule.max_interval = interval->max;
+    if (interval->related)
+      module->schedule.related = interval->related;
+  }
+
+  module->adaptive.interval = nw_module_base_interval(module);
+}
+
+static int nw_module_parse_interval(const char *arg) {
+
+  nodewatcher_module_interval_t *interval;
+  char *name, *limits, *related;
+
+  name = strdup(arg);
+  limits = strchr(name, '=');
+  if (!limits) {
+    syslog(LOG_WARNING, "Invalid interval override '%s', expected name=min[ms][:max[:related]].", arg);
+    free(name);
+    return -1;
+  }
+  *limits++ = 0;
+
+  related = strchr(limits, ':');
+  if (related)
+    related = strchr(related + 1, ':');
+  if (related)
+    *related++ = 0;
+
+  interval = malloc(sizeof(nodewatcher_module_interval_t));
+  interval->name = name;
+  interval->related = related && *related ? related : NULL;
+  interval->min = strtol(limits, &limits, 10);
+  if (!strncmp(limits, "ms", 2))
+    limits += 2;
+  else
+    interval->min *= 1000;
+  interval->max = *limits == ':' ? strtol(limits + 1, NULL, 10) : 0;
+  interval->next = interval_list;
+  interval_list = interval;
+
+  return 0;
+}
+
+/* Returns whether the host is overloaded, judged by CPU pressure or, without PSI, by the load average. */
+static int nw_module_host_overloaded(void) {
+
+  double avg10, load;
+  long cpus;
+  FILE *file;
+  int ret;
+
+  file = nw_utils_fopen("/proc/pressure/cpu", "r");
+  if (file) {
+    ret = fscanf(file, "some avg10=%lf", &avg10);
+    fclose(file);
+    if (ret == 1)
+      return avg10 > NW_MODULE_THROTTLE_PRESSURE;
+  }
+
+  file = nw_utils_fopen("/proc/loadavg", "r");
+  if (!file)
+    return 0;
+  ret = fscanf(file, "%lf", &load);
+  fclose(file);
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return ret == 1 && load > NW_MODULE_THROTTLE_LOAD * (cpus > 0 ? cpus : 1);
+}
+
+static void nw_module_throttle_update(nodewatcher_module_t *module, void *arg) {
+
+  uint64_t now = *(uint64_t *)arg;
+
+  nw_module_update_meta(module);
+  nw_module_bring_forward(module, now);
+}
+
+static void nw_module_throttle_check(void *arg) {
+
+  uint64_t now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  uint64_t cpu = nw_stats_clock_us(CLOCK_PROCESS_CPUTIME_ID);
+  unsigned int level = throttle_level;
+
+  UNUSED(arg);
+
+  if (throttle_sample.time && now > throttle_sample.time)
+    throttle_sample.usage = (cpu - throttle_sample.cpu) * 100.0 / (now - throttle_sample.time);
+  throttle_sample.time = now;
+  throttle_sample.cpu = cpu;
+  throttle_sample.overloaded = nw_module_host_overloaded();
+
+  /* Back off one step per period and recover once well below the budget. */
+  if (throttle_sample.overloaded || throttle_sample.usage > throttle_budget) {
+    if (level < NW_MODULE_THROTTLE_MAX_LEVEL)
+      level++;
+  } else if (level && throttle_sample.usage < throttle_budget / 2) {
+    level--;
+  }
+
+  if (level != throttle_level) {
+    syslog(LOG_INFO, "Throttling level %u (CPU %.2f%% of %.2f%%%s).", level, throttle_sample.usage, throttle_budget,
+      throttle_sample.overloaded ? ", host overloaded" : "");
+    throttle_level = level;
+    nw_module_foreach(nw_module_throttle_update, &now);
+  }
+
+  lu_task_insert(NW_MODULE_THROTTLE_PERIOD, nw_module_throttle_check, NULL);
+}
+
+unsigned int nw_module_throttle_level(void) {
+
+  return throttle_level;
+}
+
+static int nw_module_add(nodewatcher_module_t *module) {
 
   int ret = 0;
 
@@ -64,28 +467,101 @@ static int nw_module_add(nodewatcher_module_node_t **node, nodewatcher_module_t
 
   /* Perform module initialization. */
   module->sched_status = NW_MODULE_INIT;
+  module->supervisor.module = module;
   syslog(LOG_INFO, "Initializing module '%s'.", module->name);
   ret = module->hooks.init(module);
 
-  if (ret)
-    return ret;
+  if (ret || !nw_module_table_insert(module)) {
+    json_object_put(module->data);
+    module->data = NULL;
+    return ret ? ret : -1;
+  }
 
-  /* Create new node. */
-  nodewatcher_module_node_t *new_node = malloc(sizeof(nodewatcher_module_node_t));
-  new_node->module = module;
-  new_node->next = *node;
-  *node = new_node;
+  nw_module_apply_interval(module);
+  nw_state_restore(module);
 
-  if (module->schedule.refresh_interval)
+  if (module->adaptive.interval)
     ret = nw_module_schedule(module);
 
   return ret;
 }
 
-static int nw_module_load_library(const char *path, const lu_args *args) {
+#ifdef NW_STATIC_MODULES
+/* Descriptors of modules linked into the agent, collected by the linker. */
+extern nodewatcher_module_t *const __start_nw_modules[];
+extern nodewatcher_module_t *const __stop_nw_modules[];
+
+static int nw_module_load_builtin(const lu_args *args) {
+
+  nodewatcher_module_t *const *entry;
+  int ret = 0, status;
+
+  for (entry = __start_nw_modules; entry < __stop_nw_modules; entry++) {
+    (*entry)->args = args;
+
+    status = nw_module_add(*entry);
+    if (status)
+      syslog(LOG_WARNING, "Loading of built-in module '%s' has failed!", (*entry)->name);
+    else
+      syslog(LOG_INFO, "Loaded built-in module '%s'.", (*entry)->name);
+    ret |= status;
+  }
+
+  return ret;
+}
+#else
+/* Module directory and arguments, kept for rescanning the directory on reload. */
+static char *module_directory = NULL;
+static const lu_args *module_args = NULL;
+
+static void nw_module_table_remove(size_t index) {
+
+  free(module_table[index].path);
+  memmove(&module_table[index], &module_table[index + 1], (module_count - index - 1) * sizeof(nodewatcher_module_entry_t));
+  module_count--;
+}
+
+/* Detaches a module from the scheduler, cancelling any acquisition in progress. */
+static void nw_module_detach(nodewatcher_module_t *module) {
+
+  nw_timer_disarm(&module->timer);
+  nw_timer_disarm(&module->supervisor.timer);
+
+  if (module->sched_status == NW_MODULE_PENDING_DATA && module->hooks.cancel_acquire_data)
+    module->hooks.cancel_acquire_data(module);
+
+  module->sched_status = NW_MODULE_NONE;
+  nw_module_notify(module);
+
+  json_object_put(module->data);
+  module->data = NULL;
+}
+
+/* Removes all modules of a library, lets the module it was loaded for clean up and closes it. */
+static void nw_module_unload(void *handle, nodewatcher_module_t *module) {
+
+  size_t i = module_count;
+
+  while (i-- > 0) {
+    if (module_table[i].handle != handle)
+      continue;
+
+    nw_module_detach(module_table[i].module);
+    nw_module_table_remove(i);
+  }
+
+  if (module->hooks.cleanup)
+    module->hooks.cleanup(module);
+
+  dlclose(handle);
+}
+
+static int nw_module_load_library(const char *path, const struct stat *s, const lu_args *args) {
 
   nodewatcher_module_t *module;
+  nodewatcher_module_entry_t *entry;
   void *handle;
+  int found;
   int ret = 0;
 
   /* Load library. */
@@ -99,17 +575,32 @@ static int nw_module_load_library(const char *path, const lu_args *args) {
   module = dlsym(handle, "nw_module");
   if (!module) {
     syslog(LOG_WARNING, "Module '%s' is not a valid %s module!", path, APP);
+    dlclose(handle);
     return -1;
   }
 
   module->args = args;
 
-  /* Add module to our list of modules. */
-  ret = nw_module_add(&module_list, module);
-  if (ret)
+  /* Add module to our table of modules. */
+  module_loading_handle = handle;
+  ret = nw_module_add(module);
+  module_loading_handle = NULL;
+
+  if (ret) {
     syslog(LOG_WARNING, "Loading of module '%s' (%s) has failed!", module->name, path);
-  else
-    syslog(LOG_INFO, "Loaded module '%s' (%s).", module->name, path);
+    nw_module_unload(handle, module);
+    return ret;
+  }
+
+  /* Remember where the module came from, so reload can tell whether it changed. */
+  entry = &module_table[nw_module_table_search(module->name, &found)];
+  entry->path = strdup(path);
+  entry->dev = s->st_dev;
+  entry->ino = s->st_ino;
+  entry->mtime = s->st_mtime;
+  entry->size = s->st_size;
+
+  syslog(LOG_INFO, "Loaded module '%s' (%s).", module->name, path);
 
   return ret;
 }
@@ -120,27 +611,26 @@ static inline unsigned int file_ext(char *name, char *ext) {
   return (len_filename > len_ext) && !strcmp(name + len_filename - len_ext, ext);
 }
 
-int nw_module_init(const lu_args *args) {
+static int nw_module_loaded(const char *path) {
+
+  size_t i;
+
+  for (i = 0; i < module_count; i++) {
+    if (module_table[i].path && !strcmp(module_table[i].path, path))
+      return 1;
+  }
+
+  return 0;
+}
+
+static int nw_module_load_directory(const char *moddir, const lu_args *args) {
 
-  char c;
   DIR *dir;
   struct stat s;
   struct dirent *dir_entry;
   char path[PATH_MAX];
-  char *moddir = NULL;
   int ret = 0;
 
-  while ((c = lu_getopt(args, "m:")) != EOF) {
-    switch (c) {
-      case 'm': moddir = strdup(lu_getarg()); break;
-    }
-  }
-
-  if (!moddir) {
-    syslog(LOG_INFO, "Using default directory for modules.");
-    moddir = strdup(NA_MODULE_DIRECTORY);
-  }
-
   /* Discover and initialize all the modules. */
   dir = opendir(moddir);
   if (!dir) {
@@ -155,55 +645,346 @@ int nw_module_init(const lu_args *args) {
     snprintf(path, sizeof(path)-1, "%s/%s", moddir, dir_entry->d_name);
     if (stat(path, &s) || !S_ISREG(s.st_mode))
       continue;
-    ret |= nw_module_load_library(path, args);
+    /* Modules that are already loaded keep running undisturbed. */
+    if (nw_module_loaded(path))
+      continue;
+    ret |= nw_module_load_library(path, &s, args);
   }
   closedir(dir);
-  if (moddir)
+
+  return ret;
+}
+
+/* Self-pipe through which SIGHUP requests a reload from within the event loop. */
+static int module_reload_pipe[2] = { -1, -1 };
+
+static void nw_module_sighup(int signal) {
+
+  int saved_errno = errno;
+
+  UNUSED(signal);
+
+  if (write(module_reload_pipe[1], "", 1) < 0) {
+    /* A reload is already pending. */
+  }
+  errno = saved_errno;
+}
+
+static void nw_module_reload_recv(void *arg) {
+
+  char buffer[16];
+
+  while (read(*(int *)arg, buffer, sizeof(buffer)) > 0);
+
+  syslog(LOG_INFO, "Received SIGHUP, reloading modules.");
+  nw_module_reload();
+}
+
+static void nw_module_watch_sighup(void) {
+
+  lu_fdn_t fdn;
+  struct sigaction action;
+
+  if (pipe(module_reload_pipe) < 0) {
+    syslog(LOG_WARNING, "Unable to create reload pipe, SIGHUP will not reload modules.");
+    return;
+  }
+
+  fcntl(module_reload_pipe[0], F_SETFL, fcntl(module_reload_pipe[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(module_reload_pipe[1], F_SETFL, fcntl(module_reload_pipe[1], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(module_reload_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(module_reload_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  fdn.fd = module_reload_pipe[0];
+  fdn.recv = nw_module_reload_recv;
+  fdn.options = LS_READ;
+  fdn.data = &module_reload_pipe[0];
+  lu_fd_add(&fdn);
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = nw_module_sighup;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGHUP, &action, NULL);
+}
+#endif
+
+int nw_module_init(const lu_args *args) {
+
+  char c;
+  char *moddir = NULL;
+  int ret = 0;
+
+  if (nw_timer_init() < 0)
+    return -1;
+
+  while ((c = lu_getopt(args, "m:AI:R:B:")) != EOF) {
+    switch (c) {
+      case 'm': moddir = strdup(lu_getarg()); break;
+      case 'B': throttle_budget = atof(lu_getarg()); break;
+      case 'R': nw_utils_set_root(lu_getarg()); break;
+      case 'A': adaptive_mode = 1; break;
+      case 'I': nw_module_parse_interval(lu_getarg()); break;
+    }
+  }
+
+#ifdef NW_STATIC_MODULES
+  if (moddir) {
+    syslog(LOG_INFO, "Modules are built in, ignoring module directory '%s'.", moddir);
     free(moddir);
+  }
+
+  ret = nw_module_load_builtin(args);
+#else
+  if (!moddir) {
+    syslog(LOG_INFO, "Using default directory for modules.");
+    moddir = strdup(NA_MODULE_DIRECTORY);
+  }
+
+  module_directory = moddir;
+  module_args = args;
+
+  ret = nw_module_load_directory(moddir, args);
+  nw_module_watch_sighup();
+#endif
+
+  if (throttle_budget > 0) {
+    /* Loading modules does not count against the budget. */
+    throttle_sample.time = nw_stats_clock_us(CLOCK_MONOTONIC);
+    throttle_sample.cpu = nw_stats_clock_us(CLOCK_PROCESS_CPUTIME_ID);
+    lu_task_insert(NW_MODULE_THROTTLE_PERIOD, nw_module_throttle_check, NULL);
+  }
 
   return ret;
 }
 
-int nw_module_start_acquire_data(nodewatcher_module_t *module) {
+int nw_module_reload(void) {
 
-  module->hooks.start_acquire_data(module);
+#ifdef NW_STATIC_MODULES
+  syslog(LOG_INFO, "Modules are built in, nothing to reload.");
   return 0;
+#else
+  struct stat s;
+  size_t i = 0;
+
+  if (!module_directory)
+    return -1;
+
+  /* Unload libraries that have been removed or replaced, the rest keep their state. */
+  while (i < module_count) {
+    nodewatcher_module_entry_t *entry = &module_table[i];
+
+    if (!entry->path || (!stat(entry->path, &s) && s.st_dev == entry->dev && s.st_ino == entry->ino &&
+        s.st_mtime == entry->mtime && s.st_size == entry->size)) {
+      i++;
+      continue;
+    }
+
+    syslog(LOG_INFO, "Unloading module '%s' (%s).", entry->module->name, entry->path);
+    nw_module_unload(entry->handle, entry->module);
+
+    /* Unloading shifts the table, start over. */
+    i = 0;
+  }
+
+  /* Load new and replaced libraries. */
+  return nw_module_load_directory(module_directory, module_args);
+#endif
+}
+
+int nw_module_start_acquire_data(nodewatcher_module_t *module) {
+
+  int ret;
+  time_t deadline = module->schedule.deadline ? module->schedule.deadline : NW_MODULE_DEFAULT_DEADLINE;
+
+  /* Make sure the module is rescheduled even if it never finishes. */
+  module->sched_status = NW_MODULE_PENDING_DATA;
+  nw_timer_arm(&module->supervisor.timer, nw_stats_clock_us(CLOCK_MONOTONIC) + deadline * 1000000ULL,
+    nw_module_deadline, (void *)&module->supervisor);
+
+  nw_stats_start(&module->stats);
+  ret = module->hooks.start_acquire_data(module);
+  if (ret < 0 && module->sched_status == NW_MODULE_PENDING_DATA) {
+    /* Module gave up without finishing, there is no point in waiting for the deadline. */
+    nw_timer_disarm(&module->supervisor.timer);
+    module->stats.failures++;
+    nw_module_update_meta(module);
+    module->sched_status = NW_MODULE_NONE;
+    nw_module_schedule(module);
+    nw_module_notify(module);
+  }
+
+  return ret;
 }
 
 int nw_module_finish_acquire_data(nodewatcher_module_t *module, json_object *object) {
 
-  if (!object)
+  if (module->sched_status != NW_MODULE_PENDING_DATA) {
+    /* Acquisition has already been cancelled. */
+    if (object)
+      json_object_put(object);
+    return -1;
+  }
+
+  nw_timer_disarm(&module->supervisor.timer);
+  module->sched_status = NW_MODULE_NONE;
+
+  if (!object) {
+    module->stats.failures++;
+    nw_module_update_meta(module);
+    nw_module_schedule(module);
+    nw_module_notify(module);
     return -1;
+  }
+
+  nw_stats_finish(&module->stats);
+  module->supervisor.last_success = time(NULL);
+  nw_module_adapt_interval(module, object);
+
+  /* Measure new data and cut it down to the module's budget. */
+  json_object *memory = nw_accounting_enforce(module->name, object);
 
   /* Copy metadata from old data to new data. */
   json_object *meta;
   json_object_object_get_ex(module->data, "_meta", &meta);
+  json_object_object_del(meta, "restored");
+  json_object_object_add(meta, "memory", memory);
   json_object_object_add(object, "_meta", json_object_get(meta));
 
   /* Dump old data and move new data to module. */
   json_object_put(module->data);
   module->data = object;
+  nw_module_update_meta(module);
+
+  /* Check rules on the fresh data right away. */
+  nw_rules_evaluate(module);
 
   /* Reschedule module. */
-  module->sched_status = NW_MODULE_NONE;
   nw_module_schedule(module);
+  nw_module_notify(module);
 
   return 0;
 }
 
+void nw_module_timeout_acquire_data(nodewatcher_module_t *module) {
+
+  /* Partial data of a timed out acquisition, finished right after, is not a success. */
+  if (module->sched_status == NW_MODULE_PENDING_DATA)
+    nw_module_expire(module);
+}
+
+int nw_module_refresh(nodewatcher_module_t *module, time_t window) {
+
+  time_t now = time(NULL);
+
+  /* Join the acquisition in flight. */
+  if (module->sched_status == NW_MODULE_PENDING_DATA)
+    return 1;
+
+  if (window && module->supervisor.last_success && now - module->supervisor.last_success < window)
+    return 0;
+
+  /* Run the module now, as if its timer had fired, and count the following runs from now. */
+  nw_timer_disarm(&module->timer);
+  module->stats.due = nw_stats_clock_us(CLOCK_MONOTONIC);
+  module->sched_status = NW_MODULE_SCHEDULED;
+  nw_module_start_acquire_data(module);
+
+  return module->sched_status == NW_MODULE_PENDING_DATA;
+}
+
+static void nw_module_push_output(nodewatcher_module_t *module, void *arg) {
+
+  UNUSED(arg);
+
+  if (module->flags & NW_MODULE_OUTPUT)
+    nw_module_refresh(module, 0);
+}
+
+void nw_module_push(void) {
+
+  nw_module_foreach(nw_module_push_output, NULL);
+}
+
+int nw_module_add_listener(void (*callback)(nodewatcher_module_t *, void *), void *arg) {
+
+  if (module_listener_count == NW_MODULE_MAX_LISTENERS)
+    return -1;
+
+  module_listeners[module_listener_count].callback = callback;
+  module_listeners[module_listener_count].arg = arg;
+  module_listener_count++;
+
+  return 0;
+}
+
+int nw_module_register(nodewatcher_module_t *module) {
+
+  int ret = nw_module_add(module);
+
+  if (ret)
+    syslog(LOG_WARNING, "Registration of module '%s' has failed!", module->name);
+
+  return ret;
+}
+
+nodewatcher_module_t *nw_module_find(const char *name) {
+
+  size_t index;
+  int found;
+
+  index = nw_module_table_search(name, &found);
+
+  return found ? module_table[index].module : NULL;
+}
+
+void nw_module_foreach(void (*callback)(nodewatcher_module_t *, void *), void *arg) {
+
+  size_t i;
+
+  /* Callbacks must not add or remove modules. */
+  for (i = 0; i < module_count; i++)
+    callback(module_table[i].module, arg);
+}
+
 json_object *nw_module_get_output() {
 
   nodewatcher_module_t *module;
-  nodewatcher_module_node_t *node = module_list;
+  json_object *meta;
+  size_t i;
+  time_t now = time(NULL);
 
   json_object *object = json_object_new_object();
 
   /* Iterate through all modules and add content. */
-  while (node) {
-    module = node->module;
+  for (i = 0; i < module_count; i++) {
+    module = module_table[i].module;
+
+    /* Seconds since the last successful acquisition, -1 if there was none yet. */
+    if (json_object_object_get_ex(module->data, "_meta", &meta)) {
+      json_object_object_add(meta, "staleness",
+        json_object_new_int64(module->supervisor.last_success ? now - module->supervisor.last_success : -1));
+    }
+
     json_object_object_add(object, module->name, json_object_get(module->data));
-    node = node->next;
   }
 
+  /* Agent's own footprint. */
+  json_object *agent = nw_stats_agent_json();
+  if (throttle_budget > 0) {
+    json_object *throttle = json_object_new_object();
+    json_object_object_add(throttle, "level", json_object_new_int(throttle_level));
+    json_object_object_add(throttle, "budget_percent", json_object_new_double(throttle_budget));
+    json_object_object_add(throttle, "cpu_percent", json_object_new_double(throttle_sample.usage));
+    json_object_object_add(throttle, "host_overloaded", json_object_new_boolean(throttle_sample.overloaded));
+    json_object_object_add(agent, "throttle", throttle);
+  }
+  json_object_object_add(object, "core.agent", agent);
+
+  /* State of the rules, if any. */
+  json_object *rules = nw_rules_json();
+  if (rules)
+    json_object_object_add(object, "core.rules", rules);
+
   return object;
 }
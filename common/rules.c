@@ -0,0 +1,622 @@
+#include <ctype.h>
+#include <libre/scheduler.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "rules.h"
+
+/*
+ * Rules evaluated on every fresh module result. The rules file (-r) holds one
+ * rule per line:
+ *
+ *   <name>: <expression> <comparison> <expression> [clear <comparison> <expression>]
+ *
+ * Expressions combine numbers (10% is 0.1), fields written as <module>:<path>
+ * like in history, count(<module>:<path>) for the number of members of an
+ * object or array, rate(<expression>) for the change per second between the
+ * two latest results of the modules it refers to, + - * / and parentheses.
+ * Comparisons are < <= > >= == and !=. A rule fires when its condition becomes
+ * true and, with a clear clause, stays active until the left expression meets
+ * the clear condition:
+ *
+ *   low_memory: core.resources:memory.free / core.resources:memory.total < 5% clear > 10%
+ *   neighbour_lost: rate(count(core.routing.babel:neighbours)) < 0
+ *
+ * Rules are compiled once into postfix programs. When a rule fires or clears,
+ * it is logged and output modules are pushed with the rule states included
+ * in the output as core.rules.
+ */
+
+typedef struct {
+  const char *name;
+  uint32_t rule;
+} nw_rules_index_t;
+
+static nodewatcher_rules_rule_t *nw_rules = NULL;
+static size_t nw_rules_count = 0;
+static nodewatcher_rules_op_t *nw_rules_ops = NULL;
+static size_t nw_rules_op_count = 0;
+static nodewatcher_rules_ref_t *nw_rules_refs = NULL;
+static size_t nw_rules_ref_count = 0;
+static nodewatcher_rules_rate_t *nw_rules_rates = NULL;
+static size_t nw_rules_rate_count = 0;
+/* Rules by the modules they refer to, sorted by module name. */
+static nw_rules_index_t *nw_rules_index = NULL;
+static size_t nw_rules_index_count = 0;
+static int nw_rules_push_pending = 0;
+
+typedef struct {
+  const char *input;
+  uint32_t rule;
+  int error;
+} nw_rules_parser_t;
+
+static void nw_rules_parse_sum(nw_rules_parser_t *parser);
+
+static void *nw_rules_grow(void *array, size_t count, size_t size) {
+
+  /* Arrays grow in powers of two, so only reallocate when count is zero or a power of two. */
+  if (count & (count - 1))
+    return array;
+
+  return realloc(array, (count ? count * 2 : 1) * size);
+}
+
+static void nw_rules_emit(nw_rules_parser_t *parser, uint8_t opcode, uint32_t argument, double value) {
+
+  nodewatcher_rules_op_t *ops = nw_rules_grow(nw_rules_ops, nw_rules_op_count, sizeof(nodewatcher_rules_op_t));
+
+  if (!ops) {
+    parser->error = 1;
+    return;
+  }
+  nw_rules_ops = ops;
+
+  nw_rules_ops[nw_rules_op_count].opcode = opcode;
+  nw_rules_ops[nw_rules_op_count].argument = argument;
+  nw_rules_ops[nw_rules_op_count].value = value;
+  nw_rules_op_count++;
+}
+
+static void nw_rules_skip(nw_rules_parser_t *parser) {
+
+  while (isspace((unsigned char)*parser->input))
+    parser->input++;
+}
+
+static int nw_rules_accept(nw_rules_parser_t *parser, const char *token) {
+
+  nw_rules_skip(parser);
+  if (strncmp(parser->input, token, strlen(token)))
+    return 0;
+
+  parser->input += strlen(token);
+  return 1;
+}
+
+static void nw_rules_index_add(const char *module, uint32_t rule) {
+
+  nw_rules_index_t *index;
+  size_t i;
+
+  for (i = 0; i < nw_rules_index_count; i++) {
+    if (nw_rules_index[i].rule == rule && !strcmp(nw_rules_index[i].name, module))
+      return;
+  }
+
+  index = nw_rules_grow(nw_rules_index, nw_rules_index_count, sizeof(nw_rules_index_t));
+  if (!index)
+    return;
+  nw_rules_index = index;
+  nw_rules_index[nw_rules_index_count].name = module;
+  nw_rules_index[nw_rules_index_count].rule = rule;
+  nw_rules_index_count++;
+}
+
+/* Parses <module>:<path> into a reference, returns its index. */
+static uint32_t nw_rules_parse_ref(nw_rules_parser_t *parser) {
+
+  nodewatcher_rules_ref_t *refs, *ref;
+  const char *start, *colon;
+  char *path, *key, *end, *saveptr;
+  size_t length;
+
+  nw_rules_skip(parser);
+  start = parser->input;
+  while (*parser->input && !isspace((unsigned char)*parser->input) && !strchr("()<>=!*/+,", *parser->input))
+    parser->input++;
+
+  length = parser->input - start;
+  colon = memchr(start, ':', length);
+  if (!colon || colon == start || colon == start + length - 1) {
+    parser->error = 1;
+    return 0;
+  }
+
+  refs = nw_rules_grow(nw_rules_refs, nw_rules_ref_count, sizeof(nodewatcher_rules_ref_t));
+  if (!refs) {
+    parser->error = 1;
+    return 0;
+  }
+  nw_rules_refs = refs;
+
+  ref = &nw_rules_refs[nw_rules_ref_count];
+  memset(ref, 0, sizeof(nodewatcher_rules_ref_t));
+  ref->module = strndup(start, colon - start);
+  path = strndup(colon + 1, start + length - colon - 1);
+
+  for (key = strtok_r(path, ".", &saveptr); key; key = strtok_r(NULL, ".", &saveptr)) {
+    ref->keys = realloc(ref->keys, (ref->depth + 1) * sizeof(char *));
+    ref->indices = realloc(ref->indices, (ref->depth + 1) * sizeof(long));
+    ref->keys[ref->depth] = strdup(key);
+    ref->indices[ref->depth] = strtol(key, &end, 10);
+    if (*end || ref->indices[ref->depth] < 0)
+      ref->indices[ref->depth] = -1;
+    ref->depth++;
+  }
+  free(path);
+
+  nw_rules_index_add(ref->module, parser->rule);
+  return nw_rules_ref_count++;
+}
+
+static void nw_rules_parse_factor(nw_rules_parser_t *parser) {
+
+  nodewatcher_rules_rate_t *rates;
+  uint32_t refs;
+  char *end;
+  double value;
+
+  nw_rules_skip(parser);
+
+  if (nw_rules_accept(parser, "(")) {
+    nw_rules_parse_sum(parser);
+    if (!nw_rules_accept(parser, ")"))
+      parser->error = 1;
+  } else if (nw_rules_accept(parser, "-")) {
+    nw_rules_parse_factor(parser);
+    nw_rules_emit(parser, NW_RULES_OP_NEG, 0, 0);
+  } else if (nw_rules_accept(parser, "count(")) {
+    nw_rules_emit(parser, NW_RULES_OP_COUNT, nw_rules_parse_ref(parser), 0);
+    if (!nw_rules_accept(parser, ")"))
+      parser->error = 1;
+  } else if (nw_rules_accept(parser, "rate(")) {
+    refs = nw_rules_ref_count;
+    nw_rules_parse_sum(parser);
+    if (!nw_rules_accept(parser, ")"))
+      parser->error = 1;
+
+    /* Every rate keeps its own previous value. */
+    rates = nw_rules_grow(nw_rules_rates, nw_rules_rate_count, sizeof(nodewatcher_rules_rate_t));
+    if (!rates) {
+      parser->error = 1;
+      return;
+    }
+    nw_rules_rates = rates;
+    memset(&nw_rules_rates[nw_rules_rate_count], 0, sizeof(nodewatcher_rules_rate_t));
+    nw_rules_rates[nw_rules_rate_count].value = NAN;
+    nw_rules_rates[nw_rules_rate_count].last = NAN;
+    nw_rules_rates[nw_rules_rate_count].ref_offset = refs;
+    nw_rules_rates[nw_rules_rate_count].ref_count = nw_rules_ref_count - refs;
+    nw_rules_emit(parser, NW_RULES_OP_RATE, nw_rules_rate_count++, 0);
+  } else if (isdigit((unsigned char)*parser->input) || *parser->input == '.') {
+    value = strtod(parser->input, &end);
+    parser->input = end;
+    if (*parser->input == '%') {
+      value /= 100;
+      parser->input++;
+    }
+    nw_rules_emit(parser, NW_RULES_OP_CONST, 0, value);
+  } else {
+    nw_rules_emit(parser, NW_RULES_OP_REF, nw_rules_parse_ref(parser), 0);
+  }
+}
+
+static void nw_rules_parse_product(nw_rules_parser_t *parser) {
+
+  nw_rules_parse_factor(parser);
+  while (!parser->error) {
+    if (nw_rules_accept(parser, "*")) {
+      nw_rules_parse_factor(parser);
+      nw_rules_emit(parser, NW_RULES_OP_MUL, 0, 0);
+    } else if (nw_rules_accept(parser, "/")) {
+      nw_rules_parse_factor(parser);
+      nw_rules_emit(parser, NW_RULES_OP_DIV, 0, 0);
+    } else {
+      break;
+    }
+  }
+}
+
+static void nw_rules_parse_sum(nw_rules_parser_t *parser) {
+
+  nw_rules_parse_product(parser);
+  while (!parser->error) {
+    if (nw_rules_accept(parser, "+")) {
+      nw_rules_parse_product(parser);
+      nw_rules_emit(parser, NW_RULES_OP_ADD, 0, 0);
+    } else if (nw_rules_accept(parser, "-")) {
+      nw_rules_parse_product(parser);
+      nw_rules_emit(parser, NW_RULES_OP_SUB, 0, 0);
+    } else {
+      break;
+    }
+  }
+}
+
+static nodewatcher_rules_program_t nw_rules_parse_program(nw_rules_parser_t *parser) {
+
+  nodewatcher_rules_program_t program;
+
+  program.offset = nw_rules_op_count;
+  nw_rules_parse_sum(parser);
+  program.length = nw_rules_op_count - program.offset;
+
+  return program;
+}
+
+static int nw_rules_parse_compare(nw_rules_parser_t *parser) {
+
+  /* Longer operators first. */
+  if (nw_rules_accept(parser, "<="))
+    return NW_RULES_LE;
+  if (nw_rules_accept(parser, ">="))
+    return NW_RULES_GE;
+  if (nw_rules_accept(parser, "=="))
+    return NW_RULES_EQ;
+  if (nw_rules_accept(parser, "!="))
+    return NW_RULES_NE;
+  if (nw_rules_accept(parser, "<"))
+    return NW_RULES_LT;
+  if (nw_rules_accept(parser, ">"))
+    return NW_RULES_GT;
+
+  parser->error = 1;
+  return -1;
+}
+
+/* Drops what a rejected rule has left behind, its references stay unused. */
+static void nw_rules_discard(size_t ops) {
+
+  size_t i, j;
+
+  nw_rules_op_count = ops;
+  for (i = 0, j = 0; i < nw_rules_index_count; i++) {
+    if (nw_rules_index[i].rule != nw_rules_count)
+      nw_rules_index[j++] = nw_rules_index[i];
+  }
+  nw_rules_index_count = j;
+}
+
+static int nw_rules_parse_line(char *line, unsigned int number) {
+
+  nodewatcher_rules_rule_t *rules, rule;
+  nw_rules_parser_t parser;
+  char *name, *colon;
+  size_t ops = nw_rules_op_count;
+
+  name = line;
+  while (isspace((unsigned char)*name))
+    name++;
+  if (!*name || *name == '#')
+    return 0;
+
+  colon = strchr(name, ':');
+  /* The rule name must not swallow the module of the first field. */
+  if (!colon || colon == name || memchr(name, '.', colon - name) || memchr(name, ' ', colon - name)) {
+    syslog(LOG_WARNING, "Rules: Missing rule name on line %u.", number);
+    return -1;
+  }
+  *colon = 0;
+
+  memset(&rule, 0, sizeof(rule));
+  memset(&parser, 0, sizeof(parser));
+  parser.input = colon + 1;
+  parser.rule = nw_rules_count;
+
+  rule.value = nw_rules_parse_program(&parser);
+  rule.compare = nw_rules_parse_compare(&parser);
+  if (!parser.error)
+    rule.threshold = nw_rules_parse_program(&parser);
+
+  rule.clear_compare = -1;
+  if (!parser.error && nw_rules_accept(&parser, "clear")) {
+    rule.clear_compare = nw_rules_parse_compare(&parser);
+    if (!parser.error)
+      rule.clear = nw_rules_parse_program(&parser);
+  }
+
+  nw_rules_skip(&parser);
+  if (parser.error || *parser.input) {
+    syslog(LOG_WARNING, "Rules: Invalid rule '%s' on line %u.", name, number);
+    nw_rules_discard(ops);
+    return -1;
+  }
+
+  rules = nw_rules_grow(nw_rules, nw_rules_count, sizeof(nodewatcher_rules_rule_t));
+  if (!rules) {
+    nw_rules_discard(ops);
+    return -1;
+  }
+  nw_rules = rules;
+
+  rule.name = strdup(name);
+  rule.last = NAN;
+  nw_rules[nw_rules_count++] = rule;
+
+  return 0;
+}
+
+static json_object *nw_rules_lookup(const nodewatcher_rules_ref_t *ref) {
+
+  nodewatcher_module_t *module = nw_module_find(ref->module);
+  json_object *object;
+  size_t i;
+
+  if (!module)
+    return NULL;
+
+  object = module->data;
+  for (i = 0; i < ref->depth && object; i++) {
+    if (json_object_is_type(object, json_type_array))
+      object = ref->indices[i] >= 0 ? json_object_array_get_idx(object, ref->indices[i]) : NULL;
+    else if (!json_object_object_get_ex(object, ref->keys[i], &object))
+      object = NULL;
+  }
+
+  return object;
+}
+
+/* Counts the results of the modules a rate refers to, to tell whether there is new data. */
+static unsigned long nw_rules_runs(const nodewatcher_rules_rate_t *rate) {
+
+  nodewatcher_module_t *module;
+  unsigned long runs = 0;
+  uint32_t i;
+
+  for (i = rate->ref_offset; i < rate->ref_offset + rate->ref_count; i++) {
+    module = nw_module_find(nw_rules_refs[i].module);
+    if (module)
+      runs += module->stats.runs;
+  }
+
+  return runs;
+}
+
+static double nw_rules_run(nodewatcher_rules_program_t program, uint64_t now) {
+
+  double stack[NW_RULES_STACK_SIZE], value;
+  size_t top = 0;
+  uint32_t i;
+
+  for (i = program.offset; i < program.offset + program.length; i++) {
+    const nodewatcher_rules_op_t *op = &nw_rules_ops[i];
+    json_object *object;
+
+    switch (op->opcode) {
+      case NW_RULES_OP_CONST: value = op->value; break;
+      case NW_RULES_OP_REF: {
+        object = nw_rules_lookup(&nw_rules_refs[op->argument]);
+        if (object && (json_object_is_type(object, json_type_int) || json_object_is_type(object, json_type_double) ||
+            json_object_is_type(object, json_type_boolean)))
+          value = json_object_get_double(object);
+        else
+          value = NAN;
+        break;
+      }
+      case NW_RULES_OP_COUNT: {
+        object = nw_rules_lookup(&nw_rules_refs[op->argument]);
+        if (json_object_is_type(object, json_type_array))
+          value = json_object_array_length(object);
+        else if (json_object_is_type(object, json_type_object))
+          value = json_object_object_length(object);
+        else
+          value = object ? NAN : 0;
+        break;
+      }
+      case NW_RULES_OP_RATE: {
+        nodewatcher_rules_rate_t *rate = &nw_rules_rates[op->argument];
+        double current = stack[--top];
+        unsigned long runs;
+
+        value = current;
+        if (isnan(current))
+          break;
+
+        /* Rules are also evaluated when other modules finish, which must not move the previous value. */
+        runs = nw_rules_runs(rate);
+        if (!isnan(rate->value) && runs == rate->runs) {
+          value = rate->last;
+          break;
+        }
+
+        value = !isnan(rate->value) && now > rate->time ? (current - rate->value) * 1000000.0 / (now - rate->time) : NAN;
+        rate->value = current;
+        rate->time = now;
+        rate->runs = runs;
+        rate->last = value;
+        break;
+      }
+      case NW_RULES_OP_NEG: value = -stack[--top]; break;
+      default: {
+        double right = stack[--top], left = stack[--top];
+
+        switch (op->opcode) {
+          case NW_RULES_OP_ADD: value = left + right; break;
+          case NW_RULES_OP_SUB: value = left - right; break;
+          case NW_RULES_OP_MUL: value = left * right; break;
+          default: value = right ? left / right : NAN; break;
+        }
+        break;
+      }
+    }
+
+    if (top == NW_RULES_STACK_SIZE)
+      return NAN;
+    stack[top++] = value;
+  }
+
+  return top ? stack[top - 1] : NAN;
+}
+
+static int nw_rules_compare(int compare, double left, double right) {
+
+  switch (compare) {
+    case NW_RULES_LT: return left < right;
+    case NW_RULES_LE: return left <= right;
+    case NW_RULES_GT: return left > right;
+    case NW_RULES_GE: return left >= right;
+    case NW_RULES_EQ: return left == right;
+    default: return left != right;
+  }
+}
+
+static void nw_rules_push(void *arg) {
+
+  UNUSED(arg);
+
+  nw_rules_push_pending = 0;
+  nw_module_push();
+}
+
+static void nw_rules_check(nodewatcher_rules_rule_t *rule, uint64_t now) {
+
+  double value, threshold, clear = NAN;
+  int change;
+
+  value = nw_rules_run(rule->value, now);
+  threshold = nw_rules_run(rule->threshold, now);
+  /* The clear clause runs while the rule is inactive too, so that its rates follow the data. */
+  if (rule->clear_compare >= 0)
+    clear = nw_rules_run(rule->clear, now);
+  if (isnan(value) || isnan(threshold))
+    return;
+  rule->last = value;
+
+  if (!rule->active) {
+    if (!nw_rules_compare(rule->compare, value, threshold))
+      return;
+    change = 1;
+  } else if (rule->clear_compare >= 0) {
+    if (isnan(clear) || !nw_rules_compare(rule->clear_compare, value, clear))
+      return;
+    change = 0;
+  } else {
+    if (nw_rules_compare(rule->compare, value, threshold))
+      return;
+    change = 0;
+  }
+
+  rule->active = change;
+  rule->since = time(NULL);
+  if (change)
+    rule->fired++;
+  syslog(change ? LOG_WARNING : LOG_NOTICE, "Rule '%s' %s (value %g).", rule->name, change ? "fired" : "cleared", value);
+
+  /* Outputs are pushed from the event loop, not from within the module. */
+  if (!nw_rules_push_pending) {
+    nw_rules_push_pending = 1;
+    lu_task_insert(0, nw_rules_push, NULL);
+  }
+}
+
+void nw_rules_evaluate(nodewatcher_module_t *module) {
+
+  uint64_t now;
+  size_t low = 0, high = nw_rules_index_count, middle;
+
+  if (!nw_rules_index_count)
+    return;
+
+  /* Find the first rule referring to the module. */
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (strcmp(nw_rules_index[middle].name, module->name) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  for (; low < nw_rules_index_count && !strcmp(nw_rules_index[low].name, module->name); low++)
+    nw_rules_check(&nw_rules[nw_rules_index[low].rule], now);
+}
+
+json_object *nw_rules_json(void) {
+
+  json_object *object;
+  size_t i;
+
+  if (!nw_rules_count)
+    return NULL;
+
+  object = json_object_new_object();
+  for (i = 0; i < nw_rules_count; i++) {
+    json_object *rule = json_object_new_object();
+
+    json_object_object_add(rule, "active", json_object_new_boolean(nw_rules[i].active));
+    json_object_object_add(rule, "fired", json_object_new_int(nw_rules[i].fired));
+    if (nw_rules[i].since)
+      json_object_object_add(rule, "since", json_object_new_int64(nw_rules[i].since));
+    if (!isnan(nw_rules[i].last))
+      json_object_object_add(rule, "value", json_object_new_double(nw_rules[i].last));
+    json_object_object_add(object, nw_rules[i].name, rule);
+  }
+
+  return object;
+}
+
+static int nw_rules_index_cmp(const void *a, const void *b) {
+
+  const nw_rules_index_t *x = (const nw_rules_index_t *)a;
+  const nw_rules_index_t *y = (const nw_rules_index_t *)b;
+  int cmp = strcmp(x->name, y->name);
+
+  /* Evaluate the rules of a module in file order. */
+  return cmp ? cmp : (x->rule > y->rule) - (x->rule < y->rule);
+}
+
+int nw_rules_init(const lu_args *args) {
+
+  char line[NW_RULES_LINE_LENGTH];
+  char *filename = NULL;
+  unsigned int number = 0;
+  FILE *file;
+  char c;
+
+  while ((c = lu_getopt(args, "r:")) != EOF) {
+    switch (c) {
+      case 'r':
+        if (filename)
+          free(filename);
+        filename = strdup(lu_getarg());
+        break;
+    }
+  }
+
+  if (!filename)
+    return 0;
+
+  file = fopen(filename, "r");
+  if (!file) {
+    syslog(LOG_WARNING, "Rules: Could not open '%s'.", filename);
+    free(filename);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = 0;
+    nw_rules_parse_line(line, ++number);
+  }
+  fclose(file);
+
+  qsort(nw_rules_index, nw_rules_index_count, sizeof(nw_rules_index_t), nw_rules_index_cmp);
+
+  syslog(LOG_INFO, "Rules: Loaded %zu rules from '%s'.", nw_rules_count, filename);
+  free(filename);
+
+  return 0;
+}
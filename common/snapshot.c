@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libre/scheduler.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+/*
+ * Module data published in shared memory (-Z <path>, e.g. in /dev/shm) for
+ * local readers, see snapshot-format.h for the layout and reader/ for the
+ * library reading it. Modules are serialized when they finish an acquisition
+ * and the snapshot is rewritten at most once per event loop round.
+ */
+
+static char *nw_snapshot_path = NULL;
+static int nw_snapshot_fd = -1;
+static uint8_t *nw_snapshot_map = NULL;
+static size_t nw_snapshot_size = 0;
+/* Whether an update is already queued. */
+static int nw_snapshot_pending = 0;
+
+static nodewatcher_snapshot_entry_cache_t *nw_snapshot_entries = NULL;
+static size_t nw_snapshot_count = 0;
+
+/* Entries of the loaded modules in module order, collected for each update. */
+static nodewatcher_snapshot_entry_cache_t **nw_snapshot_loaded = NULL;
+static size_t nw_snapshot_loaded_count = 0;
+static size_t nw_snapshot_loaded_capacity = 0;
+
+static nodewatcher_snapshot_entry_cache_t *nw_snapshot_entry(nodewatcher_module_t *module, int create) {
+
+  nodewatcher_snapshot_entry_cache_t *entries;
+  size_t i;
+
+  for (i = 0; i < nw_snapshot_count; i++) {
+    if (!strcmp(nw_snapshot_entries[i].name, module->name))
+      return &nw_snapshot_entries[i];
+  }
+
+  if (!create)
+    return NULL;
+
+  entries = realloc(nw_snapshot_entries, (nw_snapshot_count + 1) * sizeof(nodewatcher_snapshot_entry_cache_t));
+  if (!entries)
+    return NULL;
+  nw_snapshot_entries = entries;
+
+  memset(&entries[nw_snapshot_count], 0, sizeof(nodewatcher_snapshot_entry_cache_t));
+  entries[nw_snapshot_count].name = strdup(module->name);
+  return &entries[nw_snapshot_count++];
+}
+
+static void nw_snapshot_collect(nodewatcher_module_t *module, void *arg) {
+
+  nodewatcher_snapshot_entry_cache_t *entry = nw_snapshot_entry(module, 0);
+  nodewatcher_snapshot_entry_cache_t **loaded;
+  uint64_t *needed = (uint64_t *)arg;
+
+  if (!entry || entry->module != module || !entry->data)
+    return;
+
+  if (nw_snapshot_loaded_count == nw_snapshot_loaded_capacity) {
+    loaded = realloc(nw_snapshot_loaded, (nw_snapshot_loaded_capacity ? nw_snapshot_loaded_capacity * 2 : 16) *
+      sizeof(nodewatcher_snapshot_entry_cache_t *));
+    if (!loaded)
+      return;
+    nw_snapshot_loaded = loaded;
+    nw_snapshot_loaded_capacity = nw_snapshot_loaded_capacity ? nw_snapshot_loaded_capacity * 2 : 16;
+  }
+
+  nw_snapshot_loaded[nw_snapshot_loaded_count++] = entry;
+  *needed += sizeof(nodewatcher_snapshot_entry_t) + strlen(entry->name) + 1 + entry->length + 1;
+}
+
+/* Makes room for the given number of bytes in a buffer, which must not be the active one. */
+static int nw_snapshot_reserve(uint32_t index, uint64_t needed) {
+
+  nodewatcher_snapshot_header_t *header = (nodewatcher_snapshot_header_t *)nw_snapshot_map;
+  nodewatcher_snapshot_buffer_t *active = &header->buffers[!index];
+  uint64_t capacity = header->buffers[index].capacity;
+  uint64_t offset, size;
+  uint8_t *map;
+
+  if (needed <= capacity)
+    return 0;
+
+  while (capacity < needed)
+    capacity *= 2;
+
+  /* Readers may still be on the active buffer, the new place must not overlap it. */
+  if (NW_SNAPSHOT_HEADER_SIZE + capacity <= active->offset)
+    offset = NW_SNAPSHOT_HEADER_SIZE;
+  else
+    offset = active->offset + active->capacity;
+
+  /* The file only grows, so readers never lose the pages they have mapped. */
+  size = offset + capacity;
+  if (size > nw_snapshot_size) {
+    if (ftruncate(nw_snapshot_fd, size) < 0)
+      return -1;
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, nw_snapshot_fd, 0);
+    if (map == MAP_FAILED)
+      return -1;
+    munmap(nw_snapshot_map, nw_snapshot_size);
+    nw_snapshot_map = map;
+    nw_snapshot_size = size;
+    header = (nodewatcher_snapshot_header_t *)nw_snapshot_map;
+  }
+
+  header->buffers[index].offset = offset;
+  header->buffers[index].capacity = capacity;
+
+  return 0;
+}
+
+static void nw_snapshot_publish(void *arg) {
+
+  nodewatcher_snapshot_header_t *header = (nodewatcher_snapshot_header_t *)nw_snapshot_map;
+  nodewatcher_snapshot_buffer_t *buffer;
+  nodewatcher_snapshot_entry_t *index;
+  nodewatcher_snapshot_entry_cache_t *entry;
+  uint64_t needed = 0, position;
+  uint32_t next, sequence;
+  size_t i, length;
+  uint8_t *base;
+
+  UNUSED(arg);
+
+  nw_snapshot_pending = 0;
+  nw_snapshot_loaded_count = 0;
+  nw_module_foreach(nw_snapshot_collect, &needed);
+
+  /* Readers of the buffer about to be written see its sequence change and retry. */
+  next = !header->active;
+  sequence = header->buffers[next].sequence;
+  __atomic_store_n(&header->buffers[next].sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (nw_snapshot_reserve(next, needed) < 0) {
+    syslog(LOG_WARNING, "Unable to grow snapshot '%s': %m", nw_snapshot_path);
+    header = (nodewatcher_snapshot_header_t *)nw_snapshot_map;
+    __atomic_store_n(&header->buffers[next].sequence, sequence + 2, __ATOMIC_RELEASE);
+    return;
+  }
+
+  header = (nodewatcher_snapshot_header_t *)nw_snapshot_map;
+  buffer = &header->buffers[next];
+  base = nw_snapshot_map + buffer->offset;
+  index = (nodewatcher_snapshot_entry_t *)base;
+  position = nw_snapshot_loaded_count * sizeof(nodewatcher_snapshot_entry_t);
+
+  for (i = 0; i < nw_snapshot_loaded_count; i++) {
+    entry = nw_snapshot_loaded[i];
+    length = strlen(entry->name);
+
+    index[i].name_offset = position;
+    index[i].name_length = length;
+    memcpy(base + position, entry->name, length + 1);
+    position += length + 1;
+
+    index[i].data_offset = position;
+    index[i].data_length = entry->length;
+    memcpy(base + position, entry->data, entry->length + 1);
+    position += entry->length + 1;
+  }
+
+  buffer->count = nw_snapshot_loaded_count;
+  buffer->length = position;
+  buffer->updated = time(NULL);
+
+  __atomic_store_n(&buffer->sequence, sequence + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->active, next, __ATOMIC_RELEASE);
+}
+
+static void nw_snapshot_finished(nodewatcher_module_t *module, void *arg) {
+
+  nodewatcher_snapshot_entry_cache_t *entry;
+  const char *data;
+  size_t length;
+  char *copy;
+
+  UNUSED(arg);
+
+  /* Failed or cancelled acquisitions leave the data as it was. */
+  entry = nw_snapshot_entry(module, 1);
+  if (!entry || (entry->module == module && entry->runs == module->stats.runs) || !module->data)
+    return;
+
+  data = json_object_to_json_string_length(module->data, JSON_C_TO_STRING_PLAIN, &length);
+  copy = realloc(entry->data, length + 1);
+  if (!copy)
+    return;
+  memcpy(copy, data, length + 1);
+
+  entry->data = copy;
+  entry->length = length;
+  entry->module = module;
+  entry->runs = module->stats.runs;
+
+  /* Modules finishing in the same round share one update. */
+  if (!nw_snapshot_pending) {
+    nw_snapshot_pending = 1;
+    lu_task_insert(0, nw_snapshot_publish, NULL);
+  }
+}
+
+/* Tells readers of a snapshot to look for a new one. */
+static void nw_snapshot_retire(int fd) {
+
+  nodewatcher_snapshot_header_t *header;
+  struct stat s;
+
+  if (fstat(fd, &s) < 0 || s.st_size < NW_SNAPSHOT_HEADER_SIZE)
+    return;
+
+  header = mmap(NULL, NW_SNAPSHOT_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED)
+    return;
+
+  if (header->magic == NW_SNAPSHOT_MAGIC)
+    __atomic_store_n(&header->magic, NW_SNAPSHOT_RETIRED, __ATOMIC_RELEASE);
+  munmap(header, NW_SNAPSHOT_HEADER_SIZE);
+}
+
+static void nw_snapshot_exit(void) {
+
+  nw_snapshot_retire(nw_snapshot_fd);
+}
+
+static void nw_snapshot_discard(const char *path) {
+
+  if (nw_snapshot_map)
+    munmap(nw_snapshot_map, nw_snapshot_size);
+  nw_snapshot_map = NULL;
+  close(nw_snapshot_fd);
+  nw_snapshot_fd = -1;
+  unlink(path);
+}
+
+static int nw_snapshot_create(void) {
+
+  nodewatcher_snapshot_header_t *header;
+  char path[PATH_MAX];
+  int previous;
+
+  /* The file is set up aside and renamed into place, readers never see it incomplete. */
+  snprintf(path, sizeof(path), "%s.tmp", nw_snapshot_path);
+  nw_snapshot_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (nw_snapshot_fd < 0)
+    return -1;
+
+  nw_snapshot_size = NW_SNAPSHOT_HEADER_SIZE + 2 * NW_SNAPSHOT_DEFAULT_CAPACITY;
+  if (ftruncate(nw_snapshot_fd, nw_snapshot_size) == 0)
+    nw_snapshot_map = mmap(NULL, nw_snapshot_size, PROT_READ | PROT_WRITE, MAP_SHARED, nw_snapshot_fd, 0);
+  if (!nw_snapshot_map || nw_snapshot_map == MAP_FAILED) {
+    nw_snapshot_map = NULL;
+    nw_snapshot_discard(path);
+    return -1;
+  }
+
+  header = (nodewatcher_snapshot_header_t *)nw_snapshot_map;
+  header->version = NW_SNAPSHOT_VERSION;
+  header->buffers[0].offset = NW_SNAPSHOT_HEADER_SIZE;
+  header->buffers[0].capacity = NW_SNAPSHOT_DEFAULT_CAPACITY;
+  header->buffers[1].offset = NW_SNAPSHOT_HEADER_SIZE + NW_SNAPSHOT_DEFAULT_CAPACITY;
+  header->buffers[1].capacity = NW_SNAPSHOT_DEFAULT_CAPACITY;
+  __atomic_store_n(&header->magic, NW_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+
+  /* Readers of a snapshot left by a previous run move over to this one. */
+  previous = open(nw_snapshot_path, O_RDWR | O_CLOEXEC);
+  if (rename(path, nw_snapshot_path) < 0) {
+    if (previous >= 0)
+      close(previous);
+    nw_snapshot_discard(path);
+    return -1;
+  }
+
+  if (previous >= 0) {
+    nw_snapshot_retire(previous);
+    close(previous);
+  }
+
+  return 0;
+}
+
+int nw_snapshot_init(const lu_args *args) {
+
+  char c;
+
+  while ((c = lu_getopt(args, "Z:")) != EOF) {
+    switch (c) {
+      case 'Z':
+        if (nw_snapshot_path)
+          free(nw_snapshot_path);
+        nw_snapshot_path = strdup(lu_getarg());
+        break;
+    }
+  }
+
+  if (!nw_snapshot_path)
+    return 0;
+
+  if (nw_snapshot_create() < 0) {
+    syslog(LOG_WARNING, "Could not create snapshot '%s': %m", nw_snapshot_path);
+    return -1;
+  }
+  atexit(nw_snapshot_exit);
+
+  nw_module_add_listener(nw_snapshot_finished, NULL);
+  nw_module_foreach(nw_snapshot_finished, NULL);
+
+  syslog(LOG_INFO, "Publishing snapshots to '%s'.", nw_snapshot_path);
+
+  return 0;
+}
@@ -0,0 +1,328 @@
+#include <fcntl.h>
+#include <libre/scheduler.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "modules.h"
+#include "state.h"
+#include "utils.h"
+
+/*
+ * Persisted state. The last data of every module, its run counter and the
+ * baselines it exports through the save_state hook are checkpointed to the
+ * state file (-p) every few minutes (-K) and on SIGTERM. At startup the file
+ * is mapped and each module starts from its last data, marked as restored
+ * until the first acquisition replaces it. Baselines refer to monotonic time
+ * and kernel counters, so they are only handed back within the same boot.
+ */
+
+static char *nw_state_path = NULL;
+static time_t nw_state_interval = NW_STATE_DEFAULT_INTERVAL;
+
+/* State file mapped at startup, released after the first checkpoint. */
+static void *nw_state_map = NULL;
+static size_t nw_state_map_size = 0;
+static char nw_state_boot_id[40];
+/* Whether the mapped state comes from the current boot, -1 if not yet known. */
+static int nw_state_same_boot = -1;
+
+static const char *nw_state_read_boot_id(void) {
+
+  static char boot_id[40];
+  FILE *file;
+
+  if (boot_id[0])
+    return boot_id;
+
+  file = nw_utils_fopen("/proc/sys/kernel/random/boot_id", "r");
+  if (!file)
+    return boot_id;
+  if (fscanf(file, "%39s", boot_id) != 1)
+    boot_id[0] = 0;
+  fclose(file);
+
+  return boot_id;
+}
+
+static void nw_state_release(void) {
+
+  if (nw_state_map)
+    munmap(nw_state_map, nw_state_map_size);
+  nw_state_map = NULL;
+  nw_state_map_size = 0;
+}
+
+static size_t nw_state_pad(size_t length) {
+
+  return (length + 7) & ~(size_t)7;
+}
+
+static int nw_state_map_file(void) {
+
+  const nodewatcher_state_header_t *header;
+  struct stat s;
+  int fd;
+
+  fd = open(nw_state_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &s) < 0 || (size_t)s.st_size < sizeof(nodewatcher_state_header_t)) {
+    close(fd);
+    return -1;
+  }
+
+  nw_state_map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (nw_state_map == MAP_FAILED) {
+    nw_state_map = NULL;
+    return -1;
+  }
+  nw_state_map_size = s.st_size;
+
+  header = (const nodewatcher_state_header_t *)nw_state_map;
+  if (header->magic != NW_STATE_MAGIC || header->version != NW_STATE_VERSION) {
+    syslog(LOG_WARNING, "Ignoring state file '%s' of an unknown format.", nw_state_path);
+    nw_state_release();
+    return -1;
+  }
+
+  memcpy(nw_state_boot_id, header->boot_id, sizeof(nw_state_boot_id));
+  nw_state_boot_id[sizeof(nw_state_boot_id) - 1] = 0;
+
+  return 0;
+}
+
+static const nodewatcher_state_record_t *nw_state_find(const char *name, const char **data, const char **state) {
+
+  const nodewatcher_state_header_t *header = (const nodewatcher_state_header_t *)nw_state_map;
+  const char *position = (const char *)nw_state_map + sizeof(nodewatcher_state_header_t);
+  const char *end = (const char *)nw_state_map + nw_state_map_size;
+  const nodewatcher_state_record_t *record;
+  size_t i, length;
+
+  for (i = 0; i < header->count; i++) {
+    if ((size_t)(end - position) < sizeof(nodewatcher_state_record_t))
+      return NULL;
+    record = (const nodewatcher_state_record_t *)position;
+    position += sizeof(nodewatcher_state_record_t);
+
+    length = nw_state_pad(record->name_length) + nw_state_pad(record->data_length) + nw_state_pad(record->state_length);
+    if ((size_t)(end - position) < length)
+      return NULL;
+
+    if (strlen(name) == record->name_length && !memcmp(position, name, record->name_length)) {
+      *data = position + nw_state_pad(record->name_length);
+      *state = *data + nw_state_pad(record->data_length);
+      return record;
+    }
+    position += length;
+  }
+
+  return NULL;
+}
+
+static json_object *nw_state_parse(const char *string, size_t length) {
+
+  struct json_tokener *tokener;
+  json_object *object;
+
+  if (!length)
+    return NULL;
+
+  tokener = json_tokener_new();
+  if (!tokener)
+    return NULL;
+  object = json_tokener_parse_ex(tokener, string, length);
+  json_tokener_free(tokener);
+
+  if (object && !json_object_is_type(object, json_type_object)) {
+    json_object_put(object);
+    return NULL;
+  }
+
+  return object;
+}
+
+void nw_state_restore(nodewatcher_module_t *module) {
+
+  const nodewatcher_state_record_t *record;
+  const char *data, *state;
+  json_object *object, *meta;
+
+  if (!nw_state_map)
+    return;
+
+  record = nw_state_find(module->name, &data, &state);
+  if (!record)
+    return;
+
+  /* Serve the last data right away, the module replaces it on its first run. */
+  object = nw_state_parse(data, record->data_length);
+  if (object) {
+    json_object_object_get_ex(module->data, "_meta", &meta);
+    json_object_object_add(meta, "restored", json_object_new_boolean(1));
+    json_object_object_add(object, "_meta", json_object_get(meta));
+    json_object_put(module->data);
+    module->data = object;
+    module->supervisor.last_success = record->last_success;
+  }
+  module->stats.runs = record->runs;
+
+  if (nw_state_same_boot < 0)
+    nw_state_same_boot = !strcmp(nw_state_boot_id, nw_state_read_boot_id());
+  if (!nw_state_same_boot || !module->hooks.restore_state)
+    return;
+
+  object = nw_state_parse(state, record->state_length);
+  if (object) {
+    module->hooks.restore_state(module, object);
+    json_object_put(object);
+  }
+}
+
+static int nw_state_write(FILE *file, const char *string, size_t length) {
+
+  static const char padding[8];
+
+  if (length && fwrite(string, length, 1, file) != 1)
+    return -1;
+  if (nw_state_pad(length) != length && fwrite(padding, nw_state_pad(length) - length, 1, file) != 1)
+    return -1;
+
+  return 0;
+}
+
+typedef struct {
+  FILE *file;
+  uint32_t count;
+  int error;
+} nw_state_writer_t;
+
+static void nw_state_save_module(nodewatcher_module_t *module, void *arg) {
+
+  nw_state_writer_t *writer = (nw_state_writer_t *)arg;
+  nodewatcher_state_record_t record;
+  json_object *state = NULL;
+  const char *data = NULL, *baselines = NULL;
+  size_t data_length = 0, state_length = 0;
+
+  if (writer->error)
+    return;
+
+  /* Modules that never produced data have nothing worth keeping. */
+  if (module->supervisor.last_success)
+    data = json_object_to_json_string_length(module->data, JSON_C_TO_STRING_PLAIN, &data_length);
+
+  if (module->hooks.save_state && (state = module->hooks.save_state(module)))
+    baselines = json_object_to_json_string_length(state, JSON_C_TO_STRING_PLAIN, &state_length);
+
+  memset(&record, 0, sizeof(record));
+  record.last_success = module->supervisor.last_success;
+  record.runs = module->stats.runs;
+  record.name_length = strlen(module->name);
+  record.data_length = data_length;
+  record.state_length = state_length;
+
+  if (fwrite(&record, sizeof(record), 1, writer->file) != 1 ||
+      nw_state_write(writer->file, module->name, record.name_length) < 0 ||
+      nw_state_write(writer->file, data, data_length) < 0 ||
+      nw_state_write(writer->file, baselines, state_length) < 0)
+    writer->error = 1;
+  writer->count++;
+
+  if (state)
+    json_object_put(state);
+}
+
+int nw_state_save(void) {
+
+  nodewatcher_state_header_t header;
+  nw_state_writer_t writer;
+  char path[PATH_MAX];
+
+  if (!nw_state_path)
+    return 0;
+
+  /* Write a new file and move it over the old one, so a crash never leaves a partial state behind. */
+  snprintf(path, sizeof(path), "%s.tmp", nw_state_path);
+  writer.file = fopen(path, "we");
+  if (!writer.file) {
+    syslog(LOG_WARNING, "Could not write state file '%s': %m", path);
+    return -1;
+  }
+  writer.count = 0;
+  writer.error = 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = NW_STATE_MAGIC;
+  header.version = NW_STATE_VERSION;
+  header.saved = time(NULL);
+  snprintf(header.boot_id, sizeof(header.boot_id), "%s", nw_state_read_boot_id());
+
+  if (fwrite(&header, sizeof(header), 1, writer.file) != 1)
+    writer.error = 1;
+  nw_module_foreach(nw_state_save_module, &writer);
+
+  header.count = writer.count;
+  if (!writer.error && (fseek(writer.file, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, writer.file) != 1))
+    writer.error = 1;
+  if (fflush(writer.file) || fsync(fileno(writer.file)) < 0)
+    writer.error = 1;
+  fclose(writer.file);
+
+  if (writer.error || rename(path, nw_state_path) < 0) {
+    syslog(LOG_WARNING, "Could not write state file '%s'.", nw_state_path);
+    unlink(path);
+    return -1;
+  }
+
+  /* Modules have taken what they need, later reloads start from scratch. */
+  nw_state_release();
+
+  return 0;
+}
+
+static void nw_state_checkpoint(void *arg) {
+
+  UNUSED(arg);
+
+  nw_state_save();
+  lu_task_insert(nw_state_interval, nw_state_checkpoint, NULL);
+}
+
+int nw_state_init(const lu_args *args) {
+
+  char c;
+
+  while ((c = lu_getopt(args, "p:K:")) != EOF) {
+    switch (c) {
+      case 'p':
+        if (nw_state_path)
+          free(nw_state_path);
+        nw_state_path = strdup(lu_getarg());
+        break;
+      case 'K': nw_state_interval = atoi(lu_getarg()); break;
+    }
+  }
+
+  if (!nw_state_path)
+    return 0;
+
+  if (nw_state_interval <= 0)
+    nw_state_interval = NW_STATE_DEFAULT_INTERVAL;
+
+  if (nw_state_map_file() == 0)
+    syslog(LOG_INFO, "Restoring state from '%s'.", nw_state_path);
+
+  /* The final save on SIGTERM is done by the agent before it exits. */
+  lu_task_insert(nw_state_interval, nw_state_checkpoint, NULL);
+
+  return 0;
+}
@@ -0,0 +1,146 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "accounting.h"
+#include "stats.h"
+
+static const unsigned int nw_stats_bounds[] = NW_STATS_HISTOGRAM_BOUNDS;
+
+/* Event loop lag, in microseconds. */
+static uint64_t nw_stats_lag_last;
+static uint64_t nw_stats_lag_max;
+
+uint64_t nw_stats_clock_us(clockid_t clock) {
+
+  struct timespec ts;
+
+  if (clock_gettime(clock, &ts) < 0)
+    return 0;
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void nw_stats_start(nodewatcher_stats_t *stats) {
+
+  stats->wall_start = nw_stats_clock_us(CLOCK_MONOTONIC);
+  stats->cpu_start = nw_stats_clock_us(CLOCK_THREAD_CPUTIME_ID);
+  nw_accounting_counters(&stats->allocs_start, &stats->bytes_start);
+}
+
+void nw_stats_finish(nodewatcher_stats_t *stats) {
+
+  uint64_t allocs, bytes;
+  unsigned int i;
+
+  /*
+   * Modules that acquire data asynchronously finish from a later event loop
+   * callback, so their CPU time and allocations also cover whatever else the
+   * loop thread did in the meantime.
+   */
+  stats->last_wall = nw_stats_clock_us(CLOCK_MONOTONIC) - stats->wall_start;
+  stats->last_cpu = nw_stats_clock_us(CLOCK_THREAD_CPUTIME_ID) - stats->cpu_start;
+  nw_accounting_counters(&allocs, &bytes);
+  stats->last_allocs = allocs - stats->allocs_start;
+  stats->last_alloc_bytes = bytes - stats->bytes_start;
+
+  stats->runs++;
+  stats->total_wall += stats->last_wall;
+  stats->total_cpu += stats->last_cpu;
+  if (stats->last_wall > stats->max_wall)
+    stats->max_wall = stats->last_wall;
+
+  for (i = 0; i < NW_STATS_HISTOGRAM_BUCKETS - 1; i++) {
+    if (stats->last_wall < nw_stats_bounds[i] * 1000ULL)
+      break;
+  }
+  stats->histogram[i]++;
+}
+
+json_object *nw_stats_to_json(const nodewatcher_stats_t *stats) {
+
+  unsigned int i;
+  char key[16];
+
+  json_object *object = json_object_new_object();
+  json_object_object_add(object, "runs", json_object_new_int64(stats->runs));
+  json_object_object_add(object, "failures", json_object_new_int64(stats->failures));
+  json_object_object_add(object, "timeouts", json_object_new_int64(stats->timeouts));
+  json_object_object_add(object, "wall_time_us", json_object_new_int64(stats->last_wall));
+  json_object_object_add(object, "cpu_time_us", json_object_new_int64(stats->last_cpu));
+  json_object_object_add(object, "max_wall_time_us", json_object_new_int64(stats->max_wall));
+  json_object_object_add(object, "total_wall_time_us", json_object_new_int64(stats->total_wall));
+  json_object_object_add(object, "total_cpu_time_us", json_object_new_int64(stats->total_cpu));
+  json_object_object_add(object, "allocs", json_object_new_int64(stats->last_allocs));
+  json_object_object_add(object, "alloc_bytes", json_object_new_int64(stats->last_alloc_bytes));
+
+  /* Histogram is keyed by the bucket's upper bound in milliseconds. */
+  json_object *histogram = json_object_new_object();
+  for (i = 0; i < NW_STATS_HISTOGRAM_BUCKETS; i++) {
+    if (i < NW_STATS_HISTOGRAM_BUCKETS - 1)
+      snprintf(key, sizeof(key), "%u", nw_stats_bounds[i]);
+    else
+      snprintf(key, sizeof(key), "inf");
+    json_object_object_add(histogram, key, json_object_new_int64(stats->histogram[i]));
+  }
+  json_object_object_add(object, "histogram_ms", histogram);
+
+  return object;
+}
+
+void nw_stats_loop_lag(uint64_t lag) {
+
+  nw_stats_lag_last = lag;
+  if (lag > nw_stats_lag_max)
+    nw_stats_lag_max = lag;
+}
+
+static long nw_stats_rss(void) {
+
+  long pages;
+  FILE *file = fopen("/proc/self/statm", "r");
+
+  if (!file)
+    return -1;
+
+  if (fscanf(file, "%*s %ld", &pages) != 1)
+    pages = -1;
+  fclose(file);
+
+  return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int nw_stats_fd_count(void) {
+
+  int count = 0;
+  struct dirent *entry;
+  DIR *dir = opendir("/proc/self/fd");
+
+  if (!dir)
+    return -1;
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.')
+      count++;
+  }
+  closedir(dir);
+
+  /* Do not count the descriptor used for the listing itself. */
+  return count - 1;
+}
+
+json_object *nw_stats_agent_json(void) {
+
+  json_object *object = json_object_new_object();
+
+  json_object_object_add(object, "rss", json_object_new_int64(nw_stats_rss()));
+  json_object_object_add(object, "fds", json_object_new_int(nw_stats_fd_count()));
+  json_object_object_add(object, "cpu_time_us", json_object_new_int64(nw_stats_clock_us(CLOCK_PROCESS_CPUTIME_ID)));
+
+  json_object *lag = json_object_new_object();
+  json_object_object_add(lag, "last_us", json_object_new_int64(nw_stats_lag_last));
+  json_object_object_add(lag, "max_us", json_object_new_int64(nw_stats_lag_max));
+  json_object_object_add(object, "loop_lag", lag);
+
+  return object;
+}
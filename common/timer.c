@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <libre/scheduler.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "modules.h"
+#include "timer.h"
+
+/*
+ * Monotonic timers with microsecond due times, kept in a binary min-heap and
+ * dispatched from the event loop through a single timerfd that is always set
+ * to the earliest of them. Jumps of the wall clock do not affect them.
+ */
+
+static int nw_timer_fd = -1;
+/* Heap of armed timers, counted from one. */
+static nodewatcher_timer_t **nw_timer_heap = NULL;
+static size_t nw_timer_count = 0;
+static size_t nw_timer_capacity = 0;
+/* Set while expired timers run, the timerfd is only set once they are done. */
+static int nw_timer_dispatching = 0;
+
+static void nw_timer_place(nodewatcher_timer_t *timer, size_t slot) {
+
+  nw_timer_heap[slot] = timer;
+  timer->slot = slot;
+}
+
+static void nw_timer_sift_up(size_t slot) {
+
+  nodewatcher_timer_t *timer = nw_timer_heap[slot];
+
+  while (slot > 1 && nw_timer_heap[slot / 2]->due > timer->due) {
+    nw_timer_place(nw_timer_heap[slot / 2], slot);
+    slot /= 2;
+  }
+  nw_timer_place(timer, slot);
+}
+
+static void nw_timer_sift_down(size_t slot) {
+
+  nodewatcher_timer_t *timer = nw_timer_heap[slot];
+  size_t child;
+
+  while ((child = slot * 2) <= nw_timer_count) {
+    if (child < nw_timer_count && nw_timer_heap[child + 1]->due < nw_timer_heap[child]->due)
+      child++;
+    if (nw_timer_heap[child]->due >= timer->due)
+      break;
+    nw_timer_place(nw_timer_heap[child], slot);
+    slot = child;
+  }
+  nw_timer_place(timer, slot);
+}
+
+/* Sets the timerfd to the earliest due time, or disarms it when there are no timers. */
+static void nw_timer_program(void) {
+
+  struct itimerspec spec;
+
+  if (nw_timer_fd < 0 || nw_timer_dispatching)
+    return;
+
+  memset(&spec, 0, sizeof(spec));
+  if (nw_timer_count) {
+    /* A zero value would disarm the timerfd. */
+    uint64_t due = nw_timer_heap[1]->due ? nw_timer_heap[1]->due : 1;
+
+    spec.it_value.tv_sec = due / 1000000;
+    spec.it_value.tv_nsec = (due % 1000000) * 1000;
+  }
+
+  if (timerfd_settime(nw_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    syslog(LOG_WARNING, "Unable to set the timer: %m");
+}
+
+void nw_timer_arm(nodewatcher_timer_t *timer, uint64_t due, void (*callback)(void *), void *arg) {
+
+  nodewatcher_timer_t **heap;
+
+  nw_timer_disarm(timer);
+
+  if (nw_timer_count + 1 >= nw_timer_capacity) {
+    heap = realloc(nw_timer_heap, (nw_timer_capacity ? nw_timer_capacity * 2 : 64) * sizeof(nodewatcher_timer_t *));
+    if (!heap) {
+      syslog(LOG_ERR, "Unable to grow the timer heap!");
+      return;
+    }
+    nw_timer_heap = heap;
+    nw_timer_capacity = nw_timer_capacity ? nw_timer_capacity * 2 : 64;
+  }
+
+  timer->due = due;
+  timer->callback = callback;
+  timer->arg = arg;
+  nw_timer_heap[++nw_timer_count] = timer;
+  nw_timer_sift_up(nw_timer_count);
+
+  if (timer->slot == 1)
+    nw_timer_program();
+}
+
+void nw_timer_disarm(nodewatcher_timer_t *timer) {
+
+  size_t slot = timer->slot;
+  nodewatcher_timer_t *last;
+
+  if (!slot)
+    return;
+
+  timer->slot = 0;
+  last = nw_timer_heap[nw_timer_count--];
+  if (last != timer) {
+    /* Move the last timer into the hole, it may belong either above or below it. */
+    nw_timer_place(last, slot);
+    if (slot > 1 && nw_timer_heap[slot / 2]->due > last->due)
+      nw_timer_sift_up(slot);
+    else
+      nw_timer_sift_down(slot);
+  }
+
+  if (slot == 1)
+    nw_timer_program();
+}
+
+static void nw_timer_dispatch(void *arg) {
+
+  uint64_t expirations, now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  nodewatcher_timer_t *timer;
+
+  UNUSED(arg);
+
+  if (read(nw_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    syslog(LOG_WARNING, "Unable to read the timer: %m");
+
+  /* Timers armed by callbacks for a time already passed run in this round as well. */
+  nw_timer_dispatching = 1;
+  while (nw_timer_count && nw_timer_heap[1]->due <= now) {
+    timer = nw_timer_heap[1];
+    nw_timer_disarm(timer);
+    timer->callback(timer->arg);
+  }
+  nw_timer_dispatching = 0;
+
+  nw_timer_program();
+}
+
+int nw_timer_init(void) {
+
+  lu_fdn_t fdn;
+
+  if (nw_timer_fd >= 0)
+    return 0;
+
+  nw_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (nw_timer_fd < 0) {
+    syslog(LOG_ERR, "Unable to create the scheduler timer: %m");
+    return -1;
+  }
+
+  fdn.fd = nw_timer_fd;
+  fdn.recv = nw_timer_dispatch;
+  fdn.options = LS_READ;
+  fdn.data = NULL;
+  lu_fd_add(&fdn);
+
+  /* Timers may have been armed before. */
+  nw_timer_program();
+
+  return 0;
+}
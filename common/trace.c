@@ -0,0 +1,126 @@
+#include <libre/scheduler.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/* Strings are copied, spans may outlive the module that recorded them. */
+typedef struct {
+  char name[48];
+  char category[16];
+  uint64_t ts;
+  uint64_t dur;
+  /* Set once the slot has been completely written. */
+  uint64_t seq;
+} nodewatcher_trace_span_t;
+
+static nodewatcher_trace_span_t nw_trace_ring[NW_TRACE_RING_SIZE];
+static uint64_t nw_trace_head;
+static char *nw_trace_filename = NULL;
+
+uint64_t nw_trace_begin(void) {
+
+  if (!nw_trace_filename)
+    return 0;
+
+  return nw_stats_clock_us(CLOCK_MONOTONIC);
+}
+
+void nw_trace_end(const char *name, const char *category, uint64_t start) {
+
+  nodewatcher_trace_span_t *span;
+  uint64_t seq;
+
+  if (!nw_trace_filename || !start)
+    return;
+
+  /* Reserve a slot, writers never wait on each other or on the flusher. */
+  seq = __atomic_fetch_add(&nw_trace_head, 1, __ATOMIC_RELAXED);
+  span = &nw_trace_ring[seq % NW_TRACE_RING_SIZE];
+
+  __atomic_store_n(&span->seq, 0, __ATOMIC_RELAXED);
+  snprintf(span->name, sizeof(span->name), "%s", name);
+  snprintf(span->category, sizeof(span->category), "%s", category);
+  span->ts = start;
+  span->dur = nw_stats_clock_us(CLOCK_MONOTONIC) - start;
+  __atomic_store_n(&span->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+int nw_trace_flush(void) {
+
+  uint64_t head, seq, i;
+  nodewatcher_trace_span_t span;
+  char path[PATH_MAX];
+  int first = 1;
+
+  if (!nw_trace_filename)
+    return -1;
+
+  snprintf(path, sizeof(path), "%s.tmp", nw_trace_filename);
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    syslog(LOG_WARNING, "Unable to write trace file '%s'.", path);
+    return -1;
+  }
+
+  head = __atomic_load_n(&nw_trace_head, __ATOMIC_ACQUIRE);
+  i = head > NW_TRACE_RING_SIZE ? head - NW_TRACE_RING_SIZE : 0;
+
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (; i < head; i++) {
+    span = nw_trace_ring[i % NW_TRACE_RING_SIZE];
+    seq = __atomic_load_n(&nw_trace_ring[i % NW_TRACE_RING_SIZE].seq, __ATOMIC_ACQUIRE);
+
+    /* Skip slots which are being written or have already been reused. */
+    if (span.seq != i + 1 || seq != i + 1)
+      continue;
+
+    fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%ld}",
+      first ? "" : ",", span.name, span.category, (unsigned long long)span.ts, (unsigned long long)span.dur,
+      getpid(), (long)syscall(SYS_gettid));
+    first = 0;
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+
+  return rename(path, nw_trace_filename);
+}
+
+static void nw_trace_flush_task(void *arg) {
+
+  nw_trace_flush();
+  lu_task_insert(NW_TRACE_FLUSH_INTERVAL, nw_trace_flush_task, arg);
+}
+
+static void nw_trace_exit(void) {
+
+  nw_trace_flush();
+}
+
+int nw_trace_init(const lu_args *args) {
+
+  char c;
+
+  while ((c = lu_getopt(args, "T:")) != EOF) {
+    switch (c) {
+      case 'T':
+        if (nw_trace_filename)
+          free(nw_trace_filename);
+        nw_trace_filename = strdup(lu_getarg());
+        break;
+    }
+  }
+
+  if (!nw_trace_filename)
+    return 0;
+
+  syslog(LOG_INFO, "Tracing event loop to '%s'.", nw_trace_filename);
+  lu_task_insert(NW_TRACE_FLUSH_INTERVAL, nw_trace_flush_task, (void *)nw_trace_ring);
+  atexit(nw_trace_exit);
+
+  return 0;
+}
@@ -1,11 +1,16 @@
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <json-c/json.h>
 
 #include "utils.h"
 
+/* Prefix for absolute paths of system files, allows modules to run against a fixture tree. */
+static char *nw_utils_root = NULL;
+
 char *nw_utils_string_trim(char *str) {
 
   char *end;
@@ -33,7 +38,7 @@ int nw_utils_string_cmp(char *str1, const char* str2) {
 
 int nw_file_line_count(const char *filename) {
 
-  FILE *file = fopen(filename, "r");
+  FILE *file = nw_utils_fopen(filename, "r");
 
   if (!file)
     return -1;
@@ -53,7 +58,7 @@ int nw_json_from_file(const char *filename,
                       const char *key,
                       int integer) {
   char tmp[1024];
-  FILE *file = fopen(filename, "r");
+  FILE *file = nw_utils_fopen(filename, "r");
   if (!file)
     return -1;
 
@@ -82,3 +87,40 @@ int nw_json_from_file(const char *filename,
   free(buffer);
   return 0;
 }
+
+void nw_utils_set_root(const char *root) {
+
+  if (nw_utils_root)
+    free(nw_utils_root);
+
+  /* An empty root or "/" is the same as no root at all. */
+  if (!root || !*root || !strcmp(root, "/")) {
+    nw_utils_root = NULL;
+    return;
+  }
+
+  nw_utils_root = strdup(root);
+}
+
+const char *nw_utils_path(char *buffer, size_t size, const char *path) {
+
+  if (!nw_utils_root || path[0] != '/')
+    return path;
+
+  snprintf(buffer, size, "%s%s", nw_utils_root, path);
+  return buffer;
+}
+
+FILE *nw_utils_fopen(const char *path, const char *mode) {
+
+  char buffer[PATH_MAX];
+
+  return fopen(nw_utils_path(buffer, sizeof(buffer), path), mode);
+}
+
+DIR *nw_utils_opendir(const char *path) {
+
+  char buffer[PATH_MAX];
+
+  return opendir(nw_utils_path(buffer, sizeof(buffer), path));
+}
@@ -0,0 +1,31 @@
+#ifndef NODEWATCHER_ACCOUNTING_H
+#define NODEWATCHER_ACCOUNTING_H
+
+#include <json-c/json.h>
+#include <libre/config.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of records kept of each list in module data that exceeds its budget. */
+#define NW_ACCOUNTING_DEFAULT_TOPN 16
+/* Maximum length of the path of a truncated value. */
+#define NW_ACCOUNTING_PATH_LENGTH 256
+
+/* Approximate heap cost of json-c values, used to estimate the size of module data. */
+#define NW_ACCOUNTING_JSON_VALUE 64
+#define NW_ACCOUNTING_JSON_ENTRY 40
+#define NW_ACCOUNTING_JSON_SLOT 8
+
+typedef struct nodewatcher_accounting_budget {
+  char *name;
+  size_t limit;
+  size_t topn;
+  struct nodewatcher_accounting_budget *next;
+} nodewatcher_accounting_budget_t;
+
+int nw_accounting_init(const lu_args *);
+void nw_accounting_counters(uint64_t *, uint64_t *);
+size_t nw_accounting_json_size(json_object *);
+json_object *nw_accounting_enforce(const char *, json_object *);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef NODEWATCHER_BATCH_H
+#define NODEWATCHER_BATCH_H
+
+#include <sys/types.h>
+
+/* Number of reads submitted to the kernel at once. */
+#define NW_BATCH_SIZE 256
+
+typedef struct {
+  /* File to open, read and close, used only when fd is negative. */
+  const char *path;
+  /* Already open file, read from offset zero and left open. */
+  int fd;
+  char *buffer;
+  size_t size;
+  /* Number of bytes read, or a negative errno. The buffer is NUL terminated. */
+  ssize_t length;
+} nodewatcher_batch_read_t;
+
+int nw_batch_read(nodewatcher_batch_read_t *, size_t);
+
+#endif
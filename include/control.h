@@ -0,0 +1,15 @@
+#ifndef NODEWATCHER_CONTROL_H
+#define NODEWATCHER_CONTROL_H
+
+#include <libre/config.h>
+
+/* Age (in seconds) below which refresh requests are answered from the current data. */
+#define NW_CONTROL_DEFAULT_WINDOW 1
+/* Maximum length of a request line. */
+#define NW_CONTROL_LINE_LENGTH 256
+/* Time (in seconds) a client may take to accept a reply before it is dropped. */
+#define NW_CONTROL_SEND_TIMEOUT 1
+
+int nw_control_init(const lu_args *);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef NODEWATCHER_EXPORTER_H
+#define NODEWATCHER_EXPORTER_H
+
+#include <libre/config.h>
+
+/* Maximum length of a metric name. */
+#define NW_EXPORTER_NAME_LENGTH 256
+/* Time (in seconds) a scraper may take to send its request and read the reply. */
+#define NW_EXPORTER_TIMEOUT 10
+/* Maximum number of scrapes served at once. */
+#define NW_EXPORTER_MAX_CLIENTS 8
+
+int nw_exporter_init(const lu_args *);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef NODEWATCHER_HISTORY_H
+#define NODEWATCHER_HISTORY_H
+
+#include <json-c/json.h>
+#include <libre/config.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Memory (in bytes) shared by all series when -Y is not given. */
+#define NW_HISTORY_DEFAULT_BUDGET (256 * 1024)
+/* Size of the compressed payload of one block. */
+#define NW_HISTORY_BLOCK_SIZE 256
+/* Raw samples, 5 minute and 1 hour averages. */
+#define NW_HISTORY_TIERS 3
+#define NW_HISTORY_RESOLUTIONS { 0, 300, 3600 }
+#define NW_HISTORY_TIER_NAMES { "raw", "5m", "1h" }
+
+typedef struct {
+  /* First sample of the block, stored in full. */
+  int64_t time;
+  uint64_t value;
+  uint16_t count;
+  /* Number of bits used in data. */
+  uint16_t bits;
+  unsigned char data[NW_HISTORY_BLOCK_SIZE];
+} nodewatcher_history_block_t;
+
+typedef struct {
+  /* Bucket length in seconds, zero for raw samples. */
+  time_t resolution;
+  /* Ring of blocks, the current one is at head and the oldest are overwritten. */
+  nodewatcher_history_block_t *blocks;
+  size_t capacity;
+  size_t head;
+  size_t used;
+  /* Encoder state of the current block. */
+  int64_t time;
+  int64_t delta;
+  uint64_t value;
+  int leading;
+  int trailing;
+  /* Bucket being averaged. */
+  int64_t bucket;
+  double sum;
+  unsigned int samples;
+} nodewatcher_history_tier_t;
+
+typedef struct {
+  char *module;
+  /* Dotted path of a numeric field in the module data. */
+  char *path;
+  /* Run counter of the last recorded acquisition. */
+  unsigned int runs;
+  nodewatcher_history_tier_t tiers[NW_HISTORY_TIERS];
+} nodewatcher_history_series_t;
+
+int nw_history_init(const lu_args *);
+json_object *nw_history_query(const char *module);
+
+#endif
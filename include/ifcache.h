@@ -0,0 +1,38 @@
+#ifndef NODEWATCHER_IFCACHE_H
+#define NODEWATCHER_IFCACHE_H
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+/* Size of the buffer used to receive netlink messages. */
+#define NW_IFCACHE_BUFFER_SIZE 32768
+
+typedef struct {
+  int index;
+  char name[IF_NAMESIZE];
+  unsigned int flags;
+  unsigned int mtu;
+  unsigned char operstate;
+  unsigned char address[32];
+  size_t address_length;
+} nodewatcher_ifcache_link_t;
+
+typedef struct {
+  int index;
+  int family;
+  unsigned char prefix_length;
+  unsigned char scope;
+  union {
+    struct in_addr in;
+    struct in6_addr in6;
+  } address;
+} nodewatcher_ifcache_addr_t;
+
+int nw_ifcache_init(void);
+uint64_t nw_ifcache_generation(void);
+const nodewatcher_ifcache_link_t *nw_ifcache_link(int);
+void nw_ifcache_foreach_link(void (*)(const nodewatcher_ifcache_link_t *, void *), void *);
+void nw_ifcache_foreach_addr(void (*)(const nodewatcher_ifcache_addr_t *, void *), void *);
+
+#endif
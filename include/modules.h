@@ -5,10 +5,44 @@
 #include <json-c/json.h>
 #include <libre/config.h>
 #include <syslog.h>
+#include <sys/types.h>
 #include <time.h>
 
+#include "stats.h"
+#include "timer.h"
+
 #define UNUSED(x) (void)(x)
+#ifdef NW_STATIC_MODULES
+/* Built-in modules keep their descriptor private and register it in the nw_modules section. */
+#define MODULE_DESC \
+  static nodewatcher_module_t nw_module; \
+  static nodewatcher_module_t *const nw_module_entry __attribute__((used, section("nw_modules"))) = &nw_module; \
+  static nodewatcher_module_t nw_module
+#else
 #define MODULE_DESC nodewatcher_module_t nw_module __attribute__((visibility("default")))
+#endif
+
+/* Time (in seconds) a module may take to acquire data when it does not set its own deadline. */
+#define NW_MODULE_DEFAULT_DEADLINE 30
+/* Number of unchanged acquisitions after which an adaptive module backs off. */
+#define NW_MODULE_ADAPTIVE_CYCLES 3
+/* Maximum number of callbacks notified when an acquisition ends. */
+#define NW_MODULE_MAX_LISTENERS 8
+
+/* Time (in seconds) between two checks of the agent CPU usage against its budget. */
+#define NW_MODULE_THROTTLE_PERIOD 10
+/* Intervals of throttled modules are stretched by up to 2^level. */
+#define NW_MODULE_THROTTLE_MAX_LEVEL 3
+/* CPU pressure (avg10 in percent) and load per CPU above which the host is considered overloaded. */
+#define NW_MODULE_THROTTLE_PRESSURE 40
+#define NW_MODULE_THROTTLE_LOAD 2
+/* Average CPU time (in microseconds) per acquisition below which stretching a module is not worth it. */
+#define NW_MODULE_THROTTLE_CHEAP_US 1000
+
+/* Module flags. */
+#define NW_MODULE_OUTPUT 0x1
+/* Never throttled. */
+#define NW_MODULE_ESSENTIAL 0x2
 
 enum {
   NW_MODULE_NONE = 0,
@@ -19,6 +53,13 @@ enum {
 
 typedef struct {
   time_t refresh_interval;
+  /* Refresh interval in milliseconds, used instead of refresh_interval when set. */
+  unsigned int refresh_interval_ms;
+  time_t deadline;
+  /* Upper bound for the refresh interval in adaptive mode, zero disables backing off. */
+  time_t max_interval;
+  /* Name of a module whose changes restore the base refresh interval. */
+  const char *related;
 } nodewatcher_module_schedule_t;
 
 typedef struct nodewatcher_module nodewatcher_module_t;
@@ -26,27 +67,67 @@ typedef struct nodewatcher_module nodewatcher_module_t;
 typedef struct {
   int (*init)(nodewatcher_module_t *module);
   int (*start_acquire_data)(nodewatcher_module_t *module);
+  void (*cancel_acquire_data)(nodewatcher_module_t *module);
+  void (*cleanup)(nodewatcher_module_t *module);
+  /* Baselines worth keeping across restarts, and their restoration right after init. */
+  json_object *(*save_state)(nodewatcher_module_t *module);
+  void (*restore_state)(nodewatcher_module_t *module, json_object *state);
 } nodewatcher_module_hooks_t;
 
+typedef struct {
+  /* Passed to the deadline timer, which runs independently of the module timer. */
+  nodewatcher_module_t *module;
+  nodewatcher_timer_t timer;
+  time_t last_success;
+} nodewatcher_module_supervisor_t;
+
+typedef struct {
+  /* Currently used refresh interval, in milliseconds. */
+  time_t interval;
+  unsigned int unchanged;
+  uint32_t hash;
+} nodewatcher_module_adaptive_t;
+
 typedef struct nodewatcher_module {
   const char *name;
   const char *author;
   const unsigned int version;
+  const unsigned int flags;
   const nodewatcher_module_hooks_t hooks;
   nodewatcher_module_schedule_t schedule;
   const lu_args *args;
   json_object *data;
   int sched_status;
+  nodewatcher_timer_t timer;
+  nodewatcher_stats_t stats;
+  nodewatcher_module_supervisor_t supervisor;
+  nodewatcher_module_adaptive_t adaptive;
 } nodewatcher_module_t;
 
-typedef struct nodewatcher_module_node {
+typedef struct {
   nodewatcher_module_t *module;
-  struct nodewatcher_module_node *next;
-} nodewatcher_module_node_t;
+  /* Library the module comes from, shared with any instances the module registers. */
+  void *handle;
+  /* Library path and identity, only set for the module the library was loaded for. */
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+} nodewatcher_module_entry_t;
 
 int nw_module_init(const lu_args *);
+int nw_module_reload(void);
+int nw_module_register(nodewatcher_module_t *module);
+nodewatcher_module_t *nw_module_find(const char *name);
+void nw_module_foreach(void (*callback)(nodewatcher_module_t *, void *), void *arg);
 int nw_module_start_acquire_data(nodewatcher_module_t *module);
 int nw_module_finish_acquire_data(nodewatcher_module_t *module, json_object *object);
+void nw_module_timeout_acquire_data(nodewatcher_module_t *module);
+int nw_module_refresh(nodewatcher_module_t *module, time_t window);
+void nw_module_push(void);
+int nw_module_add_listener(void (*callback)(nodewatcher_module_t *, void *), void *arg);
+unsigned int nw_module_throttle_level(void);
 json_object *nw_module_get_output();
 
 #endif
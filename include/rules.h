@@ -0,0 +1,88 @@
+#ifndef NODEWATCHER_RULES_H
+#define NODEWATCHER_RULES_H
+
+#include <json-c/json.h>
+#include <libre/config.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "modules.h"
+
+/* Maximum length of a rule line. */
+#define NW_RULES_LINE_LENGTH 512
+/* Depth of the evaluation stack, deeper expressions are rejected. */
+#define NW_RULES_STACK_SIZE 16
+
+enum {
+  NW_RULES_OP_CONST,
+  NW_RULES_OP_REF,
+  NW_RULES_OP_COUNT,
+  NW_RULES_OP_RATE,
+  NW_RULES_OP_NEG,
+  NW_RULES_OP_ADD,
+  NW_RULES_OP_SUB,
+  NW_RULES_OP_MUL,
+  NW_RULES_OP_DIV,
+};
+
+enum {
+  NW_RULES_LT,
+  NW_RULES_LE,
+  NW_RULES_GT,
+  NW_RULES_GE,
+  NW_RULES_EQ,
+  NW_RULES_NE,
+};
+
+typedef struct {
+  uint8_t opcode;
+  /* Reference or rate slot. */
+  uint32_t argument;
+  double value;
+} nodewatcher_rules_op_t;
+
+/* Field of module data, with its path split into keys when the rule is compiled. */
+typedef struct {
+  char *module;
+  char **keys;
+  /* Array index of each key, -1 if the key is not a number. */
+  long *indices;
+  size_t depth;
+} nodewatcher_rules_ref_t;
+
+typedef struct {
+  double value;
+  uint64_t time;
+  /* References inside the rate, the previous value only moves on when one of their modules ran. */
+  uint32_t ref_offset;
+  uint32_t ref_count;
+  unsigned long runs;
+  /* Rate between the two latest results. */
+  double last;
+} nodewatcher_rules_rate_t;
+
+/* Programs are ranges of the shared op array. */
+typedef struct {
+  uint32_t offset;
+  uint32_t length;
+} nodewatcher_rules_program_t;
+
+typedef struct {
+  char *name;
+  nodewatcher_rules_program_t value;
+  int compare;
+  nodewatcher_rules_program_t threshold;
+  /* Optional condition that clears an active rule, for hysteresis. */
+  int clear_compare;
+  nodewatcher_rules_program_t clear;
+  int active;
+  unsigned int fired;
+  time_t since;
+  double last;
+} nodewatcher_rules_rule_t;
+
+int nw_rules_init(const lu_args *);
+void nw_rules_evaluate(nodewatcher_module_t *module);
+json_object *nw_rules_json(void);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef NODEWATCHER_SNAPSHOT_FORMAT_H
+#define NODEWATCHER_SNAPSHOT_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the shared memory snapshot, shared by the agent and the reader
+ * library. The region starts with a header describing two buffers, one of
+ * them active. The agent writes the inactive buffer and then makes it active,
+ * so readers of the active buffer never wait. Each buffer has its own
+ * sequence, odd while it is written: readers copy what they need and retry if
+ * the sequence changed meanwhile.
+ */
+
+#define NW_SNAPSHOT_MAGIC 0x50534e4e
+/* Written over the magic when the agent exits or replaces the file. */
+#define NW_SNAPSHOT_RETIRED 0
+#define NW_SNAPSHOT_VERSION 1
+/* Size of the header, buffers start after it. */
+#define NW_SNAPSHOT_HEADER_SIZE 4096
+
+typedef struct {
+  uint32_t sequence;
+  /* Number of modules in the buffer. */
+  uint32_t count;
+  /* Position and size of the buffer within the region, in bytes. */
+  uint64_t offset;
+  uint64_t capacity;
+  /* Bytes used of the buffer. */
+  uint64_t length;
+  /* Wall clock time of the last update, in seconds. */
+  int64_t updated;
+} nodewatcher_snapshot_buffer_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  /* Index of the buffer readers should use. */
+  uint32_t active;
+  uint32_t reserved;
+  nodewatcher_snapshot_buffer_t buffers[2];
+} nodewatcher_snapshot_header_t;
+
+/*
+ * Buffers start with one entry per module, sorted by name, followed by the
+ * NUL terminated names and JSON data. Offsets are from the start of the buffer
+ * and lengths do not include the terminator.
+ */
+typedef struct {
+  uint32_t name_offset;
+  uint32_t name_length;
+  uint32_t data_offset;
+  uint32_t data_length;
+} nodewatcher_snapshot_entry_t;
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef NODEWATCHER_SNAPSHOT_H
+#define NODEWATCHER_SNAPSHOT_H
+
+#include <libre/config.h>
+
+#include "modules.h"
+#include "snapshot-format.h"
+
+/* Initial capacity of each snapshot buffer, buffers grow to fit the data. */
+#define NW_SNAPSHOT_DEFAULT_CAPACITY 65536
+
+/* Last serialized data of a module. */
+typedef struct {
+  char *name;
+  nodewatcher_module_t *module;
+  unsigned int runs;
+  char *data;
+  size_t length;
+} nodewatcher_snapshot_entry_cache_t;
+
+int nw_snapshot_init(const lu_args *);
+
+#endif
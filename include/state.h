@@ -0,0 +1,37 @@
+#ifndef NODEWATCHER_STATE_H
+#define NODEWATCHER_STATE_H
+
+#include <libre/config.h>
+#include <stdint.h>
+
+#include "modules.h"
+
+/* Time (in seconds) between two checkpoints of the state file. */
+#define NW_STATE_DEFAULT_INTERVAL 300
+#define NW_STATE_MAGIC 0x5453574e
+#define NW_STATE_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  /* Module baselines are only restored within the same boot. */
+  char boot_id[40];
+  int64_t saved;
+  uint32_t count;
+  uint32_t reserved;
+} nodewatcher_state_header_t;
+
+/* Followed by the module name, its last data and its baselines, each padded to 8 bytes. */
+typedef struct {
+  int64_t last_success;
+  uint32_t runs;
+  uint32_t name_length;
+  uint32_t data_length;
+  uint32_t state_length;
+} nodewatcher_state_record_t;
+
+int nw_state_init(const lu_args *);
+void nw_state_restore(nodewatcher_module_t *module);
+int nw_state_save(void);
+
+#endif
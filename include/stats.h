@@ -0,0 +1,44 @@
+#ifndef NODEWATCHER_STATS_H
+#define NODEWATCHER_STATS_H
+
+#include <json-c/json.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Upper bounds (in milliseconds) of the acquisition latency histogram, the last bucket is open. */
+#define NW_STATS_HISTOGRAM_BOUNDS { 1, 5, 10, 50, 100, 500, 1000 }
+#define NW_STATS_HISTOGRAM_BUCKETS 8
+
+typedef struct {
+  /* Current acquisition. */
+  uint64_t wall_start;
+  uint64_t cpu_start;
+  uint64_t allocs_start;
+  uint64_t bytes_start;
+  /* Monotonic time at which the module task is due to run. */
+  uint64_t due;
+
+  unsigned int runs;
+  unsigned int failures;
+  unsigned int timeouts;
+
+  /* Times are in microseconds. */
+  uint64_t last_wall;
+  uint64_t last_cpu;
+  uint64_t max_wall;
+  uint64_t total_wall;
+  uint64_t total_cpu;
+  /* Allocations made by the last acquisition, and their size in bytes. */
+  uint64_t last_allocs;
+  uint64_t last_alloc_bytes;
+  unsigned int histogram[NW_STATS_HISTOGRAM_BUCKETS];
+} nodewatcher_stats_t;
+
+uint64_t nw_stats_clock_us(clockid_t);
+void nw_stats_start(nodewatcher_stats_t *);
+void nw_stats_finish(nodewatcher_stats_t *);
+json_object *nw_stats_to_json(const nodewatcher_stats_t *);
+void nw_stats_loop_lag(uint64_t);
+json_object *nw_stats_agent_json(void);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef NODEWATCHER_TIMER_H
+#define NODEWATCHER_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  /* Monotonic time (in microseconds) at which the timer fires. */
+  uint64_t due;
+  /* Position in the heap, counted from one, zero when the timer is not armed. */
+  size_t slot;
+  void (*callback)(void *);
+  void *arg;
+} nodewatcher_timer_t;
+
+int nw_timer_init(void);
+void nw_timer_arm(nodewatcher_timer_t *, uint64_t, void (*)(void *), void *);
+void nw_timer_disarm(nodewatcher_timer_t *);
+
+#endif
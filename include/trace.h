@@ -0,0 +1,17 @@
+#ifndef NODEWATCHER_TRACE_H
+#define NODEWATCHER_TRACE_H
+
+#include <libre/config.h>
+#include <stdint.h>
+
+/* Number of spans kept in memory, older spans are overwritten. */
+#define NW_TRACE_RING_SIZE 4096
+/* Interval (in seconds) at which the ring is written to the trace file. */
+#define NW_TRACE_FLUSH_INTERVAL 10
+
+int nw_trace_init(const lu_args *);
+uint64_t nw_trace_begin(void);
+void nw_trace_end(const char *, const char *, uint64_t);
+int nw_trace_flush(void);
+
+#endif
@@ -1,11 +1,18 @@
 #ifndef NODEWATCHER_UTILS_H
 #define NODEWATCHER_UTILS_H
 
+#include <dirent.h>
 #include <json-c/json.h>
+#include <stdio.h>
 
 char *nw_utils_string_trim(char *);
 int nw_utils_string_cmp(char *, const char *);
 int nw_file_line_count(const char *);
 int nw_json_from_file(const char *, json_object *, const char *, int);
 
+void nw_utils_set_root(const char *);
+const char *nw_utils_path(char *, size_t, const char *);
+FILE *nw_utils_fopen(const char *, const char *);
+DIR *nw_utils_opendir(const char *);
+
 #endif
@@ -19,7 +19,6 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
-#include <ifaddrs.h>
 #include <libre/scheduler.h>
 #include <libre/stream.h>
 #include <net/if.h>
@@ -32,7 +31,9 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include "ifcache.h"
 #include "modules.h"
+#include "trace.h"
 #include "utils.h"
 
 enum babel_info_type {
@@ -54,6 +55,9 @@ struct nw_babel_client_s {
   json_object *object;
   nodewatcher_module_t *module;
   int state;
+  /* Link-local addresses and the interface cache generation they were built from. */
+  json_object *link_local;
+  uint64_t generation;
 };
 
 static struct nw_babel_client_s bc;
@@ -75,7 +79,16 @@ static json_object *nw_routing_babel_add_array_item(json_object *object, const c
   return item;
 }
 
-static void nw_routing_babel_close(struct nw_babel_client_s *bc) {
+static int nw_routing_babel_finish(struct nw_babel_client_s *bc) {
+
+  json_object *object = bc->object;
+
+  /* Ownership of the object passes to the core. */
+  bc->object = NULL;
+  return nw_module_finish_acquire_data(bc->module, object);
+}
+
+static void nw_routing_babel_disconnect(struct nw_babel_client_s *bc) {
 
   int fd = bc->fdn->fd;
 
@@ -86,20 +99,21 @@ static void nw_routing_babel_close(struct nw_babel_client_s *bc) {
   bc->stream = NULL;
 
   close(fd);
+}
 
-  nw_module_finish_acquire_data(bc->module, bc->object);
+static void nw_routing_babel_close(struct nw_babel_client_s *bc) {
 
-  bc->object = NULL;
+  nw_routing_babel_disconnect(bc);
+  nw_routing_babel_finish(bc);
 }
 
-static void nw_routing_babel_recv(void *arg) {
+static void nw_routing_babel_process(struct nw_babel_client_s *bc) {
 
   char *type, *info_type, *info_id, *key, *value;
   enum babel_info_type info;
   json_object *item;
   char line[1024];
   int rv;
-  struct nw_babel_client_s *bc = (struct nw_babel_client_s *)arg;
   json_object *object = bc->object;
 
   if (bc->stream == NULL)
@@ -256,68 +270,72 @@ static void nw_routing_babel_recv(void *arg) {
 
 }
 
+static void nw_routing_babel_recv(void *arg) {
+
+  uint64_t span = nw_trace_begin();
+
+  nw_routing_babel_process((struct nw_babel_client_s *)arg);
+  nw_trace_end("core.routing.babel recv", "fd", span);
+}
+
 static void nw_routing_babel_timeout(void *arg) {
 
   struct nw_babel_client_s *bc = (struct nw_babel_client_s *)arg;
+  uint64_t span = nw_trace_begin();
 
   syslog(LOG_WARNING, "%s: Connection with local Babel instance timed out.", bc->module->name);
+  nw_module_timeout_acquire_data(bc->module);
   nw_routing_babel_close(bc);
+  nw_trace_end("core.routing.babel timeout", "timeout", span);
 }
 
-static int nw_routing_babel_start_acquire_data(nodewatcher_module_t *module) {
-
-  struct ifaddrs *ifaddr, *ifa;
-  struct sockaddr_in6 babel_addr;
-
-  if (bc.object)
-    return -1;
-
-  bc.object = json_object_new_object();
-
-  /* Get the link-local addresses of the local interfaces. */
-  json_object *link_local = json_object_new_array();
-  json_object_object_add(bc.object, "link_local", link_local);
+static void nw_routing_babel_link_local(const nodewatcher_ifcache_addr_t *addr, void *arg) {
 
-  if (!getifaddrs(&ifaddr)) {
+  const nodewatcher_ifcache_link_t *link = nw_ifcache_link(addr->index);
+  char host[INET6_ADDRSTRLEN + IF_NAMESIZE + 1];
 
-    char host[NI_MAXHOST];
+  /* Skip interfaces which are down. */
+  if (!link || !(link->flags & IFF_UP))
+    return;
 
-    for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+  /* Skip non-ipv6 and non-link-local addresses. */
+  if (addr->family != AF_INET6 || !IN6_IS_ADDR_LINKLOCAL(&addr->address.in6))
+    return;
 
-      if (ifa->ifa_addr == NULL)
-        continue;
+  if (!inet_ntop(AF_INET6, &addr->address.in6, host, INET6_ADDRSTRLEN))
+    return;
 
-      /* Skip interfaces which are down. */
-      if (!(ifa->ifa_flags & IFF_UP))
-        continue;
+  /* Scoped like getnameinfo would. */
+  strcat(host, "%");
+  strcat(host, link->name);
 
-      /* Skip non-ipv6 addresses. */
-      if (ifa->ifa_addr->sa_family != AF_INET6)
-        continue;
+  json_object_array_add((json_object *)arg, json_object_new_string(host));
+}
 
-      /* Skip non-link-local addresses. */
-      if (!IN6_IS_ADDR_LINKLOCAL(&((struct sockaddr_in6*) ifa->ifa_addr)->sin6_addr))
-        continue;
+static int nw_routing_babel_start_acquire_data(nodewatcher_module_t *module) {
 
-      if (getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in6), host, NI_MAXHOST, NULL, 0, NI_NUMERICHOST))
-        continue;
+  struct sockaddr_in6 babel_addr;
 
-      json_object_array_add(link_local, json_object_new_string(host));
-    }
+  if (bc.object)
+    return -1;
 
-    freeifaddrs(ifaddr);
+  bc.object = json_object_new_object();
 
+  /* Get the link-local addresses of the local interfaces, rebuilt only when they change. */
+  if (!bc.link_local || bc.generation != nw_ifcache_generation()) {
+    json_object_put(bc.link_local);
+    bc.link_local = json_object_new_array();
+    bc.generation = nw_ifcache_generation();
+    nw_ifcache_foreach_addr(nw_routing_babel_link_local, bc.link_local);
   }
-  else {
-    syslog(LOG_WARNING, "%s: Failed to obtain link-local addresses.", module->name);
-  }
+  json_object_object_add(bc.object, "link_local", json_object_get(bc.link_local));
 
   lu_fdn_t fdn;
 
   fdn.fd = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
   if (fdn.fd < 0) {
     syslog(LOG_WARNING, "%s: Could not create socket.", module->name);
-    return nw_module_finish_acquire_data(module, bc.object);
+    return nw_routing_babel_finish(&bc);
   }
 
   memset((char *)&babel_addr, 0, sizeof(babel_addr));
@@ -327,7 +345,8 @@ static int nw_routing_babel_start_acquire_data(nodewatcher_module_t *module) {
 
   if (connect(fdn.fd, (struct sockaddr *)&babel_addr, sizeof(babel_addr)) < 0) {
     syslog(LOG_WARNING, "%s: Could not connect to local Babel instance.", module->name);
-    return nw_module_finish_acquire_data(module, bc.object);
+    close(fdn.fd);
+    return nw_routing_babel_finish(&bc);
   }
 
   int flags = fcntl(fdn.fd, F_GETFL, 0);
@@ -346,14 +365,40 @@ static int nw_routing_babel_start_acquire_data(nodewatcher_module_t *module) {
   return 0;
 }
 
+static void nw_routing_babel_cancel_acquire_data(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  if (bc.stream)
+    nw_routing_babel_disconnect(&bc);
+
+  if (bc.object) {
+    json_object_put(bc.object);
+    bc.object = NULL;
+  }
+}
+
 static int nw_routing_babel_init(nodewatcher_module_t *module) {
 
   bc.module = module;
   bc.object = NULL;
+  bc.link_local = NULL;
+
+  /* Neighbours are still reported without the interface cache, only without link-local addresses. */
+  if (nw_ifcache_init() < 0)
+    syslog(LOG_WARNING, "%s: Interface cache is not available, link-local addresses are not reported.", module->name);
 
   return 0;
 }
 
+static void nw_routing_babel_cleanup(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  json_object_put(bc.link_local);
+  bc.link_local = NULL;
+}
+
 /* Module descriptor. */
 MODULE_DESC = {
   .name = "core.routing.babel",
@@ -361,9 +406,12 @@ MODULE_DESC = {
   .version = 1,
   .hooks = {
     .init = nw_routing_babel_init,
-    .start_acquire_data = nw_routing_babel_start_acquire_data
+    .start_acquire_data = nw_routing_babel_start_acquire_data,
+    .cancel_acquire_data = nw_routing_babel_cancel_acquire_data,
+    .cleanup = nw_routing_babel_cleanup
   },
   .schedule = {
-    .refresh_interval = 60
+    .refresh_interval = 60,
+    .max_interval = 300
   }
 };
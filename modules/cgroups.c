@@ -0,0 +1,451 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <libre/scheduler.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "modules.h"
+#include "utils.h"
+
+/*
+ * Per-cgroup resource usage of a cgroup v2 subtree (-G, default /sys/fs/cgroup).
+ * Directories stay open between cycles and the hierarchy is only walked again
+ * after inotify reports a cgroup being created or removed.
+ */
+
+#define NW_CGROUPS_DEFAULT_ROOT "/sys/fs/cgroup"
+/* Maximum number of cgroups tracked. */
+#define NW_CGROUPS_MAX 4096
+#define NW_CGROUPS_BUFFER_SIZE 4096
+
+typedef struct {
+  /* Path relative to the subtree root, empty for the root itself. */
+  char *name;
+  int fd;
+  int seen;
+  uint64_t usage_usec;
+  /* Monotonic time of the sample in microseconds, zero before the first one. */
+  uint64_t time;
+} nw_cgroups_group_t;
+
+static char *nw_cgroups_root = NULL;
+static nw_cgroups_group_t *nw_cgroups_groups = NULL;
+static size_t nw_cgroups_count = 0;
+static size_t nw_cgroups_capacity = 0;
+static int nw_cgroups_dirty = 1;
+static int nw_cgroups_inotify = -1;
+static lu_fdn_t *nw_cgroups_fdn = NULL;
+
+static nw_cgroups_group_t *nw_cgroups_find(const char *name) {
+
+  size_t i;
+
+  for (i = 0; i < nw_cgroups_count; i++) {
+    if (!strcmp(nw_cgroups_groups[i].name, name))
+      return &nw_cgroups_groups[i];
+  }
+
+  return NULL;
+}
+
+static void nw_cgroups_watch(const char *name) {
+
+  char path[PATH_MAX], buffer[PATH_MAX];
+
+  if (nw_cgroups_inotify < 0)
+    return;
+
+  snprintf(path, sizeof(path), "%s/%s", nw_cgroups_root, name);
+  inotify_add_watch(nw_cgroups_inotify, nw_utils_path(buffer, sizeof(buffer), path),
+    IN_CREATE | IN_DELETE | IN_ONLYDIR);
+}
+
+static void nw_cgroups_walk(int fd, const char *name) {
+
+  nw_cgroups_group_t *group, *groups;
+  struct stat old, new;
+  struct dirent *entry;
+  char child[PATH_MAX];
+  DIR *dir;
+  int child_fd;
+
+  group = nw_cgroups_find(name);
+  if (group) {
+    if (fstat(group->fd, &old) < 0 || fstat(fd, &new) < 0 || old.st_dev != new.st_dev || old.st_ino != new.st_ino) {
+      /* Removed and created again under the same name (e.g. a restarted service), start over. */
+      close(group->fd);
+      group->fd = fd;
+      group->usage_usec = 0;
+      group->time = 0;
+      nw_cgroups_watch(name);
+    } else {
+      close(fd);
+      fd = group->fd;
+    }
+  } else {
+    if (nw_cgroups_count == NW_CGROUPS_MAX) {
+      close(fd);
+      return;
+    }
+    if (nw_cgroups_count == nw_cgroups_capacity) {
+      groups = realloc(nw_cgroups_groups, (nw_cgroups_capacity ? nw_cgroups_capacity * 2 : 64) *
+        sizeof(nw_cgroups_group_t));
+      if (!groups) {
+        close(fd);
+        return;
+      }
+      nw_cgroups_groups = groups;
+      nw_cgroups_capacity = nw_cgroups_capacity ? nw_cgroups_capacity * 2 : 64;
+    }
+
+    group = &nw_cgroups_groups[nw_cgroups_count++];
+    memset(group, 0, sizeof(nw_cgroups_group_t));
+    group->name = strdup(name);
+    group->fd = fd;
+    nw_cgroups_watch(name);
+  }
+  group->seen = 1;
+
+  /* The directory stream gets its own descriptor, ours stays open. */
+  child_fd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (child_fd < 0 || !(dir = fdopendir(child_fd))) {
+    if (child_fd >= 0)
+      close(child_fd);
+    return;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+      continue;
+
+    child_fd = openat(fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (child_fd < 0)
+      continue;
+
+    snprintf(child, sizeof(child), "%s%s%s", name, *name ? "/" : "", entry->d_name);
+    nw_cgroups_walk(child_fd, child);
+  }
+  closedir(dir);
+}
+
+static void nw_cgroups_scan(void) {
+
+  char buffer[PATH_MAX];
+  size_t i;
+  int fd;
+
+  for (i = 0; i < nw_cgroups_count; i++)
+    nw_cgroups_groups[i].seen = 0;
+
+  fd = open(nw_utils_path(buffer, sizeof(buffer), nw_cgroups_root), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0)
+    nw_cgroups_walk(fd, "");
+
+  /* Close cgroups that are gone. */
+  i = 0;
+  while (i < nw_cgroups_count) {
+    if (nw_cgroups_groups[i].seen) {
+      i++;
+      continue;
+    }
+    close(nw_cgroups_groups[i].fd);
+    free(nw_cgroups_groups[i].name);
+    nw_cgroups_groups[i] = nw_cgroups_groups[--nw_cgroups_count];
+  }
+
+  nw_cgroups_dirty = 0;
+}
+
+static void nw_cgroups_changed(void *arg) {
+
+  char buffer[NW_CGROUPS_BUFFER_SIZE];
+
+  /* Any creation or removal means the hierarchy is walked again on the next cycle. */
+  while (read(*(int *)arg, buffer, sizeof(buffer)) > 0);
+  nw_cgroups_dirty = 1;
+}
+
+static ssize_t nw_cgroups_read(int fd, const char *file, char *buffer, size_t size) {
+
+  ssize_t length;
+  int file_fd;
+
+  file_fd = openat(fd, file, O_RDONLY | O_CLOEXEC);
+  if (file_fd < 0)
+    return -1;
+
+  length = read(file_fd, buffer, size - 1);
+  close(file_fd);
+  if (length < 0)
+    return -1;
+
+  buffer[length] = 0;
+  return length;
+}
+
+/* Adds all "key value" lines of a flat keyed file to the object. */
+static json_object *nw_cgroups_keyed(int fd, const char *file, json_object *object) {
+
+  char buffer[NW_CGROUPS_BUFFER_SIZE], key[64];
+  unsigned long long value;
+  char *line, *saveptr;
+
+  if (nw_cgroups_read(fd, file, buffer, sizeof(buffer)) < 0)
+    return object;
+
+  for (line = strtok_r(buffer, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+    if (sscanf(line, "%63s %llu", key, &value) != 2)
+      continue;
+    if (!object)
+      object = json_object_new_object();
+    json_object_object_add(object, key, json_object_new_int64(value));
+  }
+
+  return object;
+}
+
+static json_object *nw_cgroups_single(int fd, const char *file) {
+
+  char buffer[64];
+
+  if (nw_cgroups_read(fd, file, buffer, sizeof(buffer)) <= 0)
+    return NULL;
+
+  /* Limits read "max". */
+  if (!strncmp(buffer, "max", 3))
+    return json_object_new_string("max");
+
+  return json_object_new_int64(strtoull(buffer, NULL, 10));
+}
+
+static json_object *nw_cgroups_io(int fd) {
+
+  char buffer[NW_CGROUPS_BUFFER_SIZE], device[32], key[32];
+  char *line, *field, *saveptr, *field_saveptr;
+  unsigned long long value;
+  json_object *io = NULL;
+
+  if (nw_cgroups_read(fd, "io.stat", buffer, sizeof(buffer)) < 0)
+    return NULL;
+
+  /* Lines look like "8:0 rbytes=1 wbytes=2 rios=3 wios=4 dbytes=0 dios=0". */
+  for (line = strtok_r(buffer, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+    field = strtok_r(line, " ", &field_saveptr);
+    if (!field)
+      continue;
+    snprintf(device, sizeof(device), "%s", field);
+
+    json_object *stats = json_object_new_object();
+    while ((field = strtok_r(NULL, " ", &field_saveptr)) != NULL) {
+      if (sscanf(field, "%31[^=]=%llu", key, &value) == 2)
+        json_object_object_add(stats, key, json_object_new_int64(value));
+    }
+
+    if (!io)
+      io = json_object_new_object();
+    json_object_object_add(io, device, stats);
+  }
+
+  return io;
+}
+
+static json_object *nw_cgroups_group_json(nw_cgroups_group_t *group, uint64_t now) {
+
+  json_object *object = json_object_new_object();
+  json_object *cpu, *memory, *value, *usage;
+
+  cpu = nw_cgroups_keyed(group->fd, "cpu.stat", NULL);
+  if (cpu) {
+    /* Share (in percent of one CPU) used since the previous cycle. */
+    if (json_object_object_get_ex(cpu, "usage_usec", &usage)) {
+      uint64_t usage_usec = json_object_get_int64(usage);
+
+      if (group->time && now > group->time && usage_usec >= group->usage_usec) {
+        json_object_object_add(cpu, "usage_percent",
+          json_object_new_double(100.0 * (usage_usec - group->usage_usec) / (now - group->time)));
+      }
+      group->usage_usec = usage_usec;
+      group->time = now;
+    }
+    json_object_object_add(object, "cpu", cpu);
+  }
+
+  memory = NULL;
+  if ((value = nw_cgroups_single(group->fd, "memory.current"))) {
+    memory = json_object_new_object();
+    json_object_object_add(memory, "current", value);
+    if ((value = nw_cgroups_single(group->fd, "memory.max")))
+      json_object_object_add(memory, "max", value);
+    if ((value = nw_cgroups_keyed(group->fd, "memory.events", NULL)))
+      json_object_object_add(memory, "events", value);
+    json_object_object_add(object, "memory", memory);
+  }
+
+  if ((value = nw_cgroups_io(group->fd)))
+    json_object_object_add(object, "io", value);
+
+  if ((value = nw_cgroups_single(group->fd, "pids.current")))
+    json_object_object_add(object, "pids", value);
+
+  return object;
+}
+
+static int nw_cgroups_start_acquire_data(nodewatcher_module_t *module) {
+
+  json_object *object = json_object_new_object();
+  json_object *groups = json_object_new_object();
+  uint64_t now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  size_t i;
+
+  if (nw_cgroups_dirty || nw_cgroups_inotify < 0)
+    nw_cgroups_scan();
+
+  for (i = 0; i < nw_cgroups_count; i++) {
+    nw_cgroups_group_t *group = &nw_cgroups_groups[i];
+    json_object_object_add(groups, *group->name ? group->name : "/", nw_cgroups_group_json(group, now));
+  }
+
+  json_object_object_add(object, "groups", groups);
+
+  /* Store resulting JSON object. */
+  return nw_module_finish_acquire_data(module, object);
+}
+
+static json_object *nw_cgroups_save_state(nodewatcher_module_t *module) {
+
+  json_object *state = NULL, *sample;
+  struct stat s;
+  size_t i;
+
+  UNUSED(module);
+
+  for (i = 0; i < nw_cgroups_count; i++) {
+    nw_cgroups_group_t *group = &nw_cgroups_groups[i];
+
+    if (!group->time || fstat(group->fd, &s) < 0)
+      continue;
+
+    /* The directory identifies the cgroup, a new one under the same name starts over. */
+    sample = json_object_new_array();
+    json_object_array_add(sample, json_object_new_int64(group->usage_usec));
+    json_object_array_add(sample, json_object_new_int64(group->time));
+    json_object_array_add(sample, json_object_new_int64(s.st_dev));
+    json_object_array_add(sample, json_object_new_int64(s.st_ino));
+
+    if (!state)
+      state = json_object_new_object();
+    json_object_object_add(state, group->name, sample);
+  }
+
+  return state;
+}
+
+static void nw_cgroups_restore_state(nodewatcher_module_t *module, json_object *state) {
+
+  nw_cgroups_group_t *group;
+  struct stat s;
+
+  UNUSED(module);
+
+  if (!json_object_is_type(state, json_type_object))
+    return;
+
+  nw_cgroups_scan();
+
+  json_object_object_foreach(state, name, sample) {
+    if (!json_object_is_type(sample, json_type_array) || json_object_array_length(sample) != 4)
+      continue;
+    if (!(group = nw_cgroups_find(name)) || fstat(group->fd, &s) < 0)
+      continue;
+    if ((uint64_t)s.st_dev != (uint64_t)json_object_get_int64(json_object_array_get_idx(sample, 2)) ||
+        (uint64_t)s.st_ino != (uint64_t)json_object_get_int64(json_object_array_get_idx(sample, 3)))
+      continue;
+
+    group->usage_usec = json_object_get_int64(json_object_array_get_idx(sample, 0));
+    group->time = json_object_get_int64(json_object_array_get_idx(sample, 1));
+  }
+}
+
+static int nw_cgroups_init(nodewatcher_module_t *module) {
+
+  char c;
+  lu_fdn_t fdn;
+
+  while ((c = lu_getopt(module->args, "G:")) != EOF) {
+    switch (c) {
+      case 'G':
+        if (nw_cgroups_root)
+          free(nw_cgroups_root);
+        nw_cgroups_root = strdup(lu_getarg());
+        break;
+    }
+  }
+
+  if (!nw_cgroups_root)
+    nw_cgroups_root = strdup(NW_CGROUPS_DEFAULT_ROOT);
+
+  nw_cgroups_dirty = 1;
+  nw_cgroups_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (nw_cgroups_inotify < 0) {
+    /* Without notifications the hierarchy is walked every cycle. */
+    syslog(LOG_WARNING, "Module %s: Could not watch cgroups, rescanning every cycle.", module->name);
+    return 0;
+  }
+
+  fdn.fd = nw_cgroups_inotify;
+  fdn.recv = nw_cgroups_changed;
+  fdn.options = LS_READ;
+  fdn.data = &nw_cgroups_inotify;
+  nw_cgroups_fdn = lu_fd_add(&fdn);
+
+  syslog(LOG_INFO, "Module %s: Reporting cgroups under '%s'.", module->name, nw_cgroups_root);
+
+  return 0;
+}
+
+static void nw_cgroups_cleanup(nodewatcher_module_t *module) {
+
+  size_t i;
+
+  UNUSED(module);
+
+  for (i = 0; i < nw_cgroups_count; i++) {
+    close(nw_cgroups_groups[i].fd);
+    free(nw_cgroups_groups[i].name);
+  }
+  free(nw_cgroups_groups);
+  nw_cgroups_groups = NULL;
+  nw_cgroups_count = 0;
+  nw_cgroups_capacity = 0;
+
+  if (nw_cgroups_fdn)
+    lu_fd_del(nw_cgroups_fdn);
+  nw_cgroups_fdn = NULL;
+  if (nw_cgroups_inotify >= 0)
+    close(nw_cgroups_inotify);
+  nw_cgroups_inotify = -1;
+
+  free(nw_cgroups_root);
+  nw_cgroups_root = NULL;
+}
+
+/* Module descriptor. */
+MODULE_DESC = {
+  .name = "core.cgroups",
+  .author = "jaka@live.jp",
+  .version = 1,
+  .hooks = {
+    .init = nw_cgroups_init,
+    .start_acquire_data = nw_cgroups_start_acquire_data,
+    .cleanup = nw_cgroups_cleanup,
+    .save_state = nw_cgroups_save_state,
+    .restore_state = nw_cgroups_restore_state,
+  },
+  .schedule = {
+    .refresh_interval = 30,
+  },
+};
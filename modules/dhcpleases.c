@@ -82,6 +82,14 @@ static int nw_dhcpleases_init(nodewatcher_module_t *module) {
   return 0;
 }
 
+static void nw_dhcpleases_cleanup(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  free(nw_dhcpleases_filename);
+  nw_dhcpleases_filename = NULL;
+}
+
 /* Module descriptor. */
 MODULE_DESC = {
   .name = "core.clients",
@@ -89,9 +97,13 @@ MODULE_DESC = {
   .version = 1,
   .hooks = {
     .init = nw_dhcpleases_init,
-    .start_acquire_data = nw_dhcpleases_start_acquire_data
+    .start_acquire_data = nw_dhcpleases_start_acquire_data,
+    .cleanup = nw_dhcpleases_cleanup
   },
   .schedule = {
     .refresh_interval = 30,
+    .max_interval = 300,
+    /* Clients moving between nodes show up as changes of the mesh neighbours. */
+    .related = "core.routing.babel",
   },
 };
@@ -1,27 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+
 #include "modules.h"
 
+/*
+ * Synthetic load generator. Without options it emits a single counter, with
+ * -L n=<instances>,keys=<keys>,depth=<depth>,strlen=<bytes>,interval=<seconds>
+ * it registers additional instances and every instance emits the given number
+ * of keys, each nested depth objects deep and ending in an integer or a string.
+ */
+
+/* Longest string value, values are built on the stack. */
+#define NW_DUMMY_MAX_STRLEN 4096
+
+typedef struct {
+  /* Must be first, the core hands us the module pointer. */
+  nodewatcher_module_t module;
+  char name[32];
+  int counter;
+} nw_dummy_instance_t;
+
 static int nw_dummy_counter;
+static int nw_dummy_instances = 1;
+static int nw_dummy_keys = 0;
+static int nw_dummy_depth = 0;
+static int nw_dummy_strlen = 8;
+static time_t nw_dummy_interval = 0;
+static nw_dummy_instance_t *nw_dummy_instance_list = NULL;
+
+static json_object *nw_dummy_value(int counter, int key) {
+
+  char buffer[nw_dummy_strlen + 1];
+
+  if (key % 2 == 0)
+    return json_object_new_int(counter + key);
+
+  memset(buffer, 'a' + (counter + key) % 26, nw_dummy_strlen);
+  buffer[nw_dummy_strlen] = 0;
+  return json_object_new_string(buffer);
+}
+
+static int nw_dummy_instance_init(nodewatcher_module_t *module) {
+
+  ((nw_dummy_instance_t *)module)->counter = 0;
+  return 0;
+}
 
 static int nw_dummy_start_acquire_data(nodewatcher_module_t *module) {
 
+  int *counter = &nw_dummy_counter;
   json_object *object = json_object_new_object();
+  char key[16];
+  int i, level;
+
+  if (module->hooks.init == nw_dummy_instance_init)
+    counter = &((nw_dummy_instance_t *)module)->counter;
 
   /* Save the counter. */
-  json_object_object_add(object, "value", json_object_new_int(nw_dummy_counter));
-  nw_dummy_counter++;
+  json_object_object_add(object, "value", json_object_new_int(*counter));
+
+  for (i = 0; i < nw_dummy_keys; i++) {
+    json_object *value = nw_dummy_value(*counter, i);
+
+    for (level = 0; level < nw_dummy_depth; level++) {
+      json_object *parent = json_object_new_object();
+      json_object_object_add(parent, "nested", value);
+      value = parent;
+    }
+
+    snprintf(key, sizeof(key), "key%d", i);
+    json_object_object_add(object, key, value);
+  }
+
+  (*counter)++;
 
   /* Store resulting JSON object. */
   return nw_module_finish_acquire_data(module, object);
 }
 
+static void nw_dummy_parse_load(const char *arg) {
+
+  char *options = strdup(arg);
+  char *option, *value, *saveptr;
+
+  for (option = strtok_r(options, ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+    value = strchr(option, '=');
+    if (!value)
+      continue;
+    *value++ = 0;
+
+    if (!strcmp(option, "n"))
+      nw_dummy_instances = atoi(value);
+    else if (!strcmp(option, "keys"))
+      nw_dummy_keys = atoi(value);
+    else if (!strcmp(option, "depth"))
+      nw_dummy_depth = atoi(value);
+    else if (!strcmp(option, "strlen"))
+      nw_dummy_strlen = atoi(value);
+    else if (!strcmp(option, "interval"))
+      nw_dummy_interval = atoi(value);
+  }
+
+  free(options);
+}
+
+static int nw_dummy_register_instances(nodewatcher_module_t *module) {
+
+  int i;
+
+  if (nw_dummy_instances < 2)
+    return 0;
+
+  nw_dummy_instance_list = calloc(nw_dummy_instances - 1, sizeof(nw_dummy_instance_t));
+  if (!nw_dummy_instance_list)
+    return -1;
+
+  for (i = 0; i < nw_dummy_instances - 1; i++) {
+    nw_dummy_instance_t *instance = &nw_dummy_instance_list[i];
+    nodewatcher_module_t descriptor = {
+      .name = instance->name,
+      .author = module->author,
+      .version = module->version,
+      .hooks = {
+        .init = nw_dummy_instance_init,
+        .start_acquire_data = nw_dummy_start_acquire_data,
+      },
+      .schedule = module->schedule,
+      .args = module->args,
+    };
+
+    snprintf(instance->name, sizeof(instance->name), "%s.%d", module->name, i + 1);
+    memcpy(&instance->module, &descriptor, sizeof(descriptor));
+
+    if (nw_module_register(&instance->module))
+      return -1;
+  }
+
+  return 0;
+}
+
 static int nw_dummy_init(nodewatcher_module_t *module) {
 
-  UNUSED(module);
+  char c;
+
+  while ((c = lu_getopt(module->args, "L:")) != EOF) {
+    switch (c) {
+      case 'L': nw_dummy_parse_load(lu_getarg()); break;
+    }
+  }
+
+  if (nw_dummy_strlen < 1)
+    nw_dummy_strlen = 1;
+  if (nw_dummy_strlen > NW_DUMMY_MAX_STRLEN)
+    nw_dummy_strlen = NW_DUMMY_MAX_STRLEN;
+  if (nw_dummy_interval > 0)
+    module->schedule.refresh_interval = nw_dummy_interval;
 
   /* Init the counter. */
   nw_dummy_counter = 0;
 
-  return 0;
+  return nw_dummy_register_instances(module);
+}
+
+static void nw_dummy_cleanup(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  /* The core has already removed the instances. */
+  free(nw_dummy_instance_list);
+  nw_dummy_instance_list = NULL;
 }
 
 /* Module descriptor. */
@@ -32,6 +179,7 @@ MODULE_DESC = {
   .hooks = {
     .init = nw_dummy_init,
     .start_acquire_data = nw_dummy_start_acquire_data,
+    .cleanup = nw_dummy_cleanup,
   },
   .schedule = {
     .refresh_interval = 30,
@@ -1,4 +1,5 @@
 #include "modules.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -13,6 +14,7 @@ static int nw_fileoutput_start_acquire_data(nodewatcher_module_t *module) {
 
   if (nw_fileoutput_filename) {
 
+    uint64_t span = nw_trace_begin();
     json_object *data = nw_module_get_output();
     mode_t pmask = umask(0022);
 
@@ -22,6 +24,7 @@ static int nw_fileoutput_start_acquire_data(nodewatcher_module_t *module) {
       fprintf(file, "%s\n", json_object_to_json_string(data));
       fclose(file);
     }
+    nw_trace_end("core.fileoutput serialize", "output", span);
 
     /* Restore umask. */
     umask(pmask);
@@ -57,14 +60,24 @@ static int nw_fileoutput_init(nodewatcher_module_t *module) {
   return 0;
 }
 
+static void nw_fileoutput_cleanup(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  free(nw_fileoutput_filename);
+  nw_fileoutput_filename = NULL;
+}
+
 /* Module descriptor. */
 MODULE_DESC = {
   .name = "core.fileoutput",
   .author = "jaka@live.jp",
   .version = 1,
+  .flags = NW_MODULE_OUTPUT,
   .hooks = {
     .init = nw_fileoutput_init,
     .start_acquire_data = nw_fileoutput_start_acquire_data,
+    .cleanup = nw_fileoutput_cleanup,
   },
   .schedule = {
     .refresh_interval = 30,
@@ -0,0 +1,355 @@
+#include <linux/if.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "modules.h"
+
+/*
+ * Per-interface counters and rates, fetched with a single RTM_GETLINK dump.
+ * The previous sample is kept to report per-second rates of every counter.
+ */
+
+#define NW_INTERFACES_BUFFER_SIZE 32768
+
+enum {
+  NW_INTERFACES_RX_BYTES,
+  NW_INTERFACES_TX_BYTES,
+  NW_INTERFACES_RX_PACKETS,
+  NW_INTERFACES_TX_PACKETS,
+  NW_INTERFACES_RX_ERRORS,
+  NW_INTERFACES_TX_ERRORS,
+  NW_INTERFACES_RX_DROPPED,
+  NW_INTERFACES_TX_DROPPED,
+  NW_INTERFACES_COUNTERS,
+};
+
+static const char *nw_interfaces_counter_names[NW_INTERFACES_COUNTERS] = {
+  "rx_bytes", "tx_bytes", "rx_packets", "tx_packets", "rx_errors", "tx_errors", "rx_dropped", "tx_dropped",
+};
+
+static const char *nw_interfaces_operstates[] = {
+  "unknown", "notpresent", "down", "lowerlayerdown", "testing", "dormant", "up",
+};
+
+typedef struct {
+  int index;
+  uint64_t counters[NW_INTERFACES_COUNTERS];
+} nw_interfaces_sample_t;
+
+typedef struct {
+  nw_interfaces_sample_t *samples;
+  size_t count;
+  size_t capacity;
+  /* Monotonic time of the dump in microseconds. */
+  uint64_t time;
+} nw_interfaces_snapshot_t;
+
+static int nw_interfaces_fd = -1;
+static uint32_t nw_interfaces_seq = 0;
+static nw_interfaces_snapshot_t nw_interfaces_previous;
+static nw_interfaces_snapshot_t nw_interfaces_current;
+
+/* Drivers with 32-bit counters wrap around, anything else going down was a reset. */
+static int nw_interfaces_delta(uint64_t current, uint64_t previous, uint64_t *delta) {
+
+  if (current >= previous)
+    *delta = current - previous;
+  else if (previous <= UINT32_MAX)
+    *delta = current + (UINT32_MAX - previous) + 1;
+  else
+    return -1;
+
+  return 0;
+}
+
+static int nw_interfaces_sample_cmp(const void *a, const void *b) {
+
+  int x = ((const nw_interfaces_sample_t *)a)->index;
+  int y = ((const nw_interfaces_sample_t *)b)->index;
+
+  return (x > y) - (x < y);
+}
+
+static nw_interfaces_sample_t *nw_interfaces_sample_add(nw_interfaces_snapshot_t *snapshot) {
+
+  nw_interfaces_sample_t *samples;
+
+  if (snapshot->count == snapshot->capacity) {
+    samples = realloc(snapshot->samples, (snapshot->capacity ? snapshot->capacity * 2 : 32) * sizeof(nw_interfaces_sample_t));
+    if (!samples)
+      return NULL;
+    snapshot->samples = samples;
+    snapshot->capacity = snapshot->capacity ? snapshot->capacity * 2 : 32;
+  }
+
+  return &snapshot->samples[snapshot->count++];
+}
+
+static void nw_interfaces_parse_link(struct nlmsghdr *nlh, json_object *interfaces) {
+
+  struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+  struct rtattr *rta;
+  struct rtnl_link_stats64 stats;
+  nw_interfaces_sample_t *sample, *previous;
+  uint64_t delta;
+  const char *name = NULL;
+  int length = IFLA_PAYLOAD(nlh);
+  int has_stats = 0;
+  char mac[3 * 32];
+  size_t i;
+
+  json_object *interface = json_object_new_object();
+  json_object_object_add(interface, "index", json_object_new_int(ifi->ifi_index));
+  json_object_object_add(interface, "up", json_object_new_boolean(ifi->ifi_flags & IFF_UP));
+
+  for (rta = IFLA_RTA(ifi); RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+    switch (rta->rta_type) {
+      case IFLA_IFNAME: name = RTA_DATA(rta); break;
+      case IFLA_MTU: {
+        json_object_object_add(interface, "mtu", json_object_new_int(*(uint32_t *)RTA_DATA(rta)));
+        break;
+      }
+      case IFLA_OPERSTATE: {
+        uint8_t state = *(uint8_t *)RTA_DATA(rta);
+        if (state >= sizeof(nw_interfaces_operstates) / sizeof(nw_interfaces_operstates[0]))
+          state = IF_OPER_UNKNOWN;
+        json_object_object_add(interface, "operstate", json_object_new_string(nw_interfaces_operstates[state]));
+        break;
+      }
+      case IFLA_ADDRESS: {
+        unsigned char *address = RTA_DATA(rta);
+        size_t address_length = RTA_PAYLOAD(rta);
+
+        if (!address_length || address_length > sizeof(mac) / 3)
+          break;
+        for (i = 0; i < address_length; i++)
+          sprintf(mac + i * 3, "%02x%s", address[i], i + 1 < address_length ? ":" : "");
+        json_object_object_add(interface, "mac", json_object_new_string(mac));
+        break;
+      }
+      case IFLA_STATS64: {
+        /* The attribute is only 4-byte aligned. */
+        memset(&stats, 0, sizeof(stats));
+        memcpy(&stats, RTA_DATA(rta), RTA_PAYLOAD(rta) < sizeof(stats) ? RTA_PAYLOAD(rta) : sizeof(stats));
+        has_stats = 1;
+        break;
+      }
+    }
+  }
+
+  if (!name) {
+    json_object_put(interface);
+    return;
+  }
+
+  if (has_stats && (sample = nw_interfaces_sample_add(&nw_interfaces_current))) {
+    json_object *counters = json_object_new_object();
+
+    sample->index = ifi->ifi_index;
+    sample->counters[NW_INTERFACES_RX_BYTES] = stats.rx_bytes;
+    sample->counters[NW_INTERFACES_TX_BYTES] = stats.tx_bytes;
+    sample->counters[NW_INTERFACES_RX_PACKETS] = stats.rx_packets;
+    sample->counters[NW_INTERFACES_TX_PACKETS] = stats.tx_packets;
+    sample->counters[NW_INTERFACES_RX_ERRORS] = stats.rx_errors;
+    sample->counters[NW_INTERFACES_TX_ERRORS] = stats.tx_errors;
+    sample->counters[NW_INTERFACES_RX_DROPPED] = stats.rx_dropped;
+    sample->counters[NW_INTERFACES_TX_DROPPED] = stats.tx_dropped;
+
+    for (i = 0; i < NW_INTERFACES_COUNTERS; i++)
+      json_object_object_add(counters, nw_interfaces_counter_names[i], json_object_new_int64(sample->counters[i]));
+    json_object_object_add(interface, "counters", counters);
+
+    /* Rates need a previous sample of the same interface. */
+    previous = nw_interfaces_previous.count ? bsearch(sample, nw_interfaces_previous.samples,
+      nw_interfaces_previous.count, sizeof(nw_interfaces_sample_t), nw_interfaces_sample_cmp) : NULL;
+    if (previous && nw_interfaces_current.time > nw_interfaces_previous.time) {
+      json_object *rates = json_object_new_object();
+      double elapsed = (nw_interfaces_current.time - nw_interfaces_previous.time) / 1000000.0;
+
+      for (i = 0; i < NW_INTERFACES_COUNTERS; i++) {
+        if (nw_interfaces_delta(sample->counters[i], previous->counters[i], &delta) < 0)
+          continue;
+        json_object_object_add(rates, nw_interfaces_counter_names[i], json_object_new_double(delta / elapsed));
+      }
+      json_object_object_add(interface, "rates", rates);
+    }
+  }
+
+  json_object_object_add(interfaces, name, interface);
+}
+
+static int nw_interfaces_dump(json_object *interfaces) {
+
+  struct {
+    struct nlmsghdr nlh;
+    struct ifinfomsg ifi;
+  } request;
+  struct sockaddr_nl address;
+  struct nlmsghdr *nlh;
+  char buffer[NW_INTERFACES_BUFFER_SIZE];
+  ssize_t length;
+
+  memset(&request, 0, sizeof(request));
+  request.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+  request.nlh.nlmsg_type = RTM_GETLINK;
+  request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.nlh.nlmsg_seq = ++nw_interfaces_seq;
+  request.ifi.ifi_family = AF_UNSPEC;
+
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+
+  if (sendto(nw_interfaces_fd, &request, request.nlh.nlmsg_len, 0, (struct sockaddr *)&address, sizeof(address)) < 0)
+    return -1;
+
+  for (;;) {
+    length = recv(nw_interfaces_fd, buffer, sizeof(buffer), 0);
+    if (length < 0)
+      return -1;
+
+    for (nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, length); nlh = NLMSG_NEXT(nlh, length)) {
+      /* Skip leftovers of an earlier, interrupted dump. */
+      if (nlh->nlmsg_seq != nw_interfaces_seq)
+        continue;
+      if (nlh->nlmsg_type == NLMSG_DONE)
+        return 0;
+      if (nlh->nlmsg_type == NLMSG_ERROR)
+        return -1;
+      if (nlh->nlmsg_type == RTM_NEWLINK)
+        nw_interfaces_parse_link(nlh, interfaces);
+    }
+  }
+}
+
+static int nw_interfaces_start_acquire_data(nodewatcher_module_t *module) {
+
+  nw_interfaces_snapshot_t swap;
+  json_object *object = json_object_new_object();
+  json_object *interfaces = json_object_new_object();
+
+  nw_interfaces_current.count = 0;
+  nw_interfaces_current.time = nw_stats_clock_us(CLOCK_MONOTONIC);
+
+  if (nw_interfaces_dump(interfaces) < 0) {
+    syslog(LOG_WARNING, "%s: Failed to dump network interfaces.", module->name);
+    json_object_put(interfaces);
+    json_object_put(object);
+    return nw_module_finish_acquire_data(module, NULL);
+  }
+  json_object_object_add(object, "interfaces", interfaces);
+
+  /* Keep this sample, sorted for lookups in the next cycle. */
+  qsort(nw_interfaces_current.samples, nw_interfaces_current.count, sizeof(nw_interfaces_sample_t),
+    nw_interfaces_sample_cmp);
+  swap = nw_interfaces_previous;
+  nw_interfaces_previous = nw_interfaces_current;
+  nw_interfaces_current = swap;
+
+  /* Store resulting JSON object. */
+  return nw_module_finish_acquire_data(module, object);
+}
+
+static json_object *nw_interfaces_save_state(nodewatcher_module_t *module) {
+
+  json_object *state, *samples, *sample;
+  size_t i, j;
+
+  UNUSED(module);
+
+  if (!nw_interfaces_previous.count)
+    return NULL;
+
+  state = json_object_new_object();
+  samples = json_object_new_array();
+  for (i = 0; i < nw_interfaces_previous.count; i++) {
+    sample = json_object_new_array();
+    json_object_array_add(sample, json_object_new_int(nw_interfaces_previous.samples[i].index));
+    for (j = 0; j < NW_INTERFACES_COUNTERS; j++)
+      json_object_array_add(sample, json_object_new_int64(nw_interfaces_previous.samples[i].counters[j]));
+    json_object_array_add(samples, sample);
+  }
+  json_object_object_add(state, "time", json_object_new_int64(nw_interfaces_previous.time));
+  json_object_object_add(state, "samples", samples);
+
+  return state;
+}
+
+static void nw_interfaces_restore_state(nodewatcher_module_t *module, json_object *state) {
+
+  json_object *time, *samples, *entry;
+  nw_interfaces_sample_t *sample;
+  size_t i, j;
+
+  UNUSED(module);
+
+  if (!json_object_object_get_ex(state, "time", &time) || !json_object_object_get_ex(state, "samples", &samples) ||
+      !json_object_is_type(samples, json_type_array))
+    return;
+
+  /* Saved samples are sorted already. */
+  nw_interfaces_previous.count = 0;
+  nw_interfaces_previous.time = json_object_get_int64(time);
+  for (i = 0; i < json_object_array_length(samples); i++) {
+    entry = json_object_array_get_idx(samples, i);
+    if (!json_object_is_type(entry, json_type_array) || json_object_array_length(entry) != 1 + NW_INTERFACES_COUNTERS)
+      continue;
+    if (!(sample = nw_interfaces_sample_add(&nw_interfaces_previous)))
+      break;
+
+    sample->index = json_object_get_int(json_object_array_get_idx(entry, 0));
+    for (j = 0; j < NW_INTERFACES_COUNTERS; j++)
+      sample->counters[j] = json_object_get_int64(json_object_array_get_idx(entry, j + 1));
+  }
+}
+
+static int nw_interfaces_init(nodewatcher_module_t *module) {
+
+  struct timeval timeout = { 1, 0 };
+
+  nw_interfaces_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (nw_interfaces_fd < 0) {
+    syslog(LOG_ERR, "Module %s: Could not create netlink socket!", module->name);
+    return -1;
+  }
+
+  /* The kernel answers right away, do not let a lost reply block the loop. */
+  setsockopt(nw_interfaces_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  return 0;
+}
+
+static void nw_interfaces_cleanup(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  if (nw_interfaces_fd >= 0)
+    close(nw_interfaces_fd);
+  nw_interfaces_fd = -1;
+
+  free(nw_interfaces_previous.samples);
+  free(nw_interfaces_current.samples);
+  memset(&nw_interfaces_previous, 0, sizeof(nw_interfaces_previous));
+  memset(&nw_interfaces_current, 0, sizeof(nw_interfaces_current));
+}
+
+/* Module descriptor. */
+MODULE_DESC = {
+  .name = "core.interfaces",
+  .author = "jaka@live.jp",
+  .version = 1,
+  .hooks = {
+    .init = nw_interfaces_init,
+    .start_acquire_data = nw_interfaces_start_acquire_data,
+    .cleanup = nw_interfaces_cleanup,
+    .save_state = nw_interfaces_save_state,
+    .restore_state = nw_interfaces_restore_state,
+  },
+  .schedule = {
+    .refresh_interval = 30,
+  },
+};
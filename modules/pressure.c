@@ -0,0 +1,290 @@
+#include <fcntl.h>
+#include <libre/scheduler.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "modules.h"
+#include "utils.h"
+
+/*
+ * Pressure stall information from /proc/pressure. Kernel triggers, given with
+ * -t <resource>:<some|full>:<stall us>:<window us>[,...], take an immediate
+ * snapshot and push it to the output modules when a stall exceeds the limit.
+ */
+
+/* Windows that are a multiple of 2 s are also accepted without CAP_SYS_RESOURCE. */
+#define NW_PRESSURE_DEFAULT_TRIGGERS "cpu:some:150000:2000000,memory:some:150000:2000000,io:some:150000:2000000"
+/* Minimum time (in milliseconds) between two pushes caused by triggers. */
+#define NW_PRESSURE_PUSH_INTERVAL 1000
+#define NW_PRESSURE_MAX_TRIGGERS 8
+
+static const char *nw_pressure_resources[] = { "cpu", "memory", "io", NULL };
+
+typedef struct {
+  int fd;
+  char resource[8];
+  char kind[8];
+  unsigned long events;
+} nw_pressure_trigger_t;
+
+static nw_pressure_trigger_t nw_pressure_triggers[NW_PRESSURE_MAX_TRIGGERS];
+static int nw_pressure_trigger_count = 0;
+static char *nw_pressure_trigger_spec = NULL;
+/* The event loop only watches for readability, so POLLPRI is collected through epoll. */
+static int nw_pressure_epoll = -1;
+static lu_fdn_t *nw_pressure_fdn = NULL;
+static uint64_t nw_pressure_last_push = 0;
+/* Armed while a push is held back until the interval has passed. */
+static nodewatcher_timer_t nw_pressure_deferred;
+static nodewatcher_module_t *nw_pressure_module = NULL;
+
+static json_object *nw_pressure_read(const char *resource) {
+
+  char path[PATH_MAX], kind[8];
+  double avg10, avg60, avg300;
+  unsigned long long total;
+  json_object *object = NULL;
+  FILE *file;
+
+  snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+  file = nw_utils_fopen(path, "r");
+  if (!file)
+    return NULL;
+
+  while (fscanf(file, "%7s avg10=%lf avg60=%lf avg300=%lf total=%llu", kind, &avg10, &avg60, &avg300, &total) == 5) {
+    json_object *stall = json_object_new_object();
+    json_object_object_add(stall, "avg10", json_object_new_double(avg10));
+    json_object_object_add(stall, "avg60", json_object_new_double(avg60));
+    json_object_object_add(stall, "avg300", json_object_new_double(avg300));
+    json_object_object_add(stall, "total_us", json_object_new_int64(total));
+
+    if (!object)
+      object = json_object_new_object();
+    json_object_object_add(object, kind, stall);
+  }
+  fclose(file);
+
+  return object;
+}
+
+static int nw_pressure_start_acquire_data(nodewatcher_module_t *module) {
+
+  json_object *object = json_object_new_object();
+  json_object *resource;
+  int i;
+
+  for (i = 0; nw_pressure_resources[i]; i++) {
+    resource = nw_pressure_read(nw_pressure_resources[i]);
+    if (resource)
+      json_object_object_add(object, nw_pressure_resources[i], resource);
+  }
+
+  if (nw_pressure_trigger_count) {
+    json_object *triggers = json_object_new_object();
+    char name[20];
+
+    for (i = 0; i < nw_pressure_trigger_count; i++) {
+      snprintf(name, sizeof(name), "%s.%s", nw_pressure_triggers[i].resource, nw_pressure_triggers[i].kind);
+      json_object_object_add(triggers, name, json_object_new_int64(nw_pressure_triggers[i].events));
+    }
+    json_object_object_add(object, "triggers", triggers);
+  }
+
+  /* Store resulting JSON object. */
+  return nw_module_finish_acquire_data(module, object);
+}
+
+static void nw_pressure_push(void *arg) {
+
+  UNUSED(arg);
+
+  nw_pressure_last_push = nw_stats_clock_us(CLOCK_MONOTONIC);
+  nw_module_refresh(nw_pressure_module, 0);
+  nw_module_push();
+}
+
+static void nw_pressure_event(void *arg) {
+
+  struct epoll_event events[NW_PRESSURE_MAX_TRIGGERS];
+  uint64_t now;
+  int count, i;
+
+  UNUSED(arg);
+
+  count = epoll_wait(nw_pressure_epoll, events, NW_PRESSURE_MAX_TRIGGERS, 0);
+  if (count <= 0)
+    return;
+
+  for (i = 0; i < count; i++) {
+    nw_pressure_trigger_t *trigger = (nw_pressure_trigger_t *)events[i].data.ptr;
+
+    if (events[i].events & EPOLLERR) {
+      /* The pressure file went away, there is nothing left to wait for. */
+      syslog(LOG_WARNING, "%s: Trigger for %s pressure failed.", nw_pressure_module->name, trigger->resource);
+      epoll_ctl(nw_pressure_epoll, EPOLL_CTL_DEL, trigger->fd, NULL);
+      continue;
+    }
+    trigger->events++;
+  }
+
+  /*
+   * Take a snapshot right away and push it, but do not flood the outputs. Triggers
+   * within the interval get one push at its end, so the last stall is not lost.
+   */
+  now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  if (nw_pressure_last_push && now - nw_pressure_last_push < NW_PRESSURE_PUSH_INTERVAL * 1000ULL) {
+    if (!nw_pressure_deferred.slot)
+      nw_timer_arm(&nw_pressure_deferred, nw_pressure_last_push + NW_PRESSURE_PUSH_INTERVAL * 1000ULL,
+        nw_pressure_push, NULL);
+    return;
+  }
+
+  nw_pressure_push(NULL);
+}
+
+static int nw_pressure_add_trigger(nodewatcher_module_t *module, char *spec) {
+
+  char path[PATH_MAX], buffer[PATH_MAX], threshold[64];
+  char *resource, *kind, *stall, *window, *saveptr;
+  nw_pressure_trigger_t *trigger;
+  struct epoll_event event;
+
+  resource = strtok_r(spec, ":", &saveptr);
+  kind = strtok_r(NULL, ":", &saveptr);
+  stall = strtok_r(NULL, ":", &saveptr);
+  window = strtok_r(NULL, ":", &saveptr);
+  if (!resource || !kind || !stall || !window || strlen(resource) >= sizeof(trigger->resource) ||
+      strlen(kind) >= sizeof(trigger->kind)) {
+    syslog(LOG_WARNING, "Module %s: Ignoring invalid trigger '%s'.", module->name, spec);
+    return -1;
+  }
+
+  if (nw_pressure_trigger_count == NW_PRESSURE_MAX_TRIGGERS)
+    return -1;
+  trigger = &nw_pressure_triggers[nw_pressure_trigger_count];
+
+  snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+  trigger->fd = open(nw_utils_path(buffer, sizeof(buffer), path), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (trigger->fd < 0) {
+    syslog(LOG_WARNING, "Module %s: Pressure of '%s' is not available.", module->name, resource);
+    return -1;
+  }
+
+  /* The trigger lives as long as the file stays open. */
+  snprintf(threshold, sizeof(threshold), "%s %s %s", kind, stall, window);
+  if (write(trigger->fd, threshold, strlen(threshold) + 1) < 0) {
+    syslog(LOG_WARNING, "Module %s: Could not set %s pressure trigger '%s': %m", module->name, resource, threshold);
+    close(trigger->fd);
+    return -1;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLPRI;
+  event.data.ptr = trigger;
+  if (epoll_ctl(nw_pressure_epoll, EPOLL_CTL_ADD, trigger->fd, &event) < 0) {
+    close(trigger->fd);
+    return -1;
+  }
+
+  snprintf(trigger->resource, sizeof(trigger->resource), "%s", resource);
+  snprintf(trigger->kind, sizeof(trigger->kind), "%s", kind);
+  trigger->events = 0;
+  nw_pressure_trigger_count++;
+
+  return 0;
+}
+
+static int nw_pressure_init(nodewatcher_module_t *module) {
+
+  char c;
+  char *specs, *spec, *saveptr;
+  lu_fdn_t fdn;
+
+  nw_pressure_module = module;
+
+  while ((c = lu_getopt(module->args, "t:")) != EOF) {
+    switch (c) {
+      case 't':
+        if (nw_pressure_trigger_spec)
+          free(nw_pressure_trigger_spec);
+        nw_pressure_trigger_spec = strdup(lu_getarg());
+        break;
+    }
+  }
+
+  if (!nw_pressure_trigger_spec)
+    nw_pressure_trigger_spec = strdup(NW_PRESSURE_DEFAULT_TRIGGERS);
+
+  /* An empty list disables triggers. */
+  if (!*nw_pressure_trigger_spec)
+    return 0;
+
+  nw_pressure_epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (nw_pressure_epoll < 0) {
+    syslog(LOG_WARNING, "Module %s: Could not create epoll instance, triggers are disabled.", module->name);
+    return 0;
+  }
+
+  specs = strdup(nw_pressure_trigger_spec);
+  for (spec = strtok_r(specs, ",", &saveptr); spec; spec = strtok_r(NULL, ",", &saveptr))
+    nw_pressure_add_trigger(module, spec);
+  free(specs);
+
+  if (!nw_pressure_trigger_count) {
+    close(nw_pressure_epoll);
+    nw_pressure_epoll = -1;
+    return 0;
+  }
+
+  fdn.fd = nw_pressure_epoll;
+  fdn.recv = nw_pressure_event;
+  fdn.options = LS_READ;
+  fdn.data = NULL;
+  nw_pressure_fdn = lu_fd_add(&fdn);
+
+  syslog(LOG_INFO, "Module %s: Watching %d pressure triggers.", module->name, nw_pressure_trigger_count);
+
+  return 0;
+}
+
+static void nw_pressure_cleanup(nodewatcher_module_t *module) {
+
+  int i;
+
+  UNUSED(module);
+
+  if (nw_pressure_fdn)
+    lu_fd_del(nw_pressure_fdn);
+  nw_pressure_fdn = NULL;
+  nw_timer_disarm(&nw_pressure_deferred);
+
+  for (i = 0; i < nw_pressure_trigger_count; i++)
+    close(nw_pressure_triggers[i].fd);
+  nw_pressure_trigger_count = 0;
+
+  if (nw_pressure_epoll >= 0)
+    close(nw_pressure_epoll);
+  nw_pressure_epoll = -1;
+
+  free(nw_pressure_trigger_spec);
+  nw_pressure_trigger_spec = NULL;
+}
+
+/* Module descriptor. */
+MODULE_DESC = {
+  .name = "core.pressure",
+  .author = "jaka@live.jp",
+  .version = 1,
+  .flags = NW_MODULE_ESSENTIAL,
+  .hooks = {
+    .init = nw_pressure_init,
+    .start_acquire_data = nw_pressure_start_acquire_data,
+    .cleanup = nw_pressure_cleanup,
+  },
+  .schedule = {
+    .refresh_interval = 30,
+  },
+};
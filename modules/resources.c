@@ -2,15 +2,51 @@
 #include <dirent.h>
 #include <string.h>
 #include <math.h>
+#include "batch.h"
 #include "modules.h"
 #include "utils.h"
 
+/* Bytes of /proc/<pid>/stat needed to get past the command name, up to 64 characters for kernel threads. */
+#define NW_RESOURCES_STAT_SIZE 128
+/* Space for the paths of one batch of process stat files. */
+#define NW_RESOURCES_PATH_POOL (NW_BATCH_SIZE * 48)
+
+static nodewatcher_batch_read_t nw_resources_reads[NW_BATCH_SIZE];
+static char nw_resources_buffers[NW_BATCH_SIZE][NW_RESOURCES_STAT_SIZE];
+static char nw_resources_paths[NW_RESOURCES_PATH_POOL];
+
+static void nw_resources_count_states(size_t count, int *proc_by_state) {
+
+  size_t i;
+  char *state;
+
+  nw_batch_read(nw_resources_reads, count);
+
+  for (i = 0; i < count; i++) {
+    if (nw_resources_reads[i].length <= 0)
+      continue;
+    /* The command name may itself contain parentheses, the state follows the last one. */
+    state = strrchr(nw_resources_reads[i].buffer, ')');
+    if (!state || state[1] != ' ')
+      continue;
+
+    switch (state[2]) {
+      case 'R': proc_by_state[0]++; break;
+      case 'S': proc_by_state[1]++; break;
+      case 'D': proc_by_state[2]++; break;
+      case 'Z': proc_by_state[3]++; break;
+      case 'T': proc_by_state[4]++; break;
+      case 'W': proc_by_state[5]++; break;
+    }
+  }
+}
+
 static int nw_resources_start_acquire_data(nodewatcher_module_t *module) {
 
   json_object *object = json_object_new_object();
 
   /* Load average */
-  FILE *loadavg_file = fopen("/proc/loadavg", "r");
+  FILE *loadavg_file = nw_utils_fopen("/proc/loadavg", "r");
   if (loadavg_file) {
     char load1min[16], load5min[16], load15min[16];
     if (fscanf(loadavg_file, "%15s %15s %15s", load1min, load5min, load15min) == 3) {
@@ -24,7 +60,7 @@ static int nw_resources_start_acquire_data(nodewatcher_module_t *module) {
   }
 
   /* Memory usage counters */
-  FILE *memory_file = fopen("/proc/meminfo", "r");
+  FILE *memory_file = nw_utils_fopen("/proc/meminfo", "r");
   if (memory_file) {
     json_object *memory = json_object_new_object();
     while (!feof(memory_file)) {
@@ -66,36 +102,48 @@ static int nw_resources_start_acquire_data(nodewatcher_module_t *module) {
   json_object_object_add(connections, "tracking", connections_tracking);
   json_object_object_add(object, "connections", connections);
 
-  /* Number of processes by status */
-  DIR *proc_dir;
+  /* Number of processes by status, stat files are read in batches; the scan is skipped while throttled */
+  DIR *proc_dir = NULL;
   struct dirent *proc_entry;
-  char path[PATH_MAX];
+  char path[PATH_MAX], root_path[PATH_MAX];
+  const char *resolved;
 
-  proc_dir = opendir("/proc");
+  if (!nw_module_throttle_level())
+    proc_dir = nw_utils_opendir("/proc");
   if (proc_dir) {
     json_object *processes = json_object_new_object();
     int proc_by_state[6] = {0};
+    size_t count = 0, pool = 0, length;
 
     while ((proc_entry = readdir(proc_dir)) != NULL) {
 
+      if (proc_entry->d_name[0] < '0' || proc_entry->d_name[0] > '9')
+        continue;
+
       snprintf(path, sizeof(path) - 1, "/proc/%s/stat", proc_entry->d_name);
+      resolved = nw_utils_path(root_path, sizeof(root_path), path);
+      length = strlen(resolved) + 1;
+      if (length > sizeof(nw_resources_paths))
+        continue;
+      if (pool + length > sizeof(nw_resources_paths)) {
+        /* Out of path space, read what we have and start over. */
+        nw_resources_count_states(count, proc_by_state);
+        count = pool = 0;
+      }
+      memcpy(nw_resources_paths + pool, resolved, length);
 
-      FILE *proc_file = fopen(path, "r");
-      if (proc_file) {
-        char state;
-        if (fscanf(proc_file, "%*d (%*[^)]) %c", &state) == 1) {
-          switch (state) {
-            case 'R': proc_by_state[0]++; break;
-            case 'S': proc_by_state[1]++; break;
-            case 'D': proc_by_state[2]++; break;
-            case 'Z': proc_by_state[3]++; break;
-            case 'T': proc_by_state[4]++; break;
-            case 'W': proc_by_state[5]++; break;
-          }
-        }
-        fclose(proc_file);
+      nw_resources_reads[count].path = nw_resources_paths + pool;
+      nw_resources_reads[count].fd = -1;
+      nw_resources_reads[count].buffer = nw_resources_buffers[count];
+      nw_resources_reads[count].size = NW_RESOURCES_STAT_SIZE;
+      pool += length;
+
+      if (++count == NW_BATCH_SIZE) {
+        nw_resources_count_states(count, proc_by_state);
+        count = pool = 0;
       }
     }
+    nw_resources_count_states(count, proc_by_state);
 
     closedir(proc_dir);
     json_object_object_add(processes, "running", json_object_new_int(proc_by_state[0]));
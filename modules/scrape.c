@@ -0,0 +1,443 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "modules.h"
+#include "utils.h"
+
+/*
+ * Values scraped from procfs and sysfs files listed in a configuration file
+ * (-c), one per line:
+ *
+ *   <output key> int <path>
+ *   <output key> string <path>
+ *   <output key> table <path> [<key>]
+ *   <output key> column <path> <line> <column>
+ *
+ * Output keys are dotted paths into the module data. A table is a file of
+ * "key: value" or "key value" lines, reported whole or as the value of one
+ * key. Columns are separated by whitespace and counted from zero, as are
+ * lines. Files are opened once and re-read from the start every cycle, all
+ * of them in one batch, and each one only once however many values it gives.
+ */
+
+#define NW_SCRAPE_BUFFER_SIZE 4096
+#define NW_SCRAPE_LINE_LENGTH 512
+
+enum {
+  NW_SCRAPE_INT,
+  NW_SCRAPE_STRING,
+  NW_SCRAPE_TABLE,
+  NW_SCRAPE_COLUMN,
+};
+
+typedef struct {
+  char *path;
+  /* Kept open between cycles, -1 until the file can be opened. */
+  int fd;
+  char *buffer;
+  ssize_t length;
+} nw_scrape_file_t;
+
+typedef struct {
+  char **keys;
+  size_t depth;
+  int type;
+  size_t file;
+  /* Key of a table entry, all entries when unset. */
+  char *key;
+  unsigned int line;
+  unsigned int column;
+} nw_scrape_metric_t;
+
+static char *nw_scrape_config = NULL;
+static nw_scrape_file_t *nw_scrape_files = NULL;
+static size_t nw_scrape_file_count = 0;
+static nw_scrape_metric_t *nw_scrape_metrics = NULL;
+static size_t nw_scrape_metric_count = 0;
+static nodewatcher_batch_read_t *nw_scrape_reads = NULL;
+
+/* Numbers are reported as numbers, anything else as a string. */
+static json_object *nw_scrape_value(const char *start, size_t length) {
+
+  char value[NW_SCRAPE_LINE_LENGTH], *end;
+  long long integer;
+  double number;
+
+  if (length >= sizeof(value))
+    length = sizeof(value) - 1;
+  memcpy(value, start, length);
+  value[length] = 0;
+
+  integer = strtoll(value, &end, 10);
+  if (length && !*end)
+    return json_object_new_int64(integer);
+
+  number = strtod(value, &end);
+  if (length && !*end)
+    return json_object_new_double(number);
+
+  return json_object_new_string(value);
+}
+
+/* Finds the given whitespace separated field, returns its length. */
+static size_t nw_scrape_field(const char *line, const char *end, unsigned int index, const char **field) {
+
+  const char *start;
+
+  for (;;) {
+    while (line < end && isspace((unsigned char)*line))
+      line++;
+    start = line;
+    while (line < end && !isspace((unsigned char)*line))
+      line++;
+    if (start == line)
+      return 0;
+    if (!index--) {
+      *field = start;
+      return line - start;
+    }
+  }
+}
+
+static json_object *nw_scrape_table(const char *buffer, const char *wanted) {
+
+  json_object *table = wanted ? NULL : json_object_new_object();
+  const char *line, *end, *separator, *value;
+  char buffer_key[NW_SCRAPE_LINE_LENGTH], *key;
+  size_t length;
+
+  for (line = buffer; *line; line = *end ? end + 1 : end) {
+    end = strchr(line, '\n');
+    if (!end)
+      end = line + strlen(line);
+
+    /* Keys end at a colon or, without one, at the first whitespace. */
+    separator = memchr(line, ':', end - line);
+    if (!separator) {
+      for (separator = line; separator < end && !isspace((unsigned char)*separator); separator++);
+    }
+    if (separator == line || separator == end || (size_t)(separator - line) >= sizeof(buffer_key))
+      continue;
+
+    memcpy(buffer_key, line, separator - line);
+    buffer_key[separator - line] = 0;
+    key = nw_utils_string_trim(buffer_key);
+    if (wanted && strcmp(key, wanted))
+      continue;
+
+    length = nw_scrape_field(separator + 1, end, 0, &value);
+    if (!length)
+      continue;
+
+    if (wanted)
+      return nw_scrape_value(value, length);
+    json_object_object_add(table, key, nw_scrape_value(value, length));
+  }
+
+  return table;
+}
+
+static json_object *nw_scrape_extract(nw_scrape_metric_t *metric, const char *buffer) {
+
+  const char *line = buffer, *end, *field;
+  unsigned int i;
+  size_t length;
+
+  switch (metric->type) {
+    case NW_SCRAPE_INT: return json_object_new_int64(strtoll(buffer, NULL, 10));
+    case NW_SCRAPE_STRING: {
+      end = strchr(buffer, '\n');
+      length = end ? (size_t)(end - buffer) : strlen(buffer);
+      while (length && isspace((unsigned char)buffer[length - 1]))
+        length--;
+      return json_object_new_string_len(buffer, length);
+    }
+    case NW_SCRAPE_TABLE: return nw_scrape_table(buffer, metric->key);
+    case NW_SCRAPE_COLUMN: {
+      for (i = 0; i < metric->line && line; i++) {
+        line = strchr(line, '\n');
+        if (line)
+          line++;
+      }
+      if (!line)
+        return NULL;
+
+      end = strchr(line, '\n');
+      if (!end)
+        end = line + strlen(line);
+      length = nw_scrape_field(line, end, metric->column, &field);
+      return length ? nw_scrape_value(field, length) : NULL;
+    }
+  }
+
+  return NULL;
+}
+
+static void nw_scrape_put(json_object *object, nw_scrape_metric_t *metric, json_object *value) {
+
+  json_object *child;
+  size_t i;
+
+  for (i = 0; i + 1 < metric->depth; i++) {
+    if (!json_object_object_get_ex(object, metric->keys[i], &child) || !json_object_is_type(child, json_type_object)) {
+      child = json_object_new_object();
+      json_object_object_add(object, metric->keys[i], child);
+    }
+    object = child;
+  }
+
+  json_object_object_add(object, metric->keys[metric->depth - 1], value);
+}
+
+static void nw_scrape_open(nw_scrape_file_t *file) {
+
+  char buffer[PATH_MAX];
+
+  file->fd = open(nw_utils_path(buffer, sizeof(buffer), file->path), O_RDONLY | O_CLOEXEC);
+}
+
+static int nw_scrape_start_acquire_data(nodewatcher_module_t *module) {
+
+  json_object *object = json_object_new_object();
+  json_object *value;
+  size_t i, count = 0;
+
+  /* Read every open file in one batch, files that were missing are tried again. */
+  for (i = 0; i < nw_scrape_file_count; i++) {
+    nw_scrape_file_t *file = &nw_scrape_files[i];
+
+    file->length = -1;
+    if (file->fd < 0)
+      nw_scrape_open(file);
+    if (file->fd < 0)
+      continue;
+
+    nw_scrape_reads[count].path = file->path;
+    nw_scrape_reads[count].fd = file->fd;
+    nw_scrape_reads[count].buffer = file->buffer;
+    nw_scrape_reads[count].size = NW_SCRAPE_BUFFER_SIZE;
+    count++;
+  }
+  nw_batch_read(nw_scrape_reads, count);
+
+  for (i = 0, count = 0; i < nw_scrape_file_count; i++) {
+    nw_scrape_file_t *file = &nw_scrape_files[i];
+
+    if (file->fd < 0)
+      continue;
+
+    file->length = nw_scrape_reads[count++].length;
+    if (file->length < 0) {
+      /* The file went away, for example with its device, reopen it next time. */
+      close(file->fd);
+      file->fd = -1;
+    }
+  }
+
+  for (i = 0; i < nw_scrape_metric_count; i++) {
+    nw_scrape_metric_t *metric = &nw_scrape_metrics[i];
+
+    if (nw_scrape_files[metric->file].length < 0)
+      continue;
+
+    value = nw_scrape_extract(metric, nw_scrape_files[metric->file].buffer);
+    if (value)
+      nw_scrape_put(object, metric, value);
+  }
+
+  /* Store resulting JSON object. */
+  return nw_module_finish_acquire_data(module, object);
+}
+
+static size_t nw_scrape_file(const char *path) {
+
+  nw_scrape_file_t *files;
+  size_t i;
+
+  for (i = 0; i < nw_scrape_file_count; i++) {
+    if (!strcmp(nw_scrape_files[i].path, path))
+      return i;
+  }
+
+  files = realloc(nw_scrape_files, (nw_scrape_file_count + 1) * sizeof(nw_scrape_file_t));
+  if (!files)
+    return (size_t)-1;
+  nw_scrape_files = files;
+
+  files[nw_scrape_file_count].path = strdup(path);
+  files[nw_scrape_file_count].buffer = malloc(NW_SCRAPE_BUFFER_SIZE);
+  files[nw_scrape_file_count].length = -1;
+  nw_scrape_open(&files[nw_scrape_file_count]);
+
+  return nw_scrape_file_count++;
+}
+
+static void nw_scrape_metric_free(nw_scrape_metric_t *metric) {
+
+  size_t i;
+
+  for (i = 0; i < metric->depth; i++)
+    free(metric->keys[i]);
+  free(metric->keys);
+  free(metric->key);
+}
+
+static int nw_scrape_parse(nodewatcher_module_t *module, char *line, unsigned int number) {
+
+  nw_scrape_metric_t metric, *metrics;
+  char *output, *type, *path, *argument, *key, *saveptr, *keyptr, **keys;
+
+  output = strtok_r(line, " \t\r\n", &saveptr);
+  if (!output || *output == '#')
+    return 0;
+
+  type = strtok_r(NULL, " \t\r\n", &saveptr);
+  path = strtok_r(NULL, " \t\r\n", &saveptr);
+  argument = strtok_r(NULL, " \t\r\n", &saveptr);
+
+  memset(&metric, 0, sizeof(metric));
+  if (!type || !path) {
+    type = NULL;
+  } else if (!strcmp(type, "int")) {
+    metric.type = NW_SCRAPE_INT;
+  } else if (!strcmp(type, "string")) {
+    metric.type = NW_SCRAPE_STRING;
+  } else if (!strcmp(type, "table")) {
+    metric.type = NW_SCRAPE_TABLE;
+    metric.key = argument ? strdup(argument) : NULL;
+  } else if (!strcmp(type, "column") && argument) {
+    metric.type = NW_SCRAPE_COLUMN;
+    metric.line = atoi(argument);
+    argument = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (!argument)
+      type = NULL;
+    else
+      metric.column = atoi(argument);
+  } else {
+    type = NULL;
+  }
+
+  /* Output keys made of dots only name nothing. */
+  for (key = type ? strtok_r(output, ".", &keyptr) : NULL; key; key = strtok_r(NULL, ".", &keyptr)) {
+    keys = realloc(metric.keys, (metric.depth + 1) * sizeof(char *));
+    if (!keys || !(keys[metric.depth] = strdup(key))) {
+      if (keys)
+        metric.keys = keys;
+      type = NULL;
+      break;
+    }
+    metric.keys = keys;
+    metric.depth++;
+  }
+
+  if (!type || !metric.depth) {
+    syslog(LOG_WARNING, "Module %s: Ignoring invalid line %u of '%s'.", module->name, number, nw_scrape_config);
+    nw_scrape_metric_free(&metric);
+    return -1;
+  }
+
+  metric.file = nw_scrape_file(path);
+  if (metric.file == (size_t)-1) {
+    nw_scrape_metric_free(&metric);
+    return -1;
+  }
+
+  metrics = realloc(nw_scrape_metrics, (nw_scrape_metric_count + 1) * sizeof(nw_scrape_metric_t));
+  if (!metrics) {
+    nw_scrape_metric_free(&metric);
+    return -1;
+  }
+  nw_scrape_metrics = metrics;
+  nw_scrape_metrics[nw_scrape_metric_count++] = metric;
+
+  return 0;
+}
+
+static int nw_scrape_init(nodewatcher_module_t *module) {
+
+  char line[NW_SCRAPE_LINE_LENGTH];
+  unsigned int number = 0;
+  FILE *file;
+  char c;
+
+  while ((c = lu_getopt(module->args, "c:")) != EOF) {
+    switch (c) {
+      case 'c':
+        if (nw_scrape_config)
+          free(nw_scrape_config);
+        nw_scrape_config = strdup(lu_getarg());
+        break;
+    }
+  }
+
+  if (!nw_scrape_config) {
+    syslog(LOG_INFO, "Module %s: No configuration given, nothing to scrape.", module->name);
+    return 0;
+  }
+
+  file = fopen(nw_scrape_config, "r");
+  if (!file) {
+    syslog(LOG_WARNING, "Module %s: Could not open '%s'.", module->name, nw_scrape_config);
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), file))
+    nw_scrape_parse(module, line, ++number);
+  fclose(file);
+
+  nw_scrape_reads = calloc(nw_scrape_file_count ? nw_scrape_file_count : 1, sizeof(nodewatcher_batch_read_t));
+
+  syslog(LOG_INFO, "Module %s: Scraping %zu values from %zu files.", module->name, nw_scrape_metric_count,
+    nw_scrape_file_count);
+
+  return 0;
+}
+
+static void nw_scrape_cleanup(nodewatcher_module_t *module) {
+
+  size_t i;
+
+  UNUSED(module);
+
+  for (i = 0; i < nw_scrape_file_count; i++) {
+    if (nw_scrape_files[i].fd >= 0)
+      close(nw_scrape_files[i].fd);
+    free(nw_scrape_files[i].path);
+    free(nw_scrape_files[i].buffer);
+  }
+  free(nw_scrape_files);
+  nw_scrape_files = NULL;
+  nw_scrape_file_count = 0;
+
+  for (i = 0; i < nw_scrape_metric_count; i++)
+    nw_scrape_metric_free(&nw_scrape_metrics[i]);
+  free(nw_scrape_metrics);
+  nw_scrape_metrics = NULL;
+  nw_scrape_metric_count = 0;
+
+  free(nw_scrape_reads);
+  nw_scrape_reads = NULL;
+  free(nw_scrape_config);
+  nw_scrape_config = NULL;
+}
+
+/* Module descriptor. */
+MODULE_DESC = {
+  .name = "core.scrape",
+  .author = "jaka@live.jp",
+  .version = 1,
+  .hooks = {
+    .init = nw_scrape_init,
+    .start_acquire_data = nw_scrape_start_acquire_data,
+    .cleanup = nw_scrape_cleanup,
+  },
+  .schedule = {
+    .refresh_interval = 30,
+  },
+};
@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include "modules.h"
+#include "trace.h"
 
 struct nw_usbtemp_client_s {
   lu_fdn_t *fdn;
@@ -18,7 +19,18 @@ struct nw_usbtemp_client_s {
 
 static struct nw_usbtemp_client_s bc;
 
-static void nw_sensors_usbtemp_close(struct nw_usbtemp_client_s *bc)
+static int nw_sensors_usbtemp_finish(struct nw_usbtemp_client_s *bc)
+{
+  json_object *object;
+
+  /* Ownership of the object passes to the core. */
+  object = bc->object;
+  bc->object = NULL;
+
+  return nw_module_finish_acquire_data(bc->module, object);
+}
+
+static void nw_sensors_usbtemp_disconnect(struct nw_usbtemp_client_s *bc)
 {
   int fd;
 
@@ -31,23 +43,22 @@ static void nw_sensors_usbtemp_close(struct nw_usbtemp_client_s *bc)
   lu_task_remove((void *)bc);
 
   close(fd);
+}
 
-  nw_module_finish_acquire_data(bc->module, bc->object);
-
-  bc->object = NULL;
+static void nw_sensors_usbtemp_close(struct nw_usbtemp_client_s *bc)
+{
+  nw_sensors_usbtemp_disconnect(bc);
+  nw_sensors_usbtemp_finish(bc);
 }
 
-static void nw_sensors_usbtemp_recv(void *arg)
+static void nw_sensors_usbtemp_process(struct nw_usbtemp_client_s *bc)
 {
-  struct nw_usbtemp_client_s *bc;
   json_object *temperature;
   char line[1024];
   char *start;
   float temp;
   int rv;
 
-  bc = (struct nw_usbtemp_client_s *)arg;
-
   if (bc->stream == NULL)
   {
     return;
@@ -79,13 +90,26 @@ static void nw_sensors_usbtemp_recv(void *arg)
   }
 }
 
+static void nw_sensors_usbtemp_recv(void *arg)
+{
+  uint64_t span;
+
+  span = nw_trace_begin();
+  nw_sensors_usbtemp_process((struct nw_usbtemp_client_s *)arg);
+  nw_trace_end("sensors.generic recv", "fd", span);
+}
+
 static void nw_sensors_usbtemp_timeout(void *arg)
 {
   struct nw_usbtemp_client_s *bc;
+  uint64_t span;
 
+  span = nw_trace_begin();
   bc = (struct nw_usbtemp_client_s *)arg;
   syslog(LOG_WARNING, "%s: Connection with local Babel instance timed out.", bc->module->name);
+  nw_module_timeout_acquire_data(bc->module);
   nw_sensors_usbtemp_close(bc);
+  nw_trace_end("sensors.generic timeout", "timeout", span);
 }
 
 static int nw_sensors_start_acquire_data(nodewatcher_module_t *module)
@@ -104,7 +128,7 @@ static int nw_sensors_start_acquire_data(nodewatcher_module_t *module)
   if (fdn.fd < 0)
   {
     syslog(LOG_WARNING, "%s: Could not create socket.", module->name);
-    return nw_module_finish_acquire_data(module, bc.object);
+    return nw_sensors_usbtemp_finish(&bc);
   }
 
   memset((char *)&temp_addr, 0, sizeof(temp_addr));
@@ -114,7 +138,8 @@ static int nw_sensors_start_acquire_data(nodewatcher_module_t *module)
 
   if (connect(fdn.fd, (struct sockaddr *)&temp_addr, sizeof(temp_addr)) < 0) {
     syslog(LOG_WARNING, "%s: Could not connect to local usbtempd instance.", module->name);
-    return nw_module_finish_acquire_data(module, bc.object);
+    close(fdn.fd);
+    return nw_sensors_usbtemp_finish(&bc);
   }
 
   bc.stream = lu_stream_create(256);
@@ -130,6 +155,22 @@ static int nw_sensors_start_acquire_data(nodewatcher_module_t *module)
   return 0;
 }
 
+static void nw_sensors_cancel_acquire_data(nodewatcher_module_t *module)
+{
+  UNUSED(module);
+
+  if (bc.stream)
+  {
+    nw_sensors_usbtemp_disconnect(&bc);
+  }
+
+  if (bc.object)
+  {
+    json_object_put(bc.object);
+    bc.object = NULL;
+  }
+}
+
 static int nw_sensors_init(nodewatcher_module_t *module)
 {
   bc.module = module;
@@ -145,6 +186,7 @@ MODULE_DESC = {
   .hooks = {
     .init = nw_sensors_init,
     .start_acquire_data = nw_sensors_start_acquire_data,
+    .cancel_acquire_data = nw_sensors_cancel_acquire_data,
   },
   .schedule = {
     .refresh_interval = 30,
@@ -0,0 +1,345 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "modules.h"
+#include "utils.h"
+
+/*
+ * Block device I/O rates from /proc/diskstats and filesystem usage of the
+ * mount points given with -S <mountpoint>[,<mountpoint>...] (default /).
+ * Partitions (-P) and virtual devices (-V) are only reported when requested.
+ */
+
+#define NW_STORAGE_SECTOR_SIZE 512
+
+enum {
+  NW_STORAGE_READS,
+  NW_STORAGE_READS_MERGED,
+  NW_STORAGE_SECTORS_READ,
+  NW_STORAGE_MS_READING,
+  NW_STORAGE_WRITES,
+  NW_STORAGE_WRITES_MERGED,
+  NW_STORAGE_SECTORS_WRITTEN,
+  NW_STORAGE_MS_WRITING,
+  NW_STORAGE_IN_PROGRESS,
+  NW_STORAGE_MS_IO,
+  NW_STORAGE_MS_WEIGHTED,
+  NW_STORAGE_COUNTERS,
+};
+
+enum {
+  NW_STORAGE_UNKNOWN = 0,
+  NW_STORAGE_DISK,
+  NW_STORAGE_PARTITION,
+  NW_STORAGE_VIRTUAL,
+};
+
+typedef struct {
+  char name[32];
+  int type;
+  int seen;
+  uint64_t counters[NW_STORAGE_COUNTERS];
+  /* Monotonic time of the sample in microseconds, zero before the first one. */
+  uint64_t time;
+} nw_storage_device_t;
+
+static nw_storage_device_t *nw_storage_devices = NULL;
+static size_t nw_storage_device_count = 0;
+static size_t nw_storage_device_capacity = 0;
+
+static char *nw_storage_mountpoints = NULL;
+static int nw_storage_partitions = 0;
+static int nw_storage_virtual = 0;
+
+static int nw_storage_classify(const char *name) {
+
+  char path[PATH_MAX], buffer[PATH_MAX];
+  struct stat s;
+
+  snprintf(path, sizeof(path), "/sys/devices/virtual/block/%s", name);
+  if (!stat(nw_utils_path(buffer, sizeof(buffer), path), &s))
+    return NW_STORAGE_VIRTUAL;
+
+  /* Only whole disks are listed in /sys/block. */
+  snprintf(path, sizeof(path), "/sys/block/%s", name);
+  if (!stat(nw_utils_path(buffer, sizeof(buffer), path), &s))
+    return NW_STORAGE_DISK;
+
+  return NW_STORAGE_PARTITION;
+}
+
+/* Devices show up in the same order every time, so the previous position is tried first. */
+static nw_storage_device_t *nw_storage_device(const char *name, size_t hint) {
+
+  nw_storage_device_t *devices, *device;
+  size_t i;
+
+  if (hint < nw_storage_device_count && !strcmp(nw_storage_devices[hint].name, name))
+    return &nw_storage_devices[hint];
+
+  for (i = 0; i < nw_storage_device_count; i++) {
+    if (!strcmp(nw_storage_devices[i].name, name))
+      return &nw_storage_devices[i];
+  }
+
+  if (nw_storage_device_count == nw_storage_device_capacity) {
+    devices = realloc(nw_storage_devices, (nw_storage_device_capacity ? nw_storage_device_capacity * 2 : 16) *
+      sizeof(nw_storage_device_t));
+    if (!devices)
+      return NULL;
+    nw_storage_devices = devices;
+    nw_storage_device_capacity = nw_storage_device_capacity ? nw_storage_device_capacity * 2 : 16;
+  }
+
+  device = &nw_storage_devices[nw_storage_device_count++];
+  memset(device, 0, sizeof(nw_storage_device_t));
+  snprintf(device->name, sizeof(device->name), "%s", name);
+  device->type = nw_storage_classify(name);
+
+  return device;
+}
+
+/* Counters are unsigned long in the kernel, so they wrap at 32 bits on 32-bit systems. */
+static uint64_t nw_storage_delta(uint64_t current, uint64_t previous) {
+
+  if (current >= previous)
+    return current - previous;
+  if (previous <= UINT32_MAX)
+    return current + (UINT32_MAX - previous) + 1;
+  return 0;
+}
+
+static json_object *nw_storage_device_json(nw_storage_device_t *device, uint64_t *counters, uint64_t now) {
+
+  json_object *object = json_object_new_object();
+  uint64_t reads, writes;
+  double elapsed;
+
+  json_object_object_add(object, "reads", json_object_new_int64(counters[NW_STORAGE_READS]));
+  json_object_object_add(object, "writes", json_object_new_int64(counters[NW_STORAGE_WRITES]));
+  json_object_object_add(object, "read_bytes",
+    json_object_new_int64(counters[NW_STORAGE_SECTORS_READ] * NW_STORAGE_SECTOR_SIZE));
+  json_object_object_add(object, "written_bytes",
+    json_object_new_int64(counters[NW_STORAGE_SECTORS_WRITTEN] * NW_STORAGE_SECTOR_SIZE));
+  json_object_object_add(object, "in_progress", json_object_new_int64(counters[NW_STORAGE_IN_PROGRESS]));
+
+  if (!device->time || now <= device->time)
+    return object;
+
+  elapsed = (now - device->time) / 1000000.0;
+  reads = nw_storage_delta(counters[NW_STORAGE_READS], device->counters[NW_STORAGE_READS]);
+  writes = nw_storage_delta(counters[NW_STORAGE_WRITES], device->counters[NW_STORAGE_WRITES]);
+
+  json_object *rates = json_object_new_object();
+  json_object_object_add(rates, "read_iops", json_object_new_double(reads / elapsed));
+  json_object_object_add(rates, "write_iops", json_object_new_double(writes / elapsed));
+  json_object_object_add(rates, "read_bytes", json_object_new_double(NW_STORAGE_SECTOR_SIZE *
+    nw_storage_delta(counters[NW_STORAGE_SECTORS_READ], device->counters[NW_STORAGE_SECTORS_READ]) / elapsed));
+  json_object_object_add(rates, "write_bytes", json_object_new_double(NW_STORAGE_SECTOR_SIZE *
+    nw_storage_delta(counters[NW_STORAGE_SECTORS_WRITTEN], device->counters[NW_STORAGE_SECTORS_WRITTEN]) / elapsed));
+
+  /* Average time (in milliseconds) a request took, including queueing. */
+  json_object_object_add(rates, "read_latency_ms", json_object_new_double(reads ? (double)nw_storage_delta(
+    counters[NW_STORAGE_MS_READING], device->counters[NW_STORAGE_MS_READING]) / reads : 0.0));
+  json_object_object_add(rates, "write_latency_ms", json_object_new_double(writes ? (double)nw_storage_delta(
+    counters[NW_STORAGE_MS_WRITING], device->counters[NW_STORAGE_MS_WRITING]) / writes : 0.0));
+
+  /* Share of time (in percent) the device was busy. */
+  double utilisation = nw_storage_delta(counters[NW_STORAGE_MS_IO], device->counters[NW_STORAGE_MS_IO]) /
+    (elapsed * 10.0);
+  json_object_object_add(rates, "utilisation", json_object_new_double(utilisation > 100.0 ? 100.0 : utilisation));
+
+  json_object_object_add(object, "rates", rates);
+
+  return object;
+}
+
+static json_object *nw_storage_devices_json(void) {
+
+  json_object *devices = json_object_new_object();
+  nw_storage_device_t *device;
+  uint64_t counters[NW_STORAGE_COUNTERS];
+  uint64_t now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  char line[512], name[32];
+  size_t position = 0, i;
+  unsigned long long values[NW_STORAGE_COUNTERS];
+
+  FILE *file = nw_utils_fopen("/proc/diskstats", "r");
+  if (!file)
+    return devices;
+
+  for (i = 0; i < nw_storage_device_count; i++)
+    nw_storage_devices[i].seen = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "%*u %*u %31s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu", name,
+        &values[0], &values[1], &values[2], &values[3], &values[4], &values[5], &values[6], &values[7],
+        &values[8], &values[9], &values[10]) != 1 + NW_STORAGE_COUNTERS)
+      continue;
+
+    device = nw_storage_device(name, position);
+    if (!device)
+      continue;
+    position = device - nw_storage_devices + 1;
+
+    for (i = 0; i < NW_STORAGE_COUNTERS; i++)
+      counters[i] = values[i];
+
+    if ((device->type == NW_STORAGE_PARTITION && nw_storage_partitions) ||
+        (device->type == NW_STORAGE_VIRTUAL && nw_storage_virtual) || device->type == NW_STORAGE_DISK)
+      json_object_object_add(devices, device->name, nw_storage_device_json(device, counters, now));
+
+    memcpy(device->counters, counters, sizeof(counters));
+    device->time = now;
+    device->seen = 1;
+  }
+  fclose(file);
+
+  /* Forget devices that went away, they may come back as something else. */
+  i = 0;
+  while (i < nw_storage_device_count) {
+    if (!nw_storage_devices[i].seen)
+      nw_storage_devices[i] = nw_storage_devices[--nw_storage_device_count];
+    else
+      i++;
+  }
+
+  return devices;
+}
+
+static json_object *nw_storage_filesystems_json(void) {
+
+  json_object *filesystems = json_object_new_object();
+  char *mountpoints, *mountpoint, *saveptr;
+  char buffer[PATH_MAX];
+  struct statvfs s;
+
+  mountpoints = strdup(nw_storage_mountpoints);
+  for (mountpoint = strtok_r(mountpoints, ",", &saveptr); mountpoint; mountpoint = strtok_r(NULL, ",", &saveptr)) {
+    if (statvfs(nw_utils_path(buffer, sizeof(buffer), mountpoint), &s) < 0)
+      continue;
+
+    json_object *filesystem = json_object_new_object();
+    json_object_object_add(filesystem, "total", json_object_new_int64((uint64_t)s.f_blocks * s.f_frsize));
+    json_object_object_add(filesystem, "free", json_object_new_int64((uint64_t)s.f_bfree * s.f_frsize));
+    json_object_object_add(filesystem, "available", json_object_new_int64((uint64_t)s.f_bavail * s.f_frsize));
+    json_object_object_add(filesystem, "inodes", json_object_new_int64(s.f_files));
+    json_object_object_add(filesystem, "inodes_free", json_object_new_int64(s.f_ffree));
+    json_object_object_add(filesystem, "readonly", json_object_new_boolean(s.f_flag & ST_RDONLY));
+    json_object_object_add(filesystems, mountpoint, filesystem);
+  }
+  free(mountpoints);
+
+  return filesystems;
+}
+
+static int nw_storage_start_acquire_data(nodewatcher_module_t *module) {
+
+  json_object *object = json_object_new_object();
+
+  json_object_object_add(object, "devices", nw_storage_devices_json());
+  json_object_object_add(object, "filesystems", nw_storage_filesystems_json());
+
+  /* Store resulting JSON object. */
+  return nw_module_finish_acquire_data(module, object);
+}
+
+static json_object *nw_storage_save_state(nodewatcher_module_t *module) {
+
+  json_object *state, *device, *counters;
+  size_t i, j;
+
+  UNUSED(module);
+
+  if (!nw_storage_device_count)
+    return NULL;
+
+  state = json_object_new_object();
+  for (i = 0; i < nw_storage_device_count; i++) {
+    device = json_object_new_object();
+    counters = json_object_new_array();
+    for (j = 0; j < NW_STORAGE_COUNTERS; j++)
+      json_object_array_add(counters, json_object_new_int64(nw_storage_devices[i].counters[j]));
+    json_object_object_add(device, "time", json_object_new_int64(nw_storage_devices[i].time));
+    json_object_object_add(device, "counters", counters);
+    json_object_object_add(state, nw_storage_devices[i].name, device);
+  }
+
+  return state;
+}
+
+static void nw_storage_restore_state(nodewatcher_module_t *module, json_object *state) {
+
+  json_object *time, *counters;
+  nw_storage_device_t *device;
+  size_t i;
+
+  UNUSED(module);
+
+  json_object_object_foreach(state, name, entry) {
+    if (!json_object_object_get_ex(entry, "time", &time) || !json_object_object_get_ex(entry, "counters", &counters) ||
+        !json_object_is_type(counters, json_type_array) || json_object_array_length(counters) != NW_STORAGE_COUNTERS)
+      continue;
+    if (!(device = nw_storage_device(name, nw_storage_device_count)))
+      break;
+
+    device->time = json_object_get_int64(time);
+    for (i = 0; i < NW_STORAGE_COUNTERS; i++)
+      device->counters[i] = json_object_get_int64(json_object_array_get_idx(counters, i));
+  }
+}
+
+static int nw_storage_init(nodewatcher_module_t *module) {
+
+  char c;
+
+  while ((c = lu_getopt(module->args, "S:PV")) != EOF) {
+    switch (c) {
+      case 'S':
+        if (nw_storage_mountpoints)
+          free(nw_storage_mountpoints);
+        nw_storage_mountpoints = strdup(lu_getarg());
+        break;
+      case 'P': nw_storage_partitions = 1; break;
+      case 'V': nw_storage_virtual = 1; break;
+    }
+  }
+
+  if (!nw_storage_mountpoints)
+    nw_storage_mountpoints = strdup("/");
+
+  return 0;
+}
+
+static void nw_storage_cleanup(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  free(nw_storage_mountpoints);
+  nw_storage_mountpoints = NULL;
+  free(nw_storage_devices);
+  nw_storage_devices = NULL;
+  nw_storage_device_count = 0;
+  nw_storage_device_capacity = 0;
+}
+
+/* Module descriptor. */
+MODULE_DESC = {
+  .name = "core.storage",
+  .author = "jaka@live.jp",
+  .version = 1,
+  .hooks = {
+    .init = nw_storage_init,
+    .start_acquire_data = nw_storage_start_acquire_data,
+    .cleanup = nw_storage_cleanup,
+    .save_state = nw_storage_save_state,
+    .restore_state = nw_storage_restore_state,
+  },
+  .schedule = {
+    .refresh_interval = 30,
+  },
+};
@@ -16,7 +16,7 @@ static int nw_system_start_acquire_data(nodewatcher_module_t *module) {
 
   /* UUID */
   if (nw_system_uuid == NULL) {
-    FILE *uuid = fopen("/etc/uuid", "r");
+    FILE *uuid = nw_utils_fopen("/etc/uuid", "r");
     if (uuid) {
       fread(buffer, sizeof(char), sizeof(buffer), uuid);
       json_object_object_add(object, "uuid", json_object_new_string(nw_utils_string_trim(buffer)));
@@ -41,7 +41,7 @@ static int nw_system_start_acquire_data(nodewatcher_module_t *module) {
   json_object_object_add(object, "local_time", json_object_new_int(time(NULL)));
 
   /* Uptime in seconds */
-  FILE *uptime_file = fopen("/proc/uptime", "r");
+  FILE *uptime_file = nw_utils_fopen("/proc/uptime", "r");
   if (uptime_file) {
     long long int uptime;
     if (fscanf(uptime_file, "%lld", &uptime) == 1)
@@ -51,7 +51,7 @@ static int nw_system_start_acquire_data(nodewatcher_module_t *module) {
 
   /* Extract information from /proc/cpuinfo */
   json_object *hardware = json_object_new_object();
-  FILE *cpuinfo_file = fopen("/proc/cpuinfo", "r");
+  FILE *cpuinfo_file = nw_utils_fopen("/proc/cpuinfo", "r");
   if (cpuinfo_file) {
     while (!feof(cpuinfo_file)) {
       char key[128];
@@ -82,6 +82,14 @@ static int nw_system_init(nodewatcher_module_t *module) {
   return 0;
 }
 
+static void nw_system_cleanup(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  free(nw_system_uuid);
+  nw_system_uuid = NULL;
+}
+
 /* Module descriptor */
 MODULE_DESC = {
   .name = "core.general",
@@ -89,7 +97,8 @@ MODULE_DESC = {
   .version = 4,
   .hooks = {
      .init = nw_system_init,
-     .start_acquire_data = nw_system_start_acquire_data
+     .start_acquire_data = nw_system_start_acquire_data,
+     .cleanup = nw_system_cleanup
   },
   .schedule = {
     .refresh_interval = 30,
@@ -0,0 +1,891 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <libre/scheduler.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "modules.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * Per-client traffic from connection tracking. Flows are dumped over
+ * ctnetlink on the event loop, one socket buffer per dispatch, and summed by
+ * their original source address. Clients found in the DHCP leases (-l) are
+ * reported with their MAC address and hostname; without leases every source
+ * address is. Rates add up what each flow (by its conntrack id) carried since
+ * the previous dump, and the final counters of flows that end, which arrive
+ * as destroy events, so short flows between two cycles are counted too.
+ */
+
+#define DEFAULT_DHCPLEASES_FILENAME "dhcp.leases"
+#define NW_TRAFFIC_BUFFER_SIZE 65536
+/* Maximum number of flows whose counters are remembered. */
+#define NW_TRAFFIC_MAX_FLOWS 262144
+/* Maximum number of clients, destroy events of new source addresses beyond it are dropped. */
+#define NW_TRAFFIC_MAX_CLIENTS 65536
+
+enum {
+  NW_TRAFFIC_TX_BYTES,
+  NW_TRAFFIC_RX_BYTES,
+  NW_TRAFFIC_TX_PACKETS,
+  NW_TRAFFIC_RX_PACKETS,
+  NW_TRAFFIC_COUNTERS,
+};
+
+static const char *nw_traffic_counter_names[NW_TRAFFIC_COUNTERS] = {
+  "tx_bytes", "rx_bytes", "tx_packets", "rx_packets",
+};
+
+typedef struct {
+  /* Zero marks a free slot. */
+  int family;
+  unsigned char address[16];
+  /* Cycle in which the client was last seen in a dump, and last reported. */
+  unsigned int seen;
+  unsigned int reported;
+  /* Whether ended flows carried traffic since the client was last reported. */
+  int active;
+  unsigned int flows;
+  /* Totals of the live flows. */
+  uint64_t counters[NW_TRAFFIC_COUNTERS];
+  /* Traffic since the client was last reported. */
+  uint64_t delta[NW_TRAFFIC_COUNTERS];
+  /* Monotonic time of the last report in microseconds, zero if there is none. */
+  uint64_t time;
+  char mac[18];
+  char hostname[65];
+} nw_traffic_client_t;
+
+typedef struct {
+  /* Client of the flow, zero family marks a free slot. */
+  int family;
+  unsigned char address[16];
+  uint32_t id;
+  /* Cycle in which the flow was last dumped. */
+  unsigned int seen;
+  /* Set once the final counters arrived, so a late dump entry does not count it again. */
+  int ended;
+  uint64_t counters[NW_TRAFFIC_COUNTERS];
+} nw_traffic_flow_t;
+
+struct nw_traffic_dump_s {
+  lu_fdn_t *fdn;
+  nodewatcher_module_t *module;
+  uint32_t seq;
+  int pending;
+};
+
+static struct nw_traffic_dump_s nw_traffic_dump;
+static char *nw_traffic_leases = NULL;
+/* Socket receiving destroy events. */
+static lu_fdn_t *nw_traffic_events = NULL;
+
+/* Open addressing table keyed by client address, its size is a power of two. */
+static nw_traffic_client_t *nw_traffic_clients = NULL;
+static size_t nw_traffic_capacity = 0;
+static size_t nw_traffic_count = 0;
+static unsigned int nw_traffic_cycle = 0;
+
+/* Open addressing table keyed by conntrack id, its size is a power of two. */
+static nw_traffic_flow_t *nw_traffic_flows = NULL;
+static size_t nw_traffic_flow_capacity = 0;
+static size_t nw_traffic_flow_count = 0;
+
+static void nw_traffic_recv(void *arg);
+
+static uint32_t nw_traffic_hash(int family, const unsigned char *address) {
+
+  uint32_t hash = 2166136261U;
+  size_t i, length = family == AF_INET ? 4 : 16;
+
+  for (i = 0; i < length; i++) {
+    hash ^= address[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+static nw_traffic_client_t *nw_traffic_slot(nw_traffic_client_t *table, size_t capacity, int family,
+  const unsigned char *address) {
+
+  size_t i = nw_traffic_hash(family, address) & (capacity - 1);
+
+  while (table[i].family && (table[i].family != family || memcmp(table[i].address, address, 16)))
+    i = (i + 1) & (capacity - 1);
+
+  return &table[i];
+}
+
+/* Rebuilds the table, when pruning with only the clients reported in this cycle. */
+static int nw_traffic_rehash(size_t capacity, int prune) {
+
+  nw_traffic_client_t *table, *slot;
+  size_t i;
+
+  table = calloc(capacity, sizeof(nw_traffic_client_t));
+  if (!table)
+    return -1;
+
+  nw_traffic_count = 0;
+  for (i = 0; i < nw_traffic_capacity; i++) {
+    if (!nw_traffic_clients[i].family || (prune && nw_traffic_clients[i].reported != nw_traffic_cycle))
+      continue;
+    slot = nw_traffic_slot(table, capacity, nw_traffic_clients[i].family, nw_traffic_clients[i].address);
+    *slot = nw_traffic_clients[i];
+    nw_traffic_count++;
+  }
+
+  free(nw_traffic_clients);
+  nw_traffic_clients = table;
+  nw_traffic_capacity = capacity;
+
+  return 0;
+}
+
+static nw_traffic_client_t *nw_traffic_client(int family, const unsigned char *address) {
+
+  nw_traffic_client_t *client = NULL;
+
+  if (nw_traffic_capacity)
+    client = nw_traffic_slot(nw_traffic_clients, nw_traffic_capacity, family, address);
+
+  if (!client || !client->family) {
+    if (nw_traffic_count >= NW_TRAFFIC_MAX_CLIENTS)
+      return NULL;
+
+    /* Keep the load below 3/4. */
+    if ((nw_traffic_count + 1) * 4 > nw_traffic_capacity * 3) {
+      if (nw_traffic_rehash(nw_traffic_capacity ? nw_traffic_capacity * 2 : 256, 0) < 0)
+        return NULL;
+      client = nw_traffic_slot(nw_traffic_clients, nw_traffic_capacity, family, address);
+    }
+
+    memset(client, 0, sizeof(nw_traffic_client_t));
+    client->family = family;
+    memcpy(client->address, address, family == AF_INET ? 4 : 16);
+    nw_traffic_count++;
+  }
+
+  return client;
+}
+
+static nw_traffic_flow_t *nw_traffic_flow_slot(nw_traffic_flow_t *table, size_t capacity, uint32_t id) {
+
+  size_t i = (id * 2654435761U) & (capacity - 1);
+
+  while (table[i].family && table[i].id != id)
+    i = (i + 1) & (capacity - 1);
+
+  return &table[i];
+}
+
+/* Rebuilds the flow table, when pruning with only the live flows dumped in this cycle. */
+static int nw_traffic_flow_rehash(size_t capacity, int prune) {
+
+  nw_traffic_flow_t *table, *slot;
+  size_t i;
+
+  table = calloc(capacity, sizeof(nw_traffic_flow_t));
+  if (!table)
+    return -1;
+
+  nw_traffic_flow_count = 0;
+  for (i = 0; i < nw_traffic_flow_capacity; i++) {
+    if (!nw_traffic_flows[i].family ||
+        (prune && (nw_traffic_flows[i].ended || nw_traffic_flows[i].seen != nw_traffic_cycle)))
+      continue;
+    slot = nw_traffic_flow_slot(table, capacity, nw_traffic_flows[i].id);
+    *slot = nw_traffic_flows[i];
+    nw_traffic_flow_count++;
+  }
+
+  free(nw_traffic_flows);
+  nw_traffic_flows = table;
+  nw_traffic_flow_capacity = capacity;
+
+  return 0;
+}
+
+/* Finds or adds a flow, a flow of another client under a reused id starts over. */
+static nw_traffic_flow_t *nw_traffic_flow(const nw_traffic_flow_t *sample) {
+
+  nw_traffic_flow_t *flow = NULL;
+
+  /* Flows without an id can not be followed between cycles. */
+  if (!sample->id)
+    return NULL;
+
+  if (nw_traffic_flow_capacity)
+    flow = nw_traffic_flow_slot(nw_traffic_flows, nw_traffic_flow_capacity, sample->id);
+
+  if (!flow || !flow->family) {
+    /* Keep the load below 3/4, up to the maximum number of flows. */
+    if ((nw_traffic_flow_count + 1) * 4 > nw_traffic_flow_capacity * 3) {
+      if (nw_traffic_flow_count >= NW_TRAFFIC_MAX_FLOWS ||
+          nw_traffic_flow_rehash(nw_traffic_flow_capacity ? nw_traffic_flow_capacity * 2 : 1024, 0) < 0)
+        return NULL;
+      flow = nw_traffic_flow_slot(nw_traffic_flows, nw_traffic_flow_capacity, sample->id);
+    }
+    nw_traffic_flow_count++;
+  } else if (flow->family == sample->family && !memcmp(flow->address, sample->address, 16)) {
+    return flow;
+  }
+
+  memset(flow, 0, sizeof(nw_traffic_flow_t));
+  flow->family = sample->family;
+  memcpy(flow->address, sample->address, 16);
+  flow->id = sample->id;
+
+  return flow;
+}
+
+/* Adds what a flow carried since its previous counters to the traffic of its client. */
+static void nw_traffic_account(nw_traffic_client_t *client, const uint64_t *previous, const uint64_t *counters) {
+
+  size_t j;
+
+  for (j = 0; j < NW_TRAFFIC_COUNTERS; j++) {
+    if (counters[j] > previous[j])
+      client->delta[j] += counters[j] - previous[j];
+  }
+}
+
+static struct nlattr *nw_traffic_nested(struct nlattr *attr, int type) {
+
+  struct nlattr *nested = (struct nlattr *)((char *)attr + NLA_HDRLEN);
+  int length = attr->nla_len - NLA_HDRLEN;
+
+  while (length >= (int)sizeof(struct nlattr) && nested->nla_len >= sizeof(struct nlattr) && nested->nla_len <= length) {
+    if ((nested->nla_type & NLA_TYPE_MASK) == type)
+      return nested;
+    length -= NLA_ALIGN(nested->nla_len);
+    nested = (struct nlattr *)((char *)nested + NLA_ALIGN(nested->nla_len));
+  }
+
+  return NULL;
+}
+
+static uint64_t nw_traffic_u64(struct nlattr *attr) {
+
+  uint64_t value;
+
+  if (!attr || attr->nla_len < NLA_HDRLEN + sizeof(value))
+    return 0;
+
+  memcpy(&value, (char *)attr + NLA_HDRLEN, sizeof(value));
+  return be64toh(value);
+}
+
+/* Extracts the id, client address and counters of a flow, returns -1 if it has no source address. */
+static int nw_traffic_parse_flow(struct nlmsghdr *nlh, nw_traffic_flow_t *flow) {
+
+  struct nlattr *attr, *tuple = NULL, *ip, *source, *id = NULL;
+  struct nlattr *counters_orig = NULL, *counters_reply = NULL;
+  int length = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(struct nfgenmsg));
+  uint32_t value;
+
+  attr = (struct nlattr *)((char *)NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+  while (length >= (int)sizeof(struct nlattr) && attr->nla_len >= sizeof(struct nlattr) && attr->nla_len <= length) {
+    switch (attr->nla_type & NLA_TYPE_MASK) {
+      case CTA_TUPLE_ORIG: tuple = attr; break;
+      case CTA_COUNTERS_ORIG: counters_orig = attr; break;
+      case CTA_COUNTERS_REPLY: counters_reply = attr; break;
+      case CTA_ID: id = attr; break;
+    }
+    length -= NLA_ALIGN(attr->nla_len);
+    attr = (struct nlattr *)((char *)attr + NLA_ALIGN(attr->nla_len));
+  }
+
+  if (!tuple || !(ip = nw_traffic_nested(tuple, CTA_TUPLE_IP)))
+    return -1;
+
+  memset(flow, 0, sizeof(nw_traffic_flow_t));
+  if ((source = nw_traffic_nested(ip, CTA_IP_V4_SRC)) && source->nla_len >= NLA_HDRLEN + 4)
+    flow->family = AF_INET;
+  else if ((source = nw_traffic_nested(ip, CTA_IP_V6_SRC)) && source->nla_len >= NLA_HDRLEN + 16)
+    flow->family = AF_INET6;
+  else
+    return -1;
+  memcpy(flow->address, (char *)source + NLA_HDRLEN, flow->family == AF_INET ? 4 : 16);
+
+  if (id && id->nla_len >= NLA_HDRLEN + sizeof(value)) {
+    memcpy(&value, (char *)id + NLA_HDRLEN, sizeof(value));
+    flow->id = ntohl(value);
+  }
+
+  if (counters_orig) {
+    flow->counters[NW_TRAFFIC_TX_BYTES] = nw_traffic_u64(nw_traffic_nested(counters_orig, CTA_COUNTERS_BYTES));
+    flow->counters[NW_TRAFFIC_TX_PACKETS] = nw_traffic_u64(nw_traffic_nested(counters_orig, CTA_COUNTERS_PACKETS));
+  }
+  if (counters_reply) {
+    flow->counters[NW_TRAFFIC_RX_BYTES] = nw_traffic_u64(nw_traffic_nested(counters_reply, CTA_COUNTERS_BYTES));
+    flow->counters[NW_TRAFFIC_RX_PACKETS] = nw_traffic_u64(nw_traffic_nested(counters_reply, CTA_COUNTERS_PACKETS));
+  }
+
+  return 0;
+}
+
+/* A live flow from the dump. */
+static void nw_traffic_dumped(struct nlmsghdr *nlh) {
+
+  nw_traffic_flow_t sample, *flow;
+  nw_traffic_client_t *client;
+  size_t j;
+
+  if (nw_traffic_parse_flow(nlh, &sample) < 0)
+    return;
+
+  client = nw_traffic_client(sample.family, sample.address);
+  if (!client)
+    return;
+
+  if (client->seen != nw_traffic_cycle) {
+    /* First flow of this cycle. */
+    client->seen = nw_traffic_cycle;
+    client->flows = 0;
+    memset(client->counters, 0, sizeof(client->counters));
+  }
+
+  flow = nw_traffic_flow(&sample);
+  if (flow && flow->ended)
+    return;
+
+  client->flows++;
+  for (j = 0; j < NW_TRAFFIC_COUNTERS; j++)
+    client->counters[j] += sample.counters[j];
+
+  /* Without room to remember the flow its traffic can not be told apart from earlier cycles. */
+  if (!flow)
+    return;
+
+  nw_traffic_account(client, flow->counters, sample.counters);
+  memcpy(flow->counters, sample.counters, sizeof(flow->counters));
+  flow->seen = nw_traffic_cycle;
+}
+
+/* The final counters of a flow that ended. */
+static void nw_traffic_ended(struct nlmsghdr *nlh) {
+
+  static const uint64_t none[NW_TRAFFIC_COUNTERS];
+  nw_traffic_flow_t sample, *flow;
+  nw_traffic_client_t *client;
+
+  if (nw_traffic_parse_flow(nlh, &sample) < 0)
+    return;
+
+  flow = nw_traffic_flow(&sample);
+  if (flow && flow->ended)
+    return;
+
+  client = nw_traffic_client(sample.family, sample.address);
+  if (!client)
+    return;
+
+  /* Flows that started after the last dump count in full. */
+  nw_traffic_account(client, flow ? flow->counters : none, sample.counters);
+  client->active = 1;
+
+  if (flow) {
+    memcpy(flow->counters, sample.counters, sizeof(flow->counters));
+    flow->ended = 1;
+  }
+}
+
+/* Attaches lease details to clients, returns whether there were any leases. */
+static int nw_traffic_join_leases(void) {
+
+  unsigned char address[16];
+  char mac[18], ip_address[46], hostname[65];
+  nw_traffic_client_t *client;
+  unsigned int expiry;
+  int leases = 0, family;
+
+  FILE *file = nw_utils_fopen(nw_traffic_leases, "r");
+  if (!file)
+    return 0;
+
+  while (!feof(file)) {
+    if (fscanf(file, "%u %17s %45s %64s %*[^\n]\n", &expiry, mac, ip_address, hostname) < 3) {
+      if (fscanf(file, "%*[^\n]\n") == EOF)
+        break;
+      continue;
+    }
+
+    memset(address, 0, sizeof(address));
+    if (inet_pton(AF_INET, ip_address, address) == 1)
+      family = AF_INET;
+    else if (inet_pton(AF_INET6, ip_address, address) == 1)
+      family = AF_INET6;
+    else
+      continue;
+    leases = 1;
+
+    if (!nw_traffic_capacity)
+      continue;
+    client = nw_traffic_slot(nw_traffic_clients, nw_traffic_capacity, family, address);
+    if (!client->family)
+      continue;
+
+    snprintf(client->mac, sizeof(client->mac), "%s", mac);
+    snprintf(client->hostname, sizeof(client->hostname), "%s", hostname);
+  }
+  fclose(file);
+
+  return leases;
+}
+
+static int nw_traffic_finish(struct nw_traffic_dump_s *dump) {
+
+  json_object *object = json_object_new_object();
+  json_object *clients = json_object_new_object();
+  uint64_t now = nw_stats_clock_us(CLOCK_MONOTONIC);
+  char host[INET6_ADDRSTRLEN];
+  unsigned int unmatched = 0;
+  size_t i, j;
+  int leases;
+
+  dump->pending = 0;
+
+  for (i = 0; i < nw_traffic_capacity; i++) {
+    nw_traffic_client_t *client = &nw_traffic_clients[i];
+
+    client->mac[0] = 0;
+    client->hostname[0] = 0;
+    if (client->family && client->seen != nw_traffic_cycle) {
+      /* Only ended flows since the last cycle. */
+      client->flows = 0;
+      memset(client->counters, 0, sizeof(client->counters));
+    }
+  }
+  leases = nw_traffic_join_leases();
+
+  for (i = 0; i < nw_traffic_capacity; i++) {
+    nw_traffic_client_t *client = &nw_traffic_clients[i];
+
+    if (!client->family || (client->seen != nw_traffic_cycle && !client->active))
+      continue;
+    client->reported = nw_traffic_cycle;
+
+    if (leases && !client->mac[0]) {
+      unmatched += client->flows;
+      memset(client->delta, 0, sizeof(client->delta));
+      client->active = 0;
+      client->time = now;
+      continue;
+    }
+
+    json_object *entry = json_object_new_object();
+    if (client->mac[0]) {
+      json_object_object_add(entry, "mac", json_object_new_string(client->mac));
+      json_object_object_add(entry, "hostname", json_object_new_string(client->hostname));
+    }
+    json_object_object_add(entry, "flows", json_object_new_int(client->flows));
+    for (j = 0; j < NW_TRAFFIC_COUNTERS; j++)
+      json_object_object_add(entry, nw_traffic_counter_names[j], json_object_new_int64(client->counters[j]));
+
+    if (client->time && now > client->time) {
+      json_object *rates = json_object_new_object();
+      double elapsed = (now - client->time) / 1000000.0;
+
+      for (j = 0; j < NW_TRAFFIC_COUNTERS; j++)
+        json_object_object_add(rates, nw_traffic_counter_names[j], json_object_new_double(client->delta[j] / elapsed));
+      json_object_object_add(entry, "rates", rates);
+    }
+
+    memset(client->delta, 0, sizeof(client->delta));
+    client->active = 0;
+    client->time = now;
+
+    inet_ntop(client->family, client->address, host, sizeof(host));
+    json_object_object_add(clients, host, entry);
+  }
+
+  json_object_object_add(object, "clients", clients);
+  if (leases)
+    json_object_object_add(object, "unmatched_flows", json_object_new_int(unmatched));
+
+  /* Drop clients without traffic and flows that ended or are gone. */
+  if (nw_traffic_capacity)
+    nw_traffic_rehash(nw_traffic_capacity, 1);
+  if (nw_traffic_flow_capacity)
+    nw_traffic_flow_rehash(nw_traffic_flow_capacity, 1);
+
+  return nw_module_finish_acquire_data(dump->module, object);
+}
+
+static int nw_traffic_connect(struct nw_traffic_dump_s *dump) {
+
+  lu_fdn_t fdn;
+  int size = NW_TRAFFIC_BUFFER_SIZE * 4;
+
+  fdn.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_NETFILTER);
+  if (fdn.fd < 0)
+    return -1;
+
+  /* Leave room for a few buffers of flows while other tasks run. */
+  setsockopt(fdn.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  fdn.recv = nw_traffic_recv;
+  fdn.options = LS_READ;
+  fdn.data = dump;
+  dump->fdn = lu_fd_add(&fdn);
+
+  return 0;
+}
+
+static void nw_traffic_disconnect(struct nw_traffic_dump_s *dump) {
+
+  int fd;
+
+  if (!dump->fdn)
+    return;
+
+  fd = dump->fdn->fd;
+  lu_fd_del(dump->fdn);
+  close(fd);
+  dump->fdn = NULL;
+}
+
+static void nw_traffic_process(struct nw_traffic_dump_s *dump) {
+
+  static char buffer[NW_TRAFFIC_BUFFER_SIZE];
+  struct nlmsghdr *nlh;
+  ssize_t length;
+
+  /* One buffer per dispatch, so a large table does not hold up the loop. */
+  length = recv(dump->fdn->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+  if (length < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return;
+    if (!dump->pending)
+      return;
+
+    syslog(LOG_WARNING, "%s: Connection tracking dump failed: %m", dump->module->name);
+    nw_traffic_disconnect(dump);
+    nw_traffic_connect(dump);
+    dump->pending = 0;
+    nw_module_finish_acquire_data(dump->module, NULL);
+    return;
+  }
+
+  for (nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, length); nlh = NLMSG_NEXT(nlh, length)) {
+    if (!dump->pending || nlh->nlmsg_seq != dump->seq)
+      continue;
+
+    if (nlh->nlmsg_type == NLMSG_DONE) {
+      nw_traffic_finish(dump);
+      return;
+    }
+    if (nlh->nlmsg_type == NLMSG_ERROR) {
+      dump->pending = 0;
+      nw_module_finish_acquire_data(dump->module, NULL);
+      return;
+    }
+    if (NFNL_MSG_TYPE(nlh->nlmsg_type) == IPCTNL_MSG_CT_NEW)
+      nw_traffic_dumped(nlh);
+  }
+}
+
+static void nw_traffic_event_recv(void *arg) {
+
+  static char buffer[NW_TRAFFIC_BUFFER_SIZE];
+  static int warned = 0;
+  struct nlmsghdr *nlh;
+  ssize_t length;
+
+  UNUSED(arg);
+
+  length = recv(nw_traffic_events->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+  if (length < 0) {
+    if (errno == ENOBUFS && !warned) {
+      syslog(LOG_WARNING, "core.traffic: Missed flow destroy events, traffic of some ended flows is not counted.");
+      warned = 1;
+    }
+    return;
+  }
+
+  for (nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, length); nlh = NLMSG_NEXT(nlh, length)) {
+    if (NFNL_MSG_TYPE(nlh->nlmsg_type) == IPCTNL_MSG_CT_DELETE)
+      nw_traffic_ended(nlh);
+  }
+}
+
+/* Subscribes to destroy events, which carry the final counters of flows. */
+static int nw_traffic_subscribe(void) {
+
+  struct sockaddr_nl address;
+  lu_fdn_t fdn;
+  int group = NFNLGRP_CONNTRACK_DESTROY;
+  int size = NW_TRAFFIC_BUFFER_SIZE * 4;
+
+  fdn.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_NETFILTER);
+  if (fdn.fd < 0)
+    return -1;
+
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+  if (bind(fdn.fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      setsockopt(fdn.fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+    close(fdn.fd);
+    return -1;
+  }
+  setsockopt(fdn.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  fdn.recv = nw_traffic_event_recv;
+  fdn.options = LS_READ;
+  fdn.data = NULL;
+  nw_traffic_events = lu_fd_add(&fdn);
+
+  return 0;
+}
+
+static void nw_traffic_recv(void *arg) {
+
+  uint64_t span = nw_trace_begin();
+
+  nw_traffic_process((struct nw_traffic_dump_s *)arg);
+  nw_trace_end("core.traffic recv", "fd", span);
+}
+
+static int nw_traffic_start_acquire_data(nodewatcher_module_t *module) {
+
+  struct {
+    struct nlmsghdr nlh;
+    struct nfgenmsg nfg;
+  } request;
+  struct sockaddr_nl address;
+
+  if (nw_traffic_dump.pending)
+    return -1;
+
+  if (!nw_traffic_dump.fdn && nw_traffic_connect(&nw_traffic_dump) < 0) {
+    syslog(LOG_WARNING, "%s: Could not create ctnetlink socket.", module->name);
+    return nw_module_finish_acquire_data(module, NULL);
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+  request.nlh.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+  request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.nlh.nlmsg_seq = ++nw_traffic_dump.seq;
+  request.nfg.nfgen_family = AF_UNSPEC;
+  request.nfg.version = NFNETLINK_V0;
+
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+
+  if (sendto(nw_traffic_dump.fdn->fd, &request, request.nlh.nlmsg_len, 0, (struct sockaddr *)&address,
+      sizeof(address)) < 0) {
+    syslog(LOG_WARNING, "%s: Could not request connection tracking dump.", module->name);
+    return nw_module_finish_acquire_data(module, NULL);
+  }
+
+  nw_traffic_cycle++;
+  nw_traffic_dump.pending = 1;
+
+  return 0;
+}
+
+static void nw_traffic_cancel_acquire_data(nodewatcher_module_t *module) {
+
+  UNUSED(module);
+
+  /* A new dump can not start while the kernel is still sending this one. */
+  nw_traffic_dump.pending = 0;
+  nw_traffic_disconnect(&nw_traffic_dump);
+}
+
+static json_object *nw_traffic_save_state(nodewatcher_module_t *module) {
+
+  json_object *state, *clients, *flows, *sample;
+  char host[INET6_ADDRSTRLEN];
+  size_t i, j;
+
+  UNUSED(module);
+
+  if (!nw_traffic_count)
+    return NULL;
+
+  /* Clients with the time of their last report and traffic since, flows with their counters. */
+  clients = json_object_new_object();
+  for (i = 0; i < nw_traffic_capacity; i++) {
+    nw_traffic_client_t *client = &nw_traffic_clients[i];
+
+    if (!client->family || !client->time)
+      continue;
+
+    sample = json_object_new_array();
+    json_object_array_add(sample, json_object_new_int64(client->time));
+    for (j = 0; j < NW_TRAFFIC_COUNTERS; j++)
+      json_object_array_add(sample, json_object_new_int64(client->delta[j]));
+    inet_ntop(client->family, client->address, host, sizeof(host));
+    json_object_object_add(clients, host, sample);
+  }
+
+  flows = json_object_new_array();
+  for (i = 0; i < nw_traffic_flow_capacity; i++) {
+    nw_traffic_flow_t *flow = &nw_traffic_flows[i];
+
+    if (!flow->family || flow->ended)
+      continue;
+
+    sample = json_object_new_array();
+    inet_ntop(flow->family, flow->address, host, sizeof(host));
+    json_object_array_add(sample, json_object_new_string(host));
+    json_object_array_add(sample, json_object_new_int64(flow->id));
+    for (j = 0; j < NW_TRAFFIC_COUNTERS; j++)
+      json_object_array_add(sample, json_object_new_int64(flow->counters[j]));
+    json_object_array_add(flows, sample);
+  }
+
+  state = json_object_new_object();
+  json_object_object_add(state, "clients", clients);
+  json_object_object_add(state, "flows", flows);
+
+  return state;
+}
+
+static int nw_traffic_parse_address(const char *host, nw_traffic_flow_t *sample) {
+
+  memset(sample, 0, sizeof(nw_traffic_flow_t));
+  if (inet_pton(AF_INET, host, sample->address) == 1)
+    sample->family = AF_INET;
+  else if (inet_pton(AF_INET6, host, sample->address) == 1)
+    sample->family = AF_INET6;
+  else
+    return -1;
+
+  return 0;
+}
+
+static void nw_traffic_restore_state(nodewatcher_module_t *module, json_object *state) {
+
+  json_object *clients, *flows, *entry;
+  nw_traffic_client_t *client;
+  nw_traffic_flow_t sample, *flow;
+  size_t i, j;
+
+  UNUSED(module);
+
+  if (!json_object_object_get_ex(state, "clients", &clients) || !json_object_is_type(clients, json_type_object) ||
+      !json_object_object_get_ex(state, "flows", &flows) || !json_object_is_type(flows, json_type_array))
+    return;
+
+  json_object_object_foreach(clients, host, value) {
+    if (!json_object_is_type(value, json_type_array) || json_object_array_length(value) != 1 + NW_TRAFFIC_COUNTERS ||
+        nw_traffic_parse_address(host, &sample) < 0 || !(client = nw_traffic_client(sample.family, sample.address)))
+      continue;
+
+    client->time = json_object_get_int64(json_object_array_get_idx(value, 0));
+    for (j = 0; j < NW_TRAFFIC_COUNTERS; j++) {
+      client->delta[j] = json_object_get_int64(json_object_array_get_idx(value, j + 1));
+      if (client->delta[j])
+        client->active = 1;
+    }
+  }
+
+  /* Flows that are gone by the first dump are dropped when it finishes. */
+  for (i = 0; i < json_object_array_length(flows); i++) {
+    entry = json_object_array_get_idx(flows, i);
+    if (!json_object_is_type(entry, json_type_array) || json_object_array_length(entry) != 2 + NW_TRAFFIC_COUNTERS ||
+        nw_traffic_parse_address(json_object_get_string(json_object_array_get_idx(entry, 0)), &sample) < 0)
+      continue;
+
+    sample.id = json_object_get_int64(json_object_array_get_idx(entry, 1));
+    if (!(flow = nw_traffic_flow(&sample)))
+      break;
+    for (j = 0; j < NW_TRAFFIC_COUNTERS; j++)
+      flow->counters[j] = json_object_get_int64(json_object_array_get_idx(entry, j + 2));
+  }
+}
+
+static int nw_traffic_init(nodewatcher_module_t *module) {
+
+  char c;
+
+  while ((c = lu_getopt(module->args, "l:")) != EOF) {
+    switch (c) {
+      case 'l':
+        if (nw_traffic_leases)
+          free(nw_traffic_leases);
+        nw_traffic_leases = strdup(lu_getarg());
+        break;
+    }
+  }
+
+  if (!nw_traffic_leases)
+    nw_traffic_leases = strdup(DEFAULT_DHCPLEASES_FILENAME);
+
+  /* Flows only carry byte and packet counters with accounting enabled. */
+  FILE *file = nw_utils_fopen("/proc/sys/net/netfilter/nf_conntrack_acct", "r+");
+  if (file) {
+    if (fgetc(file) == '0') {
+      rewind(file);
+      fputs("1\n", file);
+      syslog(LOG_INFO, "Module %s: Enabled connection tracking accounting.", module->name);
+    }
+    fclose(file);
+  }
+
+  memset(&nw_traffic_dump, 0, sizeof(nw_traffic_dump));
+  nw_traffic_dump.module = module;
+
+  if (nw_traffic_subscribe() < 0)
+    syslog(LOG_WARNING, "Module %s: Could not subscribe to flow events, flows ending between cycles are not counted.",
+      module->name);
+
+  return 0;
+}
+
+static void nw_traffic_cleanup(nodewatcher_module_t *module) {
+
+  int fd;
+
+  UNUSED(module);
+
+  nw_traffic_disconnect(&nw_traffic_dump);
+  if (nw_traffic_events) {
+    fd = nw_traffic_events->fd;
+    lu_fd_del(nw_traffic_events);
+    close(fd);
+    nw_traffic_events = NULL;
+  }
+
+  free(nw_traffic_clients);
+  nw_traffic_clients = NULL;
+  nw_traffic_capacity = 0;
+  nw_traffic_count = 0;
+
+  free(nw_traffic_flows);
+  nw_traffic_flows = NULL;
+  nw_traffic_flow_capacity = 0;
+  nw_traffic_flow_count = 0;
+
+  free(nw_traffic_leases);
+  nw_traffic_leases = NULL;
+}
+
+/* Module descriptor. */
+MODULE_DESC = {
+  .name = "core.traffic",
+  .author = "jaka@live.jp",
+  .version = 1,
+  .hooks = {
+    .init = nw_traffic_init,
+    .start_acquire_data = nw_traffic_start_acquire_data,
+    .cancel_acquire_data = nw_traffic_cancel_acquire_data,
+    .cleanup = nw_traffic_cleanup,
+    .save_state = nw_traffic_save_state,
+    .restore_state = nw_traffic_restore_state,
+  },
+  .schedule = {
+    .refresh_interval = 60,
+  },
+};
@@ -1,11 +1,78 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <libre/scheduler.h>
 
+#include "accounting.h"
+#include "control.h"
+#include "exporter.h"
+#include "history.h"
 #include "modules.h"
+#include "rules.h"
+#include "snapshot.h"
+#include "state.h"
+#include "trace.h"
 #include "node-agent.h"
 
+/* Self-pipe through which SIGTERM and SIGINT end the agent from within the event loop. */
+static int term_pipe[2] = { -1, -1 };
+
+static void nw_agent_sigterm(int signal) {
+
+  int saved_errno = errno;
+
+  UNUSED(signal);
+
+  if (write(term_pipe[1], "", 1) < 0) {
+    /* Termination is already pending. */
+  }
+  errno = saved_errno;
+}
+
+static void nw_agent_term_recv(void *arg) {
+
+  UNUSED(arg);
+
+  syslog(LOG_INFO, "Terminating.");
+  nw_state_save();
+  /* Exit hooks (e.g. of the snapshot) run from here. */
+  exit(0);
+}
+
+static void nw_agent_watch_sigterm(void) {
+
+  lu_fdn_t fdn;
+  struct sigaction action;
+
+  if (pipe(term_pipe) < 0) {
+    syslog(LOG_WARNING, "Unable to create termination pipe, SIGTERM ends the agent without cleanup.");
+    return;
+  }
+
+  fcntl(term_pipe[0], F_SETFL, fcntl(term_pipe[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(term_pipe[1], F_SETFL, fcntl(term_pipe[1], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(term_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(term_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  fdn.fd = term_pipe[0];
+  fdn.recv = nw_agent_term_recv;
+  fdn.options = LS_READ;
+  fdn.data = NULL;
+  lu_fd_add(&fdn);
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = nw_agent_sigterm;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+}
+
 int main(int argc, char **argv) {
 
   char c;
@@ -24,12 +91,25 @@ int main(int argc, char **argv) {
   openlog(APP, log_option, LOG_DAEMON);
 
   lu_init();
+  nw_agent_watch_sigterm();
+
+  nw_trace_init(&args);
+
+  /* Map the saved state before modules are initialized, so they can start from it. */
+  nw_state_init(&args);
+  nw_history_init(&args);
+  nw_rules_init(&args);
+  nw_accounting_init(&args);
 
   if (nw_module_init(&args) < 0) {
     fprintf(stderr, "ERROR: Failed to initialize modules!\n");
     return 1;
   }
 
+  nw_control_init(&args);
+  nw_exporter_init(&args);
+  nw_snapshot_init(&args);
+
   if ((log_option & LOG_PERROR) == LOG_PERROR && daemon(1, 0)) {
     fprintf(stderr, "ERROR: Failed to daemonize, exit: %m\n");
     return 1;
@@ -0,0 +1,61 @@
+/*
+ * Prints module data from the snapshot the agent publishes with -Z, for use
+ * by scripts:
+ *
+ *   nw-snapshot <path> [<module>]
+ *
+ * Without a module, data of all modules is printed as one object.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot-reader.h"
+
+int main(int argc, char **argv) {
+
+  nw_snapshot_reader_t *reader;
+  const char *module = argc > 2 ? argv[2] : NULL;
+  size_t size = 65536;
+  char *buffer = NULL, *grown;
+  ssize_t ret;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <path> [<module>]\n", argv[0]);
+    return 2;
+  }
+
+  reader = nw_snapshot_reader_open(argv[1]);
+  if (!reader) {
+    fprintf(stderr, "ERROR: Unable to open snapshot '%s': %m\n", argv[1]);
+    return 1;
+  }
+
+  for (;;) {
+    grown = realloc(buffer, size);
+    if (!grown) {
+      ret = -ENOMEM;
+      break;
+    }
+    buffer = grown;
+
+    ret = nw_snapshot_reader_read(reader, module, buffer, size, NULL);
+    if (ret < 0 || (size_t)ret < size)
+      break;
+    size = ret + 1;
+  }
+
+  if (ret == -ENOENT)
+    fprintf(stderr, "ERROR: Module '%s' is not in the snapshot.\n", module);
+  else if (ret < 0)
+    fprintf(stderr, "ERROR: Unable to read snapshot '%s': %s\n", argv[1], strerror(-ret));
+  else
+    printf("%s\n", buffer);
+
+  free(buffer);
+  nw_snapshot_reader_close(reader);
+
+  return ret < 0 ? 1 : 0;
+}
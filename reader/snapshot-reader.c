@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot-format.h"
+#include "snapshot-reader.h"
+
+/* Attempts at a consistent copy before giving up. */
+#define NW_SNAPSHOT_READER_RETRIES 1000
+
+struct nw_snapshot_reader {
+  char *path;
+  int fd;
+  const uint8_t *map;
+  size_t size;
+};
+
+static void nw_snapshot_reader_unmap(nw_snapshot_reader_t *reader) {
+
+  if (reader->map)
+    munmap((void *)reader->map, reader->size);
+  if (reader->fd >= 0)
+    close(reader->fd);
+
+  reader->map = NULL;
+  reader->size = 0;
+  reader->fd = -1;
+}
+
+/* Maps the file currently at the path, a new one once the agent has replaced it. */
+static int nw_snapshot_reader_map(nw_snapshot_reader_t *reader) {
+
+  const nodewatcher_snapshot_header_t *header;
+  struct stat s;
+  void *map;
+
+  nw_snapshot_reader_unmap(reader);
+
+  reader->fd = open(reader->path, O_RDONLY | O_CLOEXEC);
+  if (reader->fd < 0)
+    return -errno;
+
+  if (fstat(reader->fd, &s) < 0 || s.st_size < NW_SNAPSHOT_HEADER_SIZE) {
+    nw_snapshot_reader_unmap(reader);
+    return -EINVAL;
+  }
+
+  map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+  if (map == MAP_FAILED) {
+    nw_snapshot_reader_unmap(reader);
+    return -EINVAL;
+  }
+  reader->map = map;
+  reader->size = s.st_size;
+
+  header = (const nodewatcher_snapshot_header_t *)map;
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != NW_SNAPSHOT_MAGIC)
+    return -ESTALE;
+  if (header->version != NW_SNAPSHOT_VERSION) {
+    nw_snapshot_reader_unmap(reader);
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+/* Extends the mapping after the agent has grown the file. */
+static int nw_snapshot_reader_cover(nw_snapshot_reader_t *reader, uint64_t end) {
+
+  struct stat s;
+  void *map;
+
+  /* Offsets from a torn read may point past the end of the file. */
+  if (fstat(reader->fd, &s) < 0 || (uint64_t)s.st_size < end)
+    return -EAGAIN;
+
+  map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+  if (map == MAP_FAILED)
+    return -errno;
+
+  munmap((void *)reader->map, reader->size);
+  reader->map = map;
+  reader->size = s.st_size;
+
+  return 0;
+}
+
+nw_snapshot_reader_t *nw_snapshot_reader_open(const char *path) {
+
+  nw_snapshot_reader_t *reader = calloc(1, sizeof(nw_snapshot_reader_t));
+  int ret = -ENOMEM;
+
+  if (!reader)
+    return NULL;
+
+  reader->fd = -1;
+  reader->path = strdup(path);
+  if (!reader->path || (ret = nw_snapshot_reader_map(reader)) < 0) {
+    nw_snapshot_reader_close(reader);
+    errno = -ret;
+    return NULL;
+  }
+
+  return reader;
+}
+
+static int nw_snapshot_reader_compare(const char *module, const uint8_t *name, uint32_t length) {
+
+  int cmp = strncmp(module, (const char *)name, length);
+
+  if (!cmp && module[length])
+    return 1;
+
+  return cmp;
+}
+
+/* Copies out of a buffer that may change meanwhile, so everything read is checked before use. */
+static ssize_t nw_snapshot_reader_copy(const uint8_t *base, uint64_t length, uint32_t count, const char *module,
+                                       char *buffer, size_t size) {
+
+  const nodewatcher_snapshot_entry_t *index = (const nodewatcher_snapshot_entry_t *)base;
+  nodewatcher_snapshot_entry_t entry;
+  uint32_t low = 0, high = count, middle;
+  size_t total, position;
+  int cmp;
+
+  if ((uint64_t)count * sizeof(nodewatcher_snapshot_entry_t) > length)
+    return -EINVAL;
+
+  if (!module) {
+    /* All modules, as one object keyed by module name. */
+    total = 2 + (count ? count - 1 : 0);
+    for (middle = 0; middle < count; middle++) {
+      entry = index[middle];
+      if ((uint64_t)entry.name_offset + entry.name_length > length ||
+          (uint64_t)entry.data_offset + entry.data_length > length)
+        return -EINVAL;
+      total += entry.name_length + 3 + entry.data_length;
+    }
+    if (total >= size)
+      return total;
+
+    position = 0;
+    buffer[position++] = '{';
+    for (middle = 0; middle < count; middle++) {
+      entry = index[middle];
+      if ((uint64_t)entry.name_offset + entry.name_length > length ||
+          (uint64_t)entry.data_offset + entry.data_length > length ||
+          position + entry.name_length + entry.data_length + 6 > size)
+        return -EINVAL;
+
+      if (middle)
+        buffer[position++] = ',';
+      buffer[position++] = '"';
+      memcpy(buffer + position, base + entry.name_offset, entry.name_length);
+      position += entry.name_length;
+      buffer[position++] = '"';
+      buffer[position++] = ':';
+      memcpy(buffer + position, base + entry.data_offset, entry.data_length);
+      position += entry.data_length;
+    }
+    buffer[position++] = '}';
+    buffer[position] = 0;
+    return position;
+  }
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    entry = index[middle];
+    if ((uint64_t)entry.name_offset + entry.name_length > length)
+      return -EINVAL;
+
+    cmp = nw_snapshot_reader_compare(module, base + entry.name_offset, entry.name_length);
+    if (!cmp) {
+      if ((uint64_t)entry.data_offset + entry.data_length > length)
+        return -EINVAL;
+      if (entry.data_length < size) {
+        memcpy(buffer, base + entry.data_offset, entry.data_length);
+        buffer[entry.data_length] = 0;
+      }
+      return entry.data_length;
+    }
+
+    if (cmp < 0)
+      high = middle;
+    else
+      low = middle + 1;
+  }
+
+  return -ENOENT;
+}
+
+ssize_t nw_snapshot_reader_read(nw_snapshot_reader_t *reader, const char *module, char *buffer, size_t size,
+                                int64_t *updated) {
+
+  const nodewatcher_snapshot_header_t *header;
+  const nodewatcher_snapshot_buffer_t *current;
+  uint64_t offset, length;
+  uint32_t sequence, count;
+  int64_t stamp;
+  ssize_t ret;
+  int attempt;
+
+  for (attempt = 0; attempt < NW_SNAPSHOT_READER_RETRIES; attempt++) {
+    if (!reader->map && (ret = nw_snapshot_reader_map(reader)) < 0)
+      return ret;
+
+    header = (const nodewatcher_snapshot_header_t *)reader->map;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != NW_SNAPSHOT_MAGIC) {
+      /* The agent has exited or replaced the file, follow it to the new one. */
+      if ((ret = nw_snapshot_reader_map(reader)) < 0)
+        return ret;
+      continue;
+    }
+
+    current = &header->buffers[__atomic_load_n(&header->active, __ATOMIC_ACQUIRE) & 1];
+    sequence = __atomic_load_n(&current->sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1)
+      continue;
+
+    offset = __atomic_load_n(&current->offset, __ATOMIC_RELAXED);
+    length = __atomic_load_n(&current->length, __ATOMIC_RELAXED);
+    count = __atomic_load_n(&current->count, __ATOMIC_RELAXED);
+    stamp = __atomic_load_n(&current->updated, __ATOMIC_RELAXED);
+
+    if (offset < NW_SNAPSHOT_HEADER_SIZE || offset + length < offset || offset + length > reader->size) {
+      if ((ret = nw_snapshot_reader_cover(reader, offset + length)) < 0 && ret != -EAGAIN)
+        return ret;
+      continue;
+    }
+
+    ret = nw_snapshot_reader_copy(reader->map + offset, length, count, module, buffer, size);
+
+    /* The copy is only good if the buffer was not rewritten meanwhile. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&current->sequence, __ATOMIC_RELAXED) != sequence)
+      continue;
+
+    if (updated)
+      *updated = stamp;
+    return ret;
+  }
+
+  return -EAGAIN;
+}
+
+void nw_snapshot_reader_close(nw_snapshot_reader_t *reader) {
+
+  if (!reader)
+    return;
+
+  nw_snapshot_reader_unmap(reader);
+  free(reader->path);
+  free(reader);
+}
@@ -0,0 +1,28 @@
+#ifndef NODEWATCHER_SNAPSHOT_READER_H
+#define NODEWATCHER_SNAPSHOT_READER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Reader of the snapshot the agent publishes with -Z. The file is mapped once
+ * and reads copy out of the mapping without system calls, other than to follow
+ * the snapshot when it grows or the agent is restarted.
+ */
+
+typedef struct nw_snapshot_reader nw_snapshot_reader_t;
+
+/* Returns NULL and sets errno on failure. */
+nw_snapshot_reader_t *nw_snapshot_reader_open(const char *path);
+/*
+ * Copies the JSON data of a module, or of all modules when module is NULL, to
+ * the buffer and NUL terminates it. Returns the length of the data, nothing is
+ * copied when it is not smaller than size. Errors are negative errno values:
+ * -ENOENT for an unknown module, -ESTALE when the agent has exited and -EAGAIN
+ * when no consistent copy could be made.
+ */
+ssize_t nw_snapshot_reader_read(nw_snapshot_reader_t *reader, const char *module, char *buffer, size_t size,
+                                int64_t *updated);
+void nw_snapshot_reader_close(nw_snapshot_reader_t *reader);
+
+#endif